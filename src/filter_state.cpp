@@ -0,0 +1,393 @@
+#include "filter_state.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <fstream>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+const char MAGIC[8] = { 'E', 'D', 'L', 'O', 'C', 'S', 'T', 'A' };
+const uint32_t VERSION = 1;
+
+struct Header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // to detect layout differences
+    uint64_t file_size;
+
+    uint32_t num_samples;
+    uint32_t has_odom_pose;
+    double odom_pose[3];        // x, y, yaw
+
+    double cross_section_height;
+    uint32_t num_entities;
+    uint32_t num_lines;
+    uint32_t num_id_chars;
+
+    int32_t field_width;
+    int32_t field_height;
+    uint32_t padding;
+    double field_origin[2];
+    double field_resolution;
+    double field_max_distance;
+
+    // Byte offsets of the arrays, from the start of the file
+    uint64_t samples_offset;
+    uint64_t entities_offset;
+    uint64_t lines_offset;
+    uint64_t distances_offset;
+    uint64_t ids_offset;
+};
+
+struct SampleRecord
+{
+    float x, y, yaw, weight;
+};
+
+struct EntityRecord
+{
+    double t[3];
+    double R[9];                // row-wise
+    double checksum;
+    int32_t shape_revision;
+    uint32_t num_points;
+    uint32_t id_offset;         // in the id characters (ids are null-terminated)
+    uint32_t first_line;
+    uint32_t num_lines;
+    uint32_t padding;
+};
+
+struct LineRecord
+{
+    float x1, y1, x2, y2;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+uint64_t align(uint64_t offset)
+{
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void writePadding(std::ofstream& out, uint64_t& offset)
+{
+    static const char zeros[8] = { 0 };
+    uint64_t aligned = align(offset);
+    out.write(zeros, aligned - offset);
+    offset = aligned;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FilterState::FilterState()
+{
+    clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FilterState::~FilterState()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FilterState::clear()
+{
+    sample_poses.clear();
+    sample_weights.clear();
+    has_odom_pose = false;
+    odom_x = odom_y = odom_yaw = 0;
+    cross_section_height = -1;
+    entities.clear();
+    field_origin = geo::Vec2(0, 0);
+    field_resolution = 0;
+    field_max_distance = 0;
+    field_width = 0;
+    field_height = 0;
+    field_distances.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FilterState::save(const std::string& filename, std::string& error) const
+{
+    Header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, MAGIC, sizeof(MAGIC));
+    h.version = VERSION;
+    h.header_size = sizeof(Header);
+
+    h.num_samples = sample_poses.size();
+    h.has_odom_pose = has_odom_pose;
+    h.odom_pose[0] = odom_x;
+    h.odom_pose[1] = odom_y;
+    h.odom_pose[2] = odom_yaw;
+
+    h.cross_section_height = cross_section_height;
+    h.num_entities = entities.size();
+    for(unsigned int i = 0; i < entities.size(); ++i)
+    {
+        h.num_lines += entities[i].lines_start.size();
+        h.num_id_chars += entities[i].id.size() + 1;
+    }
+
+    h.field_width = field_width;
+    h.field_height = field_height;
+    h.field_origin[0] = field_origin.x;
+    h.field_origin[1] = field_origin.y;
+    h.field_resolution = field_resolution;
+    h.field_max_distance = field_max_distance;
+
+    if (field_distances.size() != (uint64_t)field_width * field_height)
+    {
+        error = "Likelihood field size does not match its dimensions.";
+        return false;
+    }
+
+    h.samples_offset = align(sizeof(Header));
+    h.entities_offset = align(h.samples_offset + h.num_samples * sizeof(SampleRecord));
+    h.lines_offset = align(h.entities_offset + h.num_entities * sizeof(EntityRecord));
+    h.distances_offset = align(h.lines_offset + h.num_lines * sizeof(LineRecord));
+    h.ids_offset = align(h.distances_offset + field_distances.size() * sizeof(float));
+    h.file_size = h.ids_offset + h.num_id_chars;
+
+    std::string tmp_filename = filename + ".tmp";
+    std::ofstream out(tmp_filename.c_str(), std::ios::binary | std::ios::trunc);
+    if (!out)
+    {
+        error = "Could not open '" + tmp_filename + "' for writing.";
+        return false;
+    }
+
+    uint64_t offset = sizeof(Header);
+    out.write(reinterpret_cast<const char*>(&h), sizeof(Header));
+
+    // Samples
+    writePadding(out, offset);
+    for(unsigned int i = 0; i < sample_poses.size(); ++i)
+    {
+        SampleRecord r;
+        r.x = sample_poses[i].t.x;
+        r.y = sample_poses[i].t.y;
+        r.yaw = sample_poses[i].rotation();
+        r.weight = i < sample_weights.size() ? sample_weights[i] : 0;
+        out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+    }
+    offset += h.num_samples * sizeof(SampleRecord);
+
+    // Entities
+    writePadding(out, offset);
+    uint32_t id_offset = 0;
+    uint32_t first_line = 0;
+    for(unsigned int i = 0; i < entities.size(); ++i)
+    {
+        const EntityState& e = entities[i];
+        const geo::Pose3D& p = e.pose;
+
+        EntityRecord r;
+        memset(&r, 0, sizeof(r));
+        r.t[0] = p.t.x; r.t[1] = p.t.y; r.t[2] = p.t.z;
+        r.R[0] = p.R.xx; r.R[1] = p.R.xy; r.R[2] = p.R.xz;
+        r.R[3] = p.R.yx; r.R[4] = p.R.yy; r.R[5] = p.R.yz;
+        r.R[6] = p.R.zx; r.R[7] = p.R.zy; r.R[8] = p.R.zz;
+        r.checksum = e.checksum;
+        r.shape_revision = e.shape_revision;
+        r.num_points = e.num_points;
+        r.id_offset = id_offset;
+        r.first_line = first_line;
+        r.num_lines = e.lines_start.size();
+        out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+
+        id_offset += e.id.size() + 1;
+        first_line += r.num_lines;
+    }
+    offset += h.num_entities * sizeof(EntityRecord);
+
+    // Lines
+    writePadding(out, offset);
+    for(unsigned int i = 0; i < entities.size(); ++i)
+    {
+        const EntityState& e = entities[i];
+        for(unsigned int j = 0; j < e.lines_start.size(); ++j)
+        {
+            LineRecord r;
+            r.x1 = e.lines_start[j].x;
+            r.y1 = e.lines_start[j].y;
+            r.x2 = e.lines_end[j].x;
+            r.y2 = e.lines_end[j].y;
+            out.write(reinterpret_cast<const char*>(&r), sizeof(r));
+        }
+    }
+    offset += h.num_lines * sizeof(LineRecord);
+
+    // Distances
+    writePadding(out, offset);
+    if (!field_distances.empty())
+        out.write(reinterpret_cast<const char*>(&field_distances[0]), field_distances.size() * sizeof(float));
+    offset += field_distances.size() * sizeof(float);
+
+    // Ids
+    writePadding(out, offset);
+    for(unsigned int i = 0; i < entities.size(); ++i)
+        out.write(entities[i].id.c_str(), entities[i].id.size() + 1);
+
+    out.close();
+    if (!out)
+    {
+        error = "Could not write '" + tmp_filename + "'.";
+        remove(tmp_filename.c_str());
+        return false;
+    }
+
+    if (rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    {
+        error = "Could not replace '" + filename + "'.";
+        remove(tmp_filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FilterState::load(const std::string& filename, std::string& error)
+{
+    clear();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        error = "Could not open '" + filename + "'.";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(Header))
+    {
+        close(fd);
+        error = "'" + filename + "' is not a localization state file.";
+        return false;
+    }
+
+    uint64_t size = st.st_size;
+    void* map = mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+    {
+        error = "Could not map '" + filename + "'.";
+        return false;
+    }
+
+    const char* data = static_cast<const char*>(map);
+    const Header& h = *reinterpret_cast<const Header*>(data);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Validate the layout
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    bool valid = (memcmp(h.magic, MAGIC, sizeof(MAGIC)) == 0 && h.version == VERSION
+                  && h.header_size == sizeof(Header) && h.file_size == size);
+
+    uint64_t num_distances = valid && h.field_width >= 0 && h.field_height >= 0
+            ? (uint64_t)h.field_width * (uint64_t)h.field_height : 0;
+
+    valid = valid && h.field_width >= 0 && h.field_height >= 0
+            && h.samples_offset + (uint64_t)h.num_samples * sizeof(SampleRecord) <= size
+            && h.entities_offset + (uint64_t)h.num_entities * sizeof(EntityRecord) <= size
+            && h.lines_offset + (uint64_t)h.num_lines * sizeof(LineRecord) <= size
+            && h.distances_offset + num_distances * sizeof(float) <= size
+            && h.ids_offset + h.num_id_chars <= size;
+
+    const EntityRecord* entity_records = reinterpret_cast<const EntityRecord*>(data + h.entities_offset);
+    for(unsigned int i = 0; valid && i < h.num_entities; ++i)
+    {
+        const EntityRecord& r = entity_records[i];
+        valid = (r.id_offset < h.num_id_chars && (uint64_t)r.first_line + r.num_lines <= h.num_lines
+                 && memchr(data + h.ids_offset + r.id_offset, '\0', h.num_id_chars - r.id_offset) != 0);
+    }
+
+    if (!valid)
+    {
+        munmap(map, size);
+        error = "'" + filename + "' is not a valid localization state file (or was written by a different version).";
+        return false;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Copy the contents
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    const SampleRecord* samples = reinterpret_cast<const SampleRecord*>(data + h.samples_offset);
+    sample_poses.resize(h.num_samples);
+    sample_weights.resize(h.num_samples);
+    for(unsigned int i = 0; i < h.num_samples; ++i)
+    {
+        const SampleRecord& r = samples[i];
+        sample_poses[i] = geo::Transform2(r.x, r.y, r.yaw);
+        sample_weights[i] = r.weight;
+    }
+
+    has_odom_pose = h.has_odom_pose;
+    odom_x = h.odom_pose[0];
+    odom_y = h.odom_pose[1];
+    odom_yaw = h.odom_pose[2];
+
+    cross_section_height = h.cross_section_height;
+
+    const LineRecord* lines = reinterpret_cast<const LineRecord*>(data + h.lines_offset);
+    entities.resize(h.num_entities);
+    for(unsigned int i = 0; i < h.num_entities; ++i)
+    {
+        const EntityRecord& r = entity_records[i];
+        EntityState& e = entities[i];
+
+        e.id = data + h.ids_offset + r.id_offset;
+        e.shape_revision = r.shape_revision;
+        e.num_points = r.num_points;
+        e.checksum = r.checksum;
+
+        geo::Pose3D& p = e.pose;
+        p.t = geo::Vector3(r.t[0], r.t[1], r.t[2]);
+        p.R = geo::Mat3(r.R[0], r.R[1], r.R[2], r.R[3], r.R[4], r.R[5], r.R[6], r.R[7], r.R[8]);
+
+        e.lines_start.resize(r.num_lines);
+        e.lines_end.resize(r.num_lines);
+        for(unsigned int j = 0; j < r.num_lines; ++j)
+        {
+            const LineRecord& l = lines[r.first_line + j];
+            e.lines_start[j] = geo::Vec2(l.x1, l.y1);
+            e.lines_end[j] = geo::Vec2(l.x2, l.y2);
+        }
+    }
+
+    field_width = h.field_width;
+    field_height = h.field_height;
+    field_origin = geo::Vec2(h.field_origin[0], h.field_origin[1]);
+    field_resolution = h.field_resolution;
+    field_max_distance = h.field_max_distance;
+
+    const float* distances = reinterpret_cast<const float*>(data + h.distances_offset);
+    field_distances.assign(distances, distances + num_distances);
+
+    munmap(map, size);
+
+    return true;
+}
@@ -0,0 +1,79 @@
+#ifndef ED_LOCALIZATION_FILTER_STATE_H_
+#define ED_LOCALIZATION_FILTER_STATE_H_
+
+#include <geolib/datatypes.h>
+
+#include <string>
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Cached cross section of one entity (see WorldCrossSection)
+struct EntityState
+{
+    std::string id;
+    int shape_revision;
+    geo::Pose3D pose;
+
+    // Number of mesh vertices and sum of their coordinates, to check that the shape did not change
+    unsigned int num_points;
+    double checksum;
+
+    std::vector<geo::Vec2> lines_start;
+    std::vector<geo::Vec2> lines_end;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Snapshot of the localization: the samples, and the map caches of the (first) laser model, such that
+// localization can continue right away after a restart. The caches are only reused if they still match
+// the world model.
+//
+// The file is a fixed size header followed by flat, 8-byte aligned arrays (samples, entities, lines,
+// distances, entity ids), such that it is loaded with a single memory map. Poses are stored in double
+// precision, the samples, segments and distances in single precision. The file is only meant to be read on
+// the machine that wrote it (native byte order).
+
+class FilterState
+{
+
+public:
+
+    FilterState();
+
+    ~FilterState();
+
+    void clear();
+
+    // SAMPLES (in the map frame)
+
+    std::vector<geo::Transform2> sample_poses;
+    std::vector<double> sample_weights;
+
+    // Odom pose (x, y, yaw) at the time of the samples
+    bool has_odom_pose;
+    double odom_x, odom_y, odom_yaw;
+
+    // WORLD CROSS SECTION
+
+    // Negative if there is no cross section
+    double cross_section_height;
+    std::vector<EntityState> entities;
+
+    // LIKELIHOOD FIELD (width and height are 0 if there is no field)
+
+    geo::Vec2 field_origin;
+    double field_resolution;
+    double field_max_distance;
+    int field_width, field_height;
+    std::vector<float> field_distances;
+
+    // Writes to a temporary file that replaces 'filename' once complete, such that a crash while saving
+    // does not destroy the previous state. Returns false (and the reason in 'error') on failure.
+    bool save(const std::string& filename, std::string& error) const;
+
+    bool load(const std::string& filename, std::string& error);
+
+};
+
+#endif
@@ -0,0 +1,319 @@
+#include "global_localizer.h"
+
+#include "world_cross_section.h"
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+GlobalLocalizer::GlobalLocalizer() : sigma_(0.2), angle_step_(5.0 * M_PI / 180), num_levels_(5), num_beams_(60),
+    num_candidates_(500), num_seeds_(10), seed_window_(0.3), seed_step_(0.1), seed_angle_window_(0.1),
+    seed_angle_step_(0.05), best_score_(0), score_outside_(0), num_points_(0)
+{
+    field_.setResolution(0.1);
+    field_.setMaxDistance(1.0);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+GlobalLocalizer::~GlobalLocalizer()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalLocalizer::configure(tue::Configuration config)
+{
+    double resolution;
+    if (config.value("resolution", resolution, tue::config::OPTIONAL))
+    {
+        if (resolution > 0)
+            field_.setResolution(resolution);
+        else
+            config.addError("Global localization resolution must be positive.");
+    }
+
+    double max_distance;
+    if (config.value("max_distance", max_distance, tue::config::OPTIONAL))
+        field_.setMaxDistance(max_distance);
+
+    config.value("sigma", sigma_, tue::config::OPTIONAL);
+    config.value("angle_step", angle_step_, tue::config::OPTIONAL);
+    config.value("num_levels", num_levels_, tue::config::OPTIONAL);
+    config.value("num_beams", num_beams_, tue::config::OPTIONAL);
+
+    int num_candidates;
+    if (config.value("num_candidates", num_candidates, tue::config::OPTIONAL))
+        num_candidates_ = std::max(1, num_candidates);
+
+    int num_seeds;
+    if (config.value("num_seeds", num_seeds, tue::config::OPTIONAL))
+        num_seeds_ = std::max(1, num_seeds);
+
+    config.value("seed_window", seed_window_, tue::config::OPTIONAL);
+    config.value("seed_step", seed_step_, tue::config::OPTIONAL);
+    config.value("seed_angle_window", seed_angle_window_, tue::config::OPTIONAL);
+    config.value("seed_angle_step", seed_angle_step_, tue::config::OPTIONAL);
+
+    if (angle_step_ <= 0 || seed_step_ <= 0 || seed_angle_step_ <= 0)
+        config.addError("Global localization steps must be positive.");
+
+    num_levels_ = std::max(1, std::min(num_levels_, 10));
+
+    // Make sure the score grids are rebuilt with the new settings
+    levels_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalLocalizer::buildLevels()
+{
+    int width = field_.width();
+    int height = field_.height();
+    const std::vector<float>& distances = field_.distances();
+
+    double d_max = field_.maxDistance();
+    score_outside_ = exp(-d_max * d_max / (2 * sigma_ * sigma_));
+
+    levels_.resize(num_levels_);
+
+    // Level 0: score of a single end point in the cell
+    std::vector<float>& level_0 = levels_[0];
+    level_0.resize(distances.size());
+    for(unsigned int i = 0; i < distances.size(); ++i)
+        level_0[i] = exp(-distances[i] * distances[i] / (2 * sigma_ * sigma_));
+
+    // Level k: best score in the block of 2^k x 2^k cells, which is the best of four blocks of level k - 1
+    for(int k = 1; k < num_levels_; ++k)
+    {
+        const std::vector<float>& prev = levels_[k - 1];
+        std::vector<float>& level = levels_[k];
+        level.resize(distances.size());
+
+        int h = 1 << (k - 1);
+
+        for(int y = 0; y < height; ++y)
+        {
+            for(int x = 0; x < width; ++x)
+            {
+                float s = prev[y * width + x];
+
+                if (x + h < width)
+                    s = std::max(s, prev[y * width + x + h]);
+                else
+                    s = std::max(s, score_outside_);
+
+                if (y + h < height)
+                {
+                    s = std::max(s, prev[(y + h) * width + x]);
+                    if (x + h < width)
+                        s = std::max(s, prev[(y + h) * width + x + h]);
+                }
+                else
+                    s = std::max(s, score_outside_);
+
+                level[y * width + x] = s;
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalLocalizer::calculateOffsets(const sensor_msgs::LaserScan& scan, const geo::Transform2& laser_offset,
+                                       bool laser_upside_down)
+{
+    // Collect the end points of all valid beams in the base frame
+    int n = scan.ranges.size();
+    double angle_increment = n > 1 ? (scan.angle_max - scan.angle_min) / (n - 1) : 0;
+
+    std::vector<geo::Vec2> points;
+    for(int i = 0; i < n; ++i)
+    {
+        // If the laser is upside down, the ranges are mirrored (the offset is already mirrored)
+        double r = scan.ranges[laser_upside_down ? n - 1 - i : i];
+        if (!(r > scan.range_min && r < scan.range_max))
+            continue;
+
+        double a = scan.angle_min + i * angle_increment;
+        points.push_back(laser_offset * geo::Vec2(r * cos(a), r * sin(a)));
+    }
+
+    // Evenly subsample to (at most) the configured number of beams
+    std::vector<geo::Vec2> selected;
+    if (num_beams_ > 0 && (int)points.size() > num_beams_)
+    {
+        double step = (double)points.size() / num_beams_;
+        for(int i = 0; i < num_beams_; ++i)
+            selected.push_back(points[(int)(i * step)]);
+    }
+    else
+        selected.swap(points);
+
+    num_points_ = selected.size();
+
+    unsigned int num_angles = (2 * M_PI) / angle_step_ + 0.5;
+    double res_inv = 1.0 / field_.resolution();
+
+    offsets_x_.resize(num_angles * num_points_);
+    offsets_y_.resize(num_angles * num_points_);
+
+    for(unsigned int i_angle = 0; i_angle < num_angles; ++i_angle)
+    {
+        double a = i_angle * angle_step_;
+        double c = cos(a);
+        double s = sin(a);
+
+        int* ox = &offsets_x_[i_angle * num_points_];
+        int* oy = &offsets_y_[i_angle * num_points_];
+
+        // The robot base is in the center of its cell
+        for(int j = 0; j < num_points_; ++j)
+        {
+            const geo::Vec2& p = selected[j];
+            ox[j] = floor((c * p.x - s * p.y) * res_inv + 0.5);
+            oy[j] = floor((s * p.x + c * p.y) * res_inv + 0.5);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+float GlobalLocalizer::score(const std::vector<float>& grid, int x, int y, int i_angle) const
+{
+    int width = field_.width();
+    int height = field_.height();
+
+    const int* ox = &offsets_x_[i_angle * num_points_];
+    const int* oy = &offsets_y_[i_angle * num_points_];
+
+    float s = 0;
+    for(int j = 0; j < num_points_; ++j)
+    {
+        int mx = x + ox[j];
+        int my = y + oy[j];
+
+        if (mx < 0 || my < 0 || mx >= width || my >= height)
+            s += score_outside_;
+        else
+            s += grid[my * width + mx];
+    }
+
+    return s;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalLocalizer::keepBest(std::vector<Candidate>& candidates, unsigned int n)
+{
+    if (candidates.size() <= n)
+        return;
+
+    std::nth_element(candidates.begin(), candidates.begin() + n, candidates.end(), isBetter);
+    candidates.resize(n);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void GlobalLocalizer::localize(const WorldCrossSection& cross_section, const sensor_msgs::LaserScan& scan,
+                               const geo::Transform2& laser_offset, bool laser_upside_down,
+                               std::vector<geo::Transform2>& poses)
+{
+    best_score_ = 0;
+
+    // Only rebuilt if the cross section changed
+    if (field_.update(cross_section) || levels_.empty())
+        buildLevels();
+
+    if (field_.width() == 0)
+        return;
+
+    calculateOffsets(scan, laser_offset, laser_upside_down);
+
+    if (num_points_ == 0)
+        return;
+
+    unsigned int num_angles = offsets_x_.size() / num_points_;
+    double res = field_.resolution();
+    const geo::Vec2& origin = field_.origin();
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Score the coarse grid on the top level
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    // The robot base is assumed to be within the bounds of the cross section
+    int x_min = (cross_section.min().x - origin.x) / res;
+    int y_min = (cross_section.min().y - origin.y) / res;
+    int x_max = (cross_section.max().x - origin.x) / res;
+    int y_max = (cross_section.max().y - origin.y) / res;
+
+    int k = num_levels_ - 1;
+    int step = 1 << k;
+
+    candidates_.clear();
+    for(int y = y_min; y <= y_max; y += step)
+    {
+        for(int x = x_min; x <= x_max; x += step)
+        {
+            for(unsigned int i_angle = 0; i_angle < num_angles; ++i_angle)
+                candidates_.push_back(Candidate(score(levels_[k], x, y, i_angle), x, y, i_angle));
+        }
+
+        // Bound the memory use for large worlds
+        if (candidates_.size() > 16 * num_candidates_)
+            keepBest(candidates_, num_candidates_);
+    }
+
+    keepBest(candidates_, num_candidates_);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Refine the best candidates on the finer levels
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    for(--k; k >= 0; --k)
+    {
+        int h = 1 << k;
+
+        children_.clear();
+        for(unsigned int i = 0; i < candidates_.size(); ++i)
+        {
+            const Candidate& c = candidates_[i];
+            for(int dy = 0; dy <= h; dy += h)
+                for(int dx = 0; dx <= h; dx += h)
+                    children_.push_back(Candidate(score(levels_[k], c.x + dx, c.y + dy, c.i_angle),
+                                                  c.x + dx, c.y + dy, c.i_angle));
+        }
+
+        candidates_.swap(children_);
+        keepBest(candidates_, num_candidates_);
+    }
+
+    std::sort(candidates_.begin(), candidates_.end(), isBetter);
+
+    if (!candidates_.empty())
+        best_score_ = candidates_.front().score / num_points_;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Select the seeds (non-maximum suppression)
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    unsigned int num_poses_before = poses.size();
+
+    for(unsigned int i = 0; i < candidates_.size() && poses.size() - num_poses_before < num_seeds_; ++i)
+    {
+        const Candidate& c = candidates_[i];
+        geo::Vec2 p(origin.x + (c.x + 0.5) * res, origin.y + (c.y + 0.5) * res);
+        double a = c.i_angle * angle_step_;
+
+        bool suppressed = false;
+        for(unsigned int j = num_poses_before; j < poses.size() && !suppressed; ++j)
+        {
+            double da = a - poses[j].rotation();
+            da = atan2(sin(da), cos(da));
+            suppressed = (p - poses[j].t).length() < seed_window_ && std::abs(da) < seed_angle_window_;
+        }
+
+        if (!suppressed)
+            poses.push_back(geo::Transform2(p.x, p.y, a));
+    }
+}
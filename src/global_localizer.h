@@ -0,0 +1,106 @@
+#ifndef ED_LOCALIZATION_GLOBAL_LOCALIZER_H_
+#define ED_LOCALIZATION_GLOBAL_LOCALIZER_H_
+
+#include "likelihood_field.h"
+
+#include <geolib/datatypes.h>
+
+#include <sensor_msgs/LaserScan.h>
+
+#include <tue/config/configuration.h>
+
+#include <vector>
+
+class WorldCrossSection;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Finds the robot pose in the whole world cross section, without a prior estimate. The scan is scored
+// against a pyramid of likelihood fields: level k stores, for every cell, the best score of the
+// 2^k x 2^k block of cells starting at that cell. Scoring a position on level k therefore gives an upper
+// bound of the score of all positions in its block. The search starts with a coarse grid of positions
+// (at every angle step) on the top level, and only the best candidates of every level are split into
+// their four sub-blocks on the next, finer level. The candidates on level 0 are scored exactly.
+
+class GlobalLocalizer
+{
+
+public:
+
+    GlobalLocalizer();
+
+    ~GlobalLocalizer();
+
+    void configure(tue::Configuration config);
+
+    // Appends the (at most num_seeds) best poses of the robot base to 'poses', best first. Poses that are
+    // within the seed window of a better pose are suppressed. 'laser_offset' is the pose of the laser in
+    // the base frame.
+    void localize(const WorldCrossSection& cross_section, const sensor_msgs::LaserScan& scan,
+                  const geo::Transform2& laser_offset, bool laser_upside_down,
+                  std::vector<geo::Transform2>& poses);
+
+    // Score of the best pose of the last search, as a fraction of the number of evaluated beams
+    double best_score() const { return best_score_; }
+
+    // Window (+/- position and angle) and grid steps with which the particles are placed around every seed
+    double seed_window() const { return seed_window_; }
+    double seed_step() const { return seed_step_; }
+    double seed_angle_window() const { return seed_angle_window_; }
+    double seed_angle_step() const { return seed_angle_step_; }
+
+private:
+
+    struct Candidate
+    {
+        Candidate() {}
+
+        Candidate(float score_, int x_, int y_, int i_angle_) : score(score_), x(x_), y(y_), i_angle(i_angle_) {}
+
+        float score;
+        int x, y;       // cell of the robot base
+        int i_angle;
+    };
+
+    static bool isBetter(const Candidate& c1, const Candidate& c2) { return c1.score > c2.score; }
+
+    double sigma_;
+    double angle_step_;
+    int num_levels_;
+    int num_beams_;
+    unsigned int num_candidates_;
+    unsigned int num_seeds_;
+
+    double seed_window_;
+    double seed_step_;
+    double seed_angle_window_;
+    double seed_angle_step_;
+
+    double best_score_;
+
+    LikelihoodField field_;
+
+    // Score grids of all levels (same size as the likelihood field), and the score of any point outside them
+    std::vector<std::vector<float> > levels_;
+    float score_outside_;
+
+    // Cell offsets (relative to the cell of the robot base) of the scan end points, for every angle step
+    int num_points_;
+    std::vector<int> offsets_x_;
+    std::vector<int> offsets_y_;
+
+    std::vector<Candidate> candidates_;
+    std::vector<Candidate> children_;
+
+    void buildLevels();
+
+    void calculateOffsets(const sensor_msgs::LaserScan& scan, const geo::Transform2& laser_offset, bool laser_upside_down);
+
+    float score(const std::vector<float>& grid, int x, int y, int i_angle) const;
+
+    // Keeps the best n candidates, in arbitrary order
+    static void keepBest(std::vector<Candidate>& candidates, unsigned int n);
+
+};
+
+#endif
@@ -1,62 +1,30 @@
 #include "laser_model.h"
 
 #include "particle_filter.h"
-#include <ed/world_model.h>
-#include <ed/entity.h>
-#include <geolib/Shape.h>
+#include "filter_state.h"
 
 #include <tue/profiling/timer.h>
 
-// ----------------------------------------------------------------------------------------------------
-
-class LineRenderResult : public geo::LaserRangeFinder::RenderResult
-{
-
-public:
-
-    LineRenderResult(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end, double max_distance)
-        : geo::LaserRangeFinder::RenderResult(dummy_ranges_),
-          lines_start_(lines_start), lines_end_(lines_end), max_distance_sq_(max_distance * max_distance) {}
-
-    void renderLine(const geo::Vec2& p1, const geo::Vec2& p2)
-    {
-        // Calculate distance to the line
-
-        geo::Vec2 diff = p2 - p1;
-        double line_length_sq = diff.length2();
-
-        double t = p1.dot(diff) / -line_length_sq;
-
-        double distance_sq;
+#include <boost/bind.hpp>
 
-        if (t < 0)
-            distance_sq = p1.length2();
-        else if (t > 1)
-            distance_sq = p2.length2();
-        else
-            distance_sq = (p1 + t * diff).length2();
-
-        // If too far, skip
-        if (distance_sq > max_distance_sq_)
-            return;
-
-        lines_start_.push_back(p1);
-        lines_end_.push_back(p2);
-    }
-
-private:
-
-    std::vector<double> dummy_ranges_;
-    std::vector<geo::Vec2>& lines_start_;
-    std::vector<geo::Vec2>& lines_end_;
-    double max_distance_sq_;
-
-};
+#include <algorithm>
 
 // ----------------------------------------------------------------------------------------------------
 
-LaserModel::LaserModel()
+LaserModel::LaserModel() : type_(BEAM_MODEL), beam_selection_(ALL_BEAMS), adaptive_beam_min_distance_(0.1),
+    do_beam_skip_(false), beam_skip_distance_(0.5), beam_skip_threshold_(0.3), beam_skip_error_threshold_(0.9),
+    num_skipped_beams_(0), do_dynamic_obstacle_rejection_(false), dynamic_obstacle_distance_(0.5),
+    dynamic_obstacle_max_fraction_(0.5), has_reference_pose_(false), num_dynamic_beams_(0), num_samples_(0), num_unique_samples_(0), time_dedup_(0),
+    time_render_(0), time_scoring_(0), beam_combination_(CUBIC_SUM), lookup_table_resolution_(0.02),
+    lookup_table_inv_resolution_(0), lookup_table_size_(0), contiguous_beams_(false), use_opencl_(false), opencl_min_samples_(1000),
+    lookup_table_revision_(0)
 {
+    cross_section_ = &world_cross_section_;
+    current_unique_samples_ = 0;
+
+    // Bound once, such that running the job does not allocate
+    weight_update_job_ = boost::bind(&LaserModel::calculateWeightUpdates, this, _1);
+
     // DEFAULT:
     z_hit = 0.95;
     sigma_hit = 0.2;
@@ -68,6 +36,7 @@ LaserModel::LaserModel()
 
     laser_height_ = 0.3;
     laser_offset_ = geo::Transform2(0.3, 0, 0);
+    cross_section_height_ = laser_height_;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -80,8 +49,64 @@ LaserModel::~LaserModel()
 
 void LaserModel::configure(tue::Configuration config)
 {
+    std::string type;
+    if (config.value("type", type, tue::config::OPTIONAL))
+    {
+        if (type == "beam")
+            type_ = BEAM_MODEL;
+        else if (type == "likelihood_field")
+            type_ = LIKELIHOOD_FIELD_MODEL;
+        else
+            config.addError("Unknown laser model type: '" + type + "'. Options are 'beam' and 'likelihood_field'.");
+    }
+
     config.value("num_beams", num_beams);
 
+    std::string beam_selection;
+    if (config.value("beam_selection", beam_selection, tue::config::OPTIONAL))
+    {
+        if (beam_selection == "all")
+            beam_selection_ = ALL_BEAMS;
+        else if (beam_selection == "valid")
+            beam_selection_ = VALID_BEAMS;
+        else if (beam_selection == "adaptive")
+            beam_selection_ = ADAPTIVE_BEAMS;
+        else
+            config.addError("Unknown beam selection: '" + beam_selection + "'. Options are 'all', 'valid' and 'adaptive'.");
+    }
+
+    config.value("adaptive_beam_min_distance", adaptive_beam_min_distance_, tue::config::OPTIONAL);
+
+    std::string beam_combination;
+    if (config.value("beam_combination", beam_combination, tue::config::OPTIONAL))
+    {
+        if (beam_combination == "cubic_sum")
+            beam_combination_ = CUBIC_SUM;
+        else if (beam_combination == "log_likelihood")
+            beam_combination_ = LOG_LIKELIHOOD;
+        else
+            config.addError("Unknown beam combination: '" + beam_combination + "'. Options are 'cubic_sum' and 'log_likelihood'.");
+    }
+
+    config.value("lookup_table_resolution", lookup_table_resolution_, tue::config::OPTIONAL);
+    if (lookup_table_resolution_ <= 0)
+        config.addError("lookup_table_resolution must be positive");
+
+    // Beam skipping (as in AMCL): beams that only a small fraction of the samples agree with (e.g., because
+    // they hit an unmodeled obstacle) are left out, unless that holds for most beams
+    config.value("do_beam_skip", do_beam_skip_, tue::config::OPTIONAL);
+    config.value("beam_skip_distance", beam_skip_distance_, tue::config::OPTIONAL);
+    config.value("beam_skip_threshold", beam_skip_threshold_, tue::config::OPTIONAL);
+    config.value("beam_skip_error_threshold", beam_skip_error_threshold_, tue::config::OPTIONAL);
+
+    // Dynamic obstacle rejection: beams that are more than 'dynamic_obstacle_distance' shorter than expected at
+    // the reference pose (e.g., because they hit a person or a cart) are left out, for all samples. A beam stays
+    // rejected until it is within half that distance again. If more than 'dynamic_obstacle_max_fraction' of
+    // the beams would be rejected, the reference pose is probably wrong, and all beams are used.
+    config.value("do_dynamic_obstacle_rejection", do_dynamic_obstacle_rejection_, tue::config::OPTIONAL);
+    config.value("dynamic_obstacle_distance", dynamic_obstacle_distance_, tue::config::OPTIONAL);
+    config.value("dynamic_obstacle_max_fraction", dynamic_obstacle_max_fraction_, tue::config::OPTIONAL);
+
     config.value("z_hit", z_hit);
     config.value("sigma_hit", sigma_hit);
     config.value("z_short", z_short);
@@ -92,6 +117,49 @@ void LaserModel::configure(tue::Configuration config)
     config.value("min_particle_distance", min_particle_distance_);
     config.value("min_particle_rotation_distance", min_particle_rotation_distance_);
 
+    int num_threads = 1;
+    if (config.value("num_threads", num_threads, tue::config::OPTIONAL))
+        worker_pool_.setNumThreads(std::max(0, num_threads));
+
+    // Scoring backend. The OpenCL backend only pays off for large numbers of unique samples (e.g., during
+    // global localization): below 'opencl_min_samples', the CPU is used.
+    std::string backend;
+    if (config.value("backend", backend, tue::config::OPTIONAL))
+    {
+        if (backend == "cpu")
+            use_opencl_ = false;
+        else if (backend == "opencl")
+        {
+            use_opencl_ = true;
+
+            std::string error;
+            if (!opencl_scorer_.initialized() && !opencl_scorer_.initialize(error))
+                config.addError("Could not initialize the OpenCL backend: " + error);
+        }
+        else
+            config.addError("Unknown backend: '" + backend + "'. Options are 'cpu' and 'opencl'.");
+    }
+
+    int opencl_min_samples;
+    if (config.value("opencl_min_samples", opencl_min_samples, tue::config::OPTIONAL))
+        opencl_min_samples_ = std::max(0, opencl_min_samples);
+
+    double cross_section_cell_size;
+    if (config.value("cross_section_cell_size", cross_section_cell_size, tue::config::OPTIONAL))
+        world_cross_section_.setCellSize(cross_section_cell_size);
+
+    double likelihood_field_resolution;
+    if (config.value("likelihood_field_resolution", likelihood_field_resolution, tue::config::OPTIONAL))
+        likelihood_field_.setResolution(likelihood_field_resolution);
+
+    bool cull_occluded_segments;
+    if (config.value("cull_occluded_segments", cull_occluded_segments, tue::config::OPTIONAL))
+        raycaster_.setCullOccluded(cull_occluded_segments);
+
+    double likelihood_field_max_distance;
+    if (config.value("likelihood_field_max_distance", likelihood_field_max_distance, tue::config::OPTIONAL))
+        likelihood_field_.setMaxDistance(likelihood_field_max_distance);
+
     // Pre-calculate expensive operations
     int resolution = 1000; // mm accuracy
 
@@ -102,71 +170,162 @@ void LaserModel::configure(tue::Configuration config)
         exp_hit_[i] = exp(-(z * z) / (2 * this->sigma_hit * this->sigma_hit));
     }
 
-    exp_short_.resize(range_max * resolution + 1);
-    for(int i = 0; i < exp_hit_.size(); ++i)
-    {
-        double obs_range = (double)i / resolution;
-        exp_short_[i] = exp(-this->lambda_short * obs_range);
-    }
+    buildLookupTable();
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-void LaserModel::updateWeights(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan, ParticleFilter& pf)
+void LaserModel::buildLookupTable()
 {
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Find unique samples
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Both the observed and the modeled range are quantized to [0, range_max]. The last row (observed range
+    // at range_max) holds the max-range readings only, so there are at least two rows.
+    lookup_table_size_ = std::max(2.0, range_max / lookup_table_resolution_ + 1.5);
+    lookup_table_inv_resolution_ = (lookup_table_size_ - 1) / range_max;
 
-    // If N samples are nearly identical, we only want to calculate the probability update
-    // once and share it for all N samples. Therefore, we create a sample list 'unique_samples'
-    // that only contain samples that are further apart than a given threshold. We will only
-    // calculate the probabilities of those samples, and share them with the similar samples.
+    lookup_table_.resize(lookup_table_size_ * lookup_table_size_);
+    ++lookup_table_revision_;
 
-    // unique samples
-    std::vector<Transform> unique_samples;
+    for(unsigned int i_obs = 0; i_obs < lookup_table_size_; ++i_obs)
+    {
+        double obs_range = (double)i_obs / lookup_table_inv_resolution_;
+        bool max_range = (i_obs + 1 == lookup_table_size_);
 
-    // mapping of samples from the particle filter to the unique sample list
-    std::vector<unsigned int> sample_to_unique(pf.samples().size());
+        for(unsigned int i_map = 0; i_map < lookup_table_size_; ++i_map)
+        {
+            double map_range = (double)i_map / lookup_table_inv_resolution_;
+            double z = obs_range - map_range;
 
-    double min_particle_distance_sq = min_particle_distance_ * min_particle_distance_;
+            double pz = 0;
 
-    for(unsigned int i = 0; i < pf.samples().size(); ++i)
-    {
-        const Sample& s1 = pf.samples()[i];
-        const Transform& t1 = s1.pose;
+            // Part 1: good, but noisy, hit
+            pz += this->z_hit * exp(-(z * z) / (2 * this->sigma_hit * this->sigma_hit));
 
-        bool found = false;
-        for(unsigned int j = 0; j < unique_samples.size(); ++j)
-        {
-            const Transform& t2 = unique_samples[j];
+            // Part 2: short reading from unexpected obstacle (e.g., a person)
+            if(z < 0)
+                pz += this->z_short * this->lambda_short * exp(-this->lambda_short * obs_range);
 
-            // Calculate difference in rotation
-            double rot_diff = std::abs(t1.rotation() - t2.rotation());
-            if (rot_diff > M_PI)
-                rot_diff = 2 * M_PI - rot_diff;
+            // Part 3: Failure to detect obstacle, reported as max-range
+            if(max_range)
+                pz += this->z_max * 1.0;
 
-            // Check if translation and rotational difference are within boundaries
-            if ((t1.matrix().t - t2.matrix().t).length2() < min_particle_distance_sq && rot_diff < min_particle_rotation_distance_)
-            {
-                found = true;
-                sample_to_unique[i] = j;
-                break;
-            }
-        }
+            // Part 4: Random measurements
+            if(!max_range)
+                pz += this->z_rand * 1.0 / this->range_max;
 
-        if (!found)
-        {
-            sample_to_unique[i] = unique_samples.size();
-            unique_samples.push_back(t1);
+            lookup_table_[i_obs * lookup_table_size_ + i_map] = beamContribution(pz);
         }
     }
 
+    // Likelihood field: good, but noisy, hit or random measurement (see LaserModel::scoreLikelihoodField)
+    likelihood_field_table_.resize(exp_hit_.size());
+    for(unsigned int i = 0; i < exp_hit_.size(); ++i)
+        likelihood_field_table_[i] = beamContribution(this->z_hit * exp_hit_[i] + this->z_rand * 1.0 / this->range_max);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::updateWeights(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan, ParticleFilter& pf)
+{
+    time_render_ = 0;
+    time_scoring_ = 0;
+    num_skipped_beams_ = 0;
+
+    updateUniqueSamples(pf.sampleSet());
+
     // If there is only one unique sample, it means are particles are (almost) identical, and the laser model
     // update is not neccesary. This typically holds if the robot is standing still.
-    if (unique_samples.size() == 1)
+    if (unique_samples_.size() == 1)
         return;
 
+    log_weight_updates_.assign(unique_samples_.size(), 0);
+    if (!addLogWeightUpdates(world, scan, unique_samples_, log_weight_updates_))
+        return;
+
+    tue::Timer timer;
+    timer.start();
+
+    applyLogWeightUpdates(unique_samples_, log_weight_updates_, pf);
+
+    time_scoring_ += timer.getElapsedTimeInMilliSec();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::saveState(FilterState& state) const
+{
+    cross_section_->saveState(state);
+
+    if (type_ == LIKELIHOOD_FIELD_MODEL)
+        likelihood_field_.saveState(state);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::restoreState(const FilterState& state)
+{
+    // A shared cross section is restored by the laser that owns it
+    if (state.cross_section_height < 0 || sharesWorldCrossSection())
+        return;
+
+    world_cross_section_.restoreState(state);
+
+    if (type_ == LIKELIHOOD_FIELD_MODEL)
+        likelihood_field_.restoreState(state, world_cross_section_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::updateUniqueSamples(const SampleSet& samples)
+{
+    tue::Timer timer;
+    timer.start();
+
+    unique_samples_.update(samples, min_particle_distance_, min_particle_rotation_distance_);
+
+    num_samples_ = samples.size();
+    num_unique_samples_ = unique_samples_.size();
+
+    time_dedup_ = timer.getElapsedTimeInMilliSec();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::applyLogWeightUpdates(const UniqueSampleSet& unique_samples, std::vector<double>& log_weight_updates,
+                                       ParticleFilter& pf)
+{
+    if (log_weight_updates.empty())
+        return;
+
+    // Convert the log weight updates relative to the most likely sample, such that they do not underflow
+    double log_max = *std::max_element(log_weight_updates.begin(), log_weight_updates.end());
+    for(unsigned int j = 0; j < log_weight_updates.size(); ++j)
+        log_weight_updates[j] = exp(log_weight_updates[j] - log_max);
+
+    SampleSet& samples = pf.sampleSet();
+    const std::vector<unsigned int>& sample_to_unique = unique_samples.sampleToUnique();
+
+    for(unsigned int j = 0; j < samples.size(); ++j)
+        samples.weight[j] *= log_weight_updates[sample_to_unique[j]];
+
+    pf.normalize();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LaserModel::addLogWeightUpdates(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan,
+                                     const UniqueSampleSet& unique_samples, std::vector<double>& log_weight_updates)
+{
+    time_render_ = 0;
+    time_scoring_ = 0;
+    num_skipped_beams_ = 0;
+    num_dynamic_beams_ = 0;
+
+    tue::Timer timer;
+    timer.start();
+
+    // Used by the worker threads
+    current_unique_samples_ = &unique_samples;
+
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Update world renderer
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -193,33 +352,56 @@ void LaserModel::updateWeights(const ed::WorldModel& world, const sensor_msgs::L
     {
         lrf_.setNumBeams(num_beams);
         lrf_.setAngleLimits(scan.angle_min, scan.angle_max);
-        range_max = std::min<double>(range_max, scan.range_max);
+        raycaster_.setBeams(num_beams, scan.angle_min, scan.angle_max);
+
+        if (scan.range_max < range_max)
+        {
+            range_max = scan.range_max;
+            buildLookupTable();
+        }
+
+        // Unit vectors of all beams (in the laser frame), used by the likelihood field model
+        std::vector<geo::Vector3> points;
+        lrf_.rangesToPoints(std::vector<double>(num_beams, 1), points);
+
+        beam_directions_.resize(points.size());
+        for(unsigned int i = 0; i < points.size(); ++i)
+            beam_directions_[i] = geo::Vec2(points[i].x, points[i].y);
     }
 
     // If the laser is upside down, we need to mirror the sensor data
     if (laser_upside_down_)
         std::reverse(sensor_ranges_.begin(), sensor_ranges_.end());
 
+    // Determine which of the beams are evaluated
+    selectBeams();
+
+    // Without any (valid) measurement, there is nothing to update
+    if (beams_.empty())
+        return false;
+
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Determine center and maximum range of world model cross section
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    // Find the bounding rectangle around all sample poses. This will be used to determine
-    // the largest render distance (anything max_range beyond the sample boundaries does
-    // not have to be considered)
+    // Find the bounding rectangle around the laser poses of all unique samples (the only poses that
+    // are scored). This will be used to determine the largest render distance (anything max_range
+    // beyond the sample boundaries does not have to be considered). The laser poses are kept for
+    // the scoring.
+
+    laser_poses_.resize(unique_samples.size());
 
     geo::Vec2 sample_min(1e9, 1e9);
     geo::Vec2 sample_max(-1e9, -1e9);
-    for(std::vector<Sample>::iterator it = pf.samples().begin(); it != pf.samples().end(); ++it)
+    for(unsigned int j = 0; j < unique_samples.size(); ++j)
     {
-        Sample& sample = *it;
-
-        geo::Transform2 laser_pose = sample.pose.matrix() * laser_offset_;
+        geo::Transform2& laser_pose = laser_poses_[j];
+        laser_pose = unique_samples[j].matrix() * laser_offset_;
 
         sample_min.x = std::min(sample_min.x, laser_pose.t.x);
         sample_min.y = std::min(sample_min.y, laser_pose.t.y);
-        sample_max.x = std::max(sample_min.x, laser_pose.t.x);
-        sample_max.y = std::max(sample_min.y, laser_pose.t.y);
+        sample_max.x = std::max(sample_max.x, laser_pose.t.x);
+        sample_max.y = std::max(sample_max.y, laser_pose.t.y);
     }
 
     double temp_range_max = 0;
@@ -238,124 +420,473 @@ void LaserModel::updateWeights(const ed::WorldModel& world, const sensor_msgs::L
     geo::Vec2 sample_center = (sample_min + sample_max) / 2;
     double max_distance = (sample_max - sample_min).length() / 2 + temp_range_max;
 
-    // Set the range limit to the lrf renderer. This will make sure all shapes that
-    // are too far away will not be rendered (object selection, not line selection)
-    lrf_.setRangeLimits(scan.range_min, max_distance);
+    // The expected ranges of the dynamic obstacle rejection are rendered from the same lines, so they
+    // should also cover the reference pose
+    bool reject_dynamic = do_dynamic_obstacle_rejection_ && has_reference_pose_;
+
+    geo::Transform2 reference_laser_pose;
+    if (reject_dynamic)
+    {
+        reference_laser_pose = reference_pose_ * laser_offset_;
+        max_distance = std::max(max_distance, (reference_laser_pose.t - sample_center).length() + temp_range_max);
+    }
+    else
+    {
+        // The rejection state is only kept over consecutive scans
+        dynamic_beams_.clear();
+    }
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Create world model cross section
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    geo::Pose3D laser_pose(sample_center.x, sample_center.y, laser_height_);
+    // Only re-renders the entities that changed since the previous scan
+    updateWorldCrossSection(world);
 
     lines_start_.clear();
     lines_end_.clear();
 
-    // Give the max_distance also to the line renderer. It will discard all LINES that
-    // are further away. Note that this is an even finer selection than the default
-    // object selection that is done by the lrf renderer.
-    LineRenderResult render_result(lines_start_, lines_end_, max_distance);
+    // The OpenCL backend scores the whole cross section, which it only uploads if it changed
+    bool use_opencl = use_opencl_ && type_ == BEAM_MODEL && !do_beam_skip_
+            && unique_samples.size() >= opencl_min_samples_;
 
-    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it)
+    if (type_ == LIKELIHOOD_FIELD_MODEL)
     {
-        const ed::EntityConstPtr& e = *it;
-        if (e->shape() && e->has_pose())
-        {
-            // Do not render the robot itself (we're trying to localize it!)
-            if (e->hasFlag("self"))
-                continue;
+        // Only rebuilt if the cross section changed
+        likelihood_field_.update(*cross_section_);
+    }
+    else if (use_opencl)
+    {
+        use_opencl = opencl_scorer_.setCrossSection(*cross_section_)
+                && opencl_scorer_.setLookupTable(lookup_table_, lookup_table_revision_);
+    }
 
-            if (e->hasFlag("non-localizable"))
-                continue;
+    // Only select the lines that are within max_distance of the sample center
+    if (type_ == BEAM_MODEL || reject_dynamic)
+        cross_section_->query(sample_center, max_distance, lines_start_, lines_end_);
 
-            geo::LaserRangeFinder::RenderOptions options;
-            geo::Transform t_inv = laser_pose.inverse() * e->pose();
-            options.setMesh(e->shape()->getMesh(), t_inv);
-            lrf_.render(options, render_result);
-        }
+    bool raycaster_ready = false;
+    if ((type_ == BEAM_MODEL && !use_opencl) || reject_dynamic)
+    {
+        // Order the lines near to far (as seen from the sample center), such that for most samples the
+        // nearest geometry is rendered first and occluded lines can be skipped
+        sortLines(sample_center);
+
+        raycaster_.setLines(lines_start_, lines_end_);
+        raycaster_ready = true;
     }
 
-    for(unsigned int i = 0; i < lines_start_.size(); ++i)
+    lrf_.setRangeLimits(scan.range_min, temp_range_max);
+    raycaster_.setRangeLimits(scan.range_min, temp_range_max);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Reject dynamic obstacles and classify the remaining beams
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    if (reject_dynamic)
+    {
+        rejectDynamicBeams(reference_laser_pose, temp_range_max);
+
+        if (beams_.empty())
+            return false;
+    }
+
+    // The observed ranges are the same for all samples, so everything that only depends on them is determined
+    // once: the lookup table row of every beam, and (for the likelihood field) whether the beam is invalid,
+    // max range, or has an end point
+    unsigned int num_selected = beams_.size();
+    contiguous_beams_ = (num_selected == sensor_ranges_.size());
+
+    lookup_table_rows_.resize(num_selected);
+    selected_ranges_.resize(num_selected);
+    fixed_pz_.resize(num_selected);
+    end_point_beams_.clear();
+    end_points_x_.clear();
+    end_points_y_.clear();
+
+    for(unsigned int k = 0; k < num_selected; ++k)
     {
-        lines_start_[i] += sample_center;
-        lines_end_[i] += sample_center;
+        unsigned int i = beams_[k];
+        double obs_range = sensor_ranges_[i];
+        selected_ranges_[k] = obs_range;
+
+        // The last row is reserved for max-range readings, all other readings are rounded to the rows below it
+        unsigned int row = lookup_table_size_ - 1;
+        if (obs_range < range_max)
+            row = std::min((unsigned int)(std::max(obs_range, 0.0) * lookup_table_inv_resolution_ + 0.5),
+                           lookup_table_size_ - 2);
+
+        lookup_table_rows_[k] = row * lookup_table_size_;
+
+        if (obs_range <= 0)
+        {
+            // Invalid measurement
+            fixed_pz_[k] = beamContribution(0);
+        }
+        else if (obs_range >= range_max)
+        {
+            // Failure to detect obstacle, reported as max-range
+            fixed_pz_[k] = beamContribution(this->z_max * 1.0);
+        }
+        else
+        {
+            fixed_pz_[k] = 0;
+            end_point_beams_.push_back(k);
+            end_points_x_.push_back(beam_directions_[i].x * obs_range);
+            end_points_y_.push_back(beam_directions_[i].y * obs_range);
+        }
     }
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Calculate sample weight updates
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    lrf_.setRangeLimits(scan.range_min, temp_range_max);
+    time_render_ = timer.getElapsedTimeInMilliSec();
 
-    std::vector<double> weight_updates(unique_samples.size());
-    for(unsigned int j = 0; j < unique_samples.size(); ++j)
+    if (use_opencl)
     {
-        geo::Transform2 laser_pose = unique_samples[j].matrix() * laser_offset_;
-        geo::Transform2 pose_inv = laser_pose.inverse();
+        selected_beam_directions_.resize(beams_.size());
+        for(unsigned int k = 0; k < beams_.size(); ++k)
+            selected_beam_directions_[k] = beam_directions_[beams_[k]];
 
-        // Calculate sensor model for this pose
-        std::vector<double> model_ranges(sensor_ranges_.size(), 0);
+        // If the device fails, the samples are scored on the CPU instead
+        use_opencl = opencl_scorer_.score(laser_poses_, selected_beam_directions_, lookup_table_rows_,
+                                          scan.range_min, temp_range_max, range_max, lookup_table_inv_resolution_,
+                                          beam_combination_ == CUBIC_SUM ? 1 : 0, weight_updates_);
 
-        for(unsigned int i = 0; i < lines_start_.size(); ++i)
+        if (!use_opencl && !raycaster_ready)
         {
-            const geo::Vec2& p1 = lines_start_[i];
-            const geo::Vec2& p2 = lines_end_[i];
+            sortLines(sample_center);
+            raycaster_.setLines(lines_start_, lines_end_);
+        }
+    }
 
-            // Transform the points to the laser pose
-            geo::Vec2 p1_t = pose_inv * p1;
-            geo::Vec2 p2_t = pose_inv * p2;
+    // Every thread renders into its own workspace. Each unique sample is scored independently, so
+    // the result does not depend on the number of threads.
+    unsigned int num_threads = worker_pool_.numThreads();
+    thread_workspaces_.resize(num_threads);
+    for(unsigned int i = 0; i < num_threads; ++i)
+        thread_workspaces_[i].pz.resize(beams_.size());
 
-            // Render the line as if seen by the sensor
-            lrf_.renderLine(p1_t, p2_t, model_ranges);
+    if (do_beam_skip_)
+    {
+        // All beam likelihoods are kept, such that they can be combined after it is known which beams to skip
+        beam_pz_.resize(unique_samples.size() * beams_.size());
+
+        for(unsigned int i = 0; i < num_threads; ++i)
+            thread_workspaces_[i].num_agree.assign(beams_.size(), 0);
+    }
+
+    if (!use_opencl)
+    {
+        weight_updates_.resize(unique_samples.size());
+        worker_pool_.run(weight_update_job_);
+    }
+
+    if (do_beam_skip_)
+    {
+        // Skip the beams that not enough samples agree with
+
+        beam_skip_.assign(beams_.size(), 0);
+
+        for(unsigned int k = 0; k < beams_.size(); ++k)
+        {
+            unsigned int num_agree = 0;
+            for(unsigned int i = 0; i < num_threads; ++i)
+                num_agree += thread_workspaces_[i].num_agree[k];
+
+            if (num_agree < beam_skip_threshold_ * unique_samples.size())
+            {
+                beam_skip_[k] = 1;
+                ++num_skipped_beams_;
+            }
         }
 
-        double p = 1;
+        // If most beams would be skipped, the samples are probably just in the wrong place: in
+        // that case, use all beams
+        if (num_skipped_beams_ > beam_skip_error_threshold_ * beams_.size())
+        {
+            beam_skip_.assign(beams_.size(), 0);
+            num_skipped_beams_ = 0;
+        }
+
+        for(unsigned int j = 0; j < unique_samples.size(); ++j)
+            weight_updates_[j] = combineBeamLikelihoods(&beam_pz_[j * beams_.size()], &beam_skip_[0]);
+    }
+
+    // Accumulate in the log domain, such that the updates of multiple lasers can be combined by adding them
+    for(unsigned int j = 0; j < weight_updates_.size(); ++j)
+        log_weight_updates[j] += (beam_combination_ == LOG_LIKELIHOOD ? weight_updates_[j] : log(weight_updates_[j]));
 
-        for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    time_scoring_ = timer.getElapsedTimeInMilliSec() - time_render_;
+
+    return true;
+}
+
+
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::selectBeams()
+{
+    beams_.clear();
+
+    double min_distance_sq = adaptive_beam_min_distance_ * adaptive_beam_min_distance_;
+
+    bool has_last = false;
+    geo::Vec2 p_last;
+
+    for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    {
+        double r = sensor_ranges_[i];
+
+        if (beam_selection_ != ALL_BEAMS)
         {
-            double obs_range = sensor_ranges_[i];
-            double map_range = model_ranges[i];
+            // Invalid measurement (Inf, NaN and out of range readings are set to 0)
+            if (r <= 0)
+                continue;
 
-            double z = obs_range - map_range;
+            // Leave out beams that end close to the end point of the previously selected beam. This thins out
+            // the (strongly correlated) beams on nearby surfaces, while keeping the sparse ones far away.
+            if (beam_selection_ == ADAPTIVE_BEAMS && r < range_max)
+            {
+                geo::Vec2 p = beam_directions_[i] * r;
+                if (has_last && (p - p_last).length2() < min_distance_sq)
+                    continue;
 
-            double pz = 0;
+                p_last = p;
+                has_last = true;
+            }
+        }
 
-            // Part 1: good, but noisy, hit
-            //            pz += this->z_hit * exp(-(z * z) / (2 * this->sigma_hit * this->sigma_hit));
-            pz += this->z_hit * exp_hit_[std::min(std::abs(z), range_max) * 1000];
+        beams_.push_back(i);
+    }
+}
 
-            // Part 2: short reading from unexpected obstacle (e.g., a person)
-            if(z < 0)
-                //                pz += this->z_short * this->lambda_short * exp(-this->lambda_short*obs_range);
-                pz += this->z_short * this->lambda_short * exp_short_[std::min(obs_range, range_max) * 1000];
+// ----------------------------------------------------------------------------------------------------
 
-            // Part 3: Failure to detect obstacle, reported as max-range
-            if(obs_range >= this->range_max)
-                pz += this->z_max * 1.0;
+void LaserModel::rejectDynamicBeams(const geo::Transform2& reference_laser_pose, double max_range)
+{
+    reference_ranges_.assign(sensor_ranges_.size(), 0);
+    raycaster_.render(reference_laser_pose.inverse(), reference_ranges_);
 
-            // Part 4: Random measurements
-            if(obs_range < this->range_max)
-                pz += this->z_rand * 1.0 / this->range_max;
+    if (dynamic_beams_.size() != sensor_ranges_.size())
+        dynamic_beams_.assign(sensor_ranges_.size(), 0);
 
-            // here we have an ad-hoc weighting scheme for combining beam probs
-            // works well, though...
-            p += pz * pz * pz;
+    unsigned int num_dynamic = 0;
+    for(unsigned int i = 0; i < sensor_ranges_.size(); ++i)
+    {
+        double r = sensor_ranges_[i];
+
+        // Invalid and max-range readings can not be caused by an obstacle in front of the map
+        if (r <= 0 || r >= range_max)
+        {
+            dynamic_beams_[i] = 0;
+            continue;
         }
 
-        weight_updates[j] = p;
+        // Beams without a hit are expected beyond the render range
+        double expected = reference_ranges_[i] > 0 ? reference_ranges_[i] : max_range;
+
+        // Hysteresis, such that beams near the threshold do not toggle every scan
+        double threshold = dynamic_beams_[i] ? dynamic_obstacle_distance_ / 2 : dynamic_obstacle_distance_;
+        dynamic_beams_[i] = (expected - r > threshold);
     }
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Update the particle filter
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    for(unsigned int k = 0; k < beams_.size(); ++k)
+    {
+        if (dynamic_beams_[beams_[k]])
+            ++num_dynamic;
+    }
 
-    for(unsigned int j = 0; j < pf.samples().size(); ++j)
+    // If too many beams would be rejected, the reference pose is probably wrong: use all beams and start over
+    if (num_dynamic > dynamic_obstacle_max_fraction_ * beams_.size())
     {
-        Sample& sample = pf.samples()[j];
-        sample.weight *= weight_updates[sample_to_unique[j]];
+        dynamic_beams_.assign(sensor_ranges_.size(), 0);
+        return;
     }
 
-    pf.normalize();
+    unsigned int n = 0;
+    for(unsigned int k = 0; k < beams_.size(); ++k)
+    {
+        if (!dynamic_beams_[beams_[k]])
+            beams_[n++] = beams_[k];
+    }
+    beams_.resize(n);
+
+    num_dynamic_beams_ = num_dynamic;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double LaserModel::combineBeamLikelihoods(const Scalar* pz, const char* skip) const
+{
+    // The cubic sum is an ad-hoc weighting scheme for combining beam probs (p = 1 + sum of pz^3),
+    // which works well, though... The log-likelihood is the sum of log(pz).
+    double p = (beam_combination_ == CUBIC_SUM ? 1 : 0);
+
+    if (skip)
+    {
+        for(unsigned int k = 0; k < beams_.size(); ++k)
+        {
+            if (!skip[k])
+                p += pz[k];
+        }
+    }
+    else
+    {
+        for(unsigned int k = 0; k < beams_.size(); ++k)
+            p += pz[k];
+    }
+
+    return p;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::sortLines(const geo::Vec2& center)
+{
+    line_order_.resize(lines_start_.size());
+    for(unsigned int i = 0; i < lines_start_.size(); ++i)
+    {
+        geo::Vec2 p1 = lines_start_[i] - center;
+        geo::Vec2 diff = lines_end_[i] - lines_start_[i];
+        double length_sq = diff.length2();
+
+        double t = length_sq > 0 ? -p1.dot(diff) / length_sq : 0;
+        t = std::max(0.0, std::min(1.0, t));
+
+        line_order_[i] = std::make_pair((p1 + t * diff).length2(), i);
+    }
+
+    std::sort(line_order_.begin(), line_order_.end());
+
+    sorted_lines_start_.resize(lines_start_.size());
+    sorted_lines_end_.resize(lines_end_.size());
+    for(unsigned int i = 0; i < line_order_.size(); ++i)
+    {
+        sorted_lines_start_[i] = lines_start_[line_order_[i].second];
+        sorted_lines_end_[i] = lines_end_[line_order_[i].second];
+    }
+
+    lines_start_.swap(sorted_lines_start_);
+    lines_end_.swap(sorted_lines_end_);
+}
+
+template<bool CONTIGUOUS, bool BEAM_SKIP>
+void LaserModel::scoreBeamModel(ThreadWorkspace& ws, unsigned int j_begin, unsigned int j_end)
+{
+    unsigned int num_selected = beams_.size();
+    const unsigned int* beams = &beams_[0];
+    const unsigned int* rows = &lookup_table_rows_[0];
+    const Scalar* obs_ranges = &selected_ranges_[0];
+    const float* table = &lookup_table_[0];
+
+    Scalar max_range = range_max;
+    Scalar inv_res = lookup_table_inv_resolution_;
+    Scalar skip_distance = beam_skip_distance_;
+    unsigned int* num_agree = BEAM_SKIP ? &ws.num_agree[0] : 0;
+
+    for(unsigned int j = j_begin; j < j_end; ++j)
+    {
+        // Calculate sensor model for this pose
+        ws.model_ranges.assign(sensor_ranges_.size(), 0);
+        raycaster_.render(laser_poses_[j].inverse(), ws.model_ranges);
+        const Scalar* model_ranges = &ws.model_ranges[0];
+
+        // With beam skipping, the beam likelihoods are combined once all samples are done
+        Scalar* pz = BEAM_SKIP ? &beam_pz_[j * num_selected] : &ws.pz[0];
+
+        for(unsigned int k = 0; k < num_selected; ++k)
+        {
+            Scalar model_range = model_ranges[CONTIGUOUS ? k : beams[k]];
+            pz[k] = table[rows[k] + (int)(std::min(model_range, max_range) * inv_res + 0.5)];
+
+            if (BEAM_SKIP && std::abs(obs_ranges[k] - model_range) < skip_distance)
+                ++num_agree[k];
+        }
+
+        if (!BEAM_SKIP)
+            weight_updates_[j] = combineBeamLikelihoods(pz, 0);
+    }
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+template<bool BEAM_SKIP>
+void LaserModel::scoreLikelihoodField(ThreadWorkspace& ws, unsigned int j_begin, unsigned int j_end)
+{
+    // Only the beams with an end point depend on the sample, the others have a fixed contribution
+    unsigned int num_selected = beams_.size();
+    unsigned int num_end_points = end_point_beams_.size();
+    const unsigned int* end_point_beams = num_end_points > 0 ? &end_point_beams_[0] : 0;
+    const Scalar* end_points_x = num_end_points > 0 ? &end_points_x_[0] : 0;
+    const Scalar* end_points_y = num_end_points > 0 ? &end_points_y_[0] : 0;
+    const Scalar* table = &likelihood_field_table_[0];
+
+    double d_max = std::min(likelihood_field_.maxDistance(), range_max);
+    unsigned int* num_agree = BEAM_SKIP ? &ws.num_agree[0] : 0;
+
+    for(unsigned int j = j_begin; j < j_end; ++j)
+    {
+        const geo::Transform2& laser_pose = laser_poses_[j];
+        Scalar r_xx = laser_pose.R.xx, r_xy = laser_pose.R.xy, r_yx = laser_pose.R.yx, r_yy = laser_pose.R.yy;
+        Scalar t_x = laser_pose.t.x, t_y = laser_pose.t.y;
+
+        Scalar* pz = BEAM_SKIP ? &beam_pz_[j * num_selected] : &ws.pz[0];
+        std::copy(fixed_pz_.begin(), fixed_pz_.end(), pz);
+
+        for(unsigned int h = 0; h < num_end_points; ++h)
+        {
+            // Distance of the beam end point to the nearest obstacle
+            Scalar x_end = r_xx * end_points_x[h] + r_xy * end_points_y[h] + t_x;
+            Scalar y_end = r_yx * end_points_x[h] + r_yy * end_points_y[h] + t_y;
+            double d = std::min(likelihood_field_.distance(x_end, y_end), d_max);
+
+            unsigned int k = end_point_beams[h];
+            pz[k] = table[(int)(d * 1000)];
+
+            if (BEAM_SKIP && d < beam_skip_distance_)
+                ++num_agree[k];
+        }
 
+        if (!BEAM_SKIP)
+            weight_updates_[j] = combineBeamLikelihoods(pz, 0);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LaserModel::calculateWeightUpdates(unsigned int i_thread)
+{
+    // Every thread gets a consecutive block of samples
+    unsigned int num_threads = worker_pool_.numThreads();
+    const UniqueSampleSet& unique_samples = *current_unique_samples_;
+    unsigned int j_begin = unique_samples.size() * i_thread / num_threads;
+    unsigned int j_end = unique_samples.size() * (i_thread + 1) / num_threads;
+
+    ThreadWorkspace& ws = thread_workspaces_[i_thread];
+
+    // Select the specialized kernel once per block
+    if (type_ == LIKELIHOOD_FIELD_MODEL)
+    {
+        if (do_beam_skip_)
+            scoreLikelihoodField<true>(ws, j_begin, j_end);
+        else
+            scoreLikelihoodField<false>(ws, j_begin, j_end);
+    }
+    else if (contiguous_beams_)
+    {
+        if (do_beam_skip_)
+            scoreBeamModel<true, true>(ws, j_begin, j_end);
+        else
+            scoreBeamModel<true, false>(ws, j_begin, j_end);
+    }
+    else
+    {
+        if (do_beam_skip_)
+            scoreBeamModel<false, true>(ws, j_begin, j_end);
+        else
+            scoreBeamModel<false, false>(ws, j_begin, j_end);
+    }
+}
@@ -1,6 +1,13 @@
 #ifndef ED_LOCALIZATION_LASER_MODEL_H_
 #define ED_LOCALIZATION_LASER_MODEL_H_
 
+#include "unique_sample_set.h"
+#include "world_cross_section.h"
+#include "likelihood_field.h"
+#include "worker_pool.h"
+#include "segment_raycaster.h"
+#include "opencl_scorer.h"
+
 #include <ed/types.h>
 #include <geolib/sensors/LaserRangeFinder.h>
 
@@ -9,12 +16,44 @@
 #include <sensor_msgs/LaserScan.h>
 
 class ParticleFilter;
+class Transform;
+class FilterState;
 
 class LaserModel
 {
 
 public:
 
+    enum ModelType
+    {
+        // Raycasts the world cross section for every unique sample
+        BEAM_MODEL,
+
+        // Looks up the distance of every beam end point to the nearest obstacle in a precomputed grid
+        LIKELIHOOD_FIELD_MODEL
+    };
+
+    enum BeamSelection
+    {
+        // Evaluate all beams
+        ALL_BEAMS,
+
+        // Leave out invalid (Inf, NaN or out of range) beams
+        VALID_BEAMS,
+
+        // Leave out invalid beams, and beams that end close to the previously selected beam
+        ADAPTIVE_BEAMS
+    };
+
+    enum BeamCombination
+    {
+        // p = 1 + sum of pz^3 (ad-hoc, but robust)
+        CUBIC_SUM,
+
+        // p = product of pz, accumulated in the log domain
+        LOG_LIKELIHOOD
+    };
+
     LaserModel();
 
     ~LaserModel();
@@ -23,23 +62,90 @@ public:
 
     void updateWeights(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan, ParticleFilter& pf);
 
+    // The steps of updateWeights, such that multiple laser models can update the same samples in one pass:
+    // the unique samples are determined once (by one of the models), every model adds its own log weight
+    // updates, and the sum is applied to the particle filter once.
+
+    void updateUniqueSamples(const SampleSet& samples);
+
+    const UniqueSampleSet& unique_samples() const { return unique_samples_; }
+
+    // Adds the log weight update of every unique sample to log_weight_updates. Returns false if the
+    // scan did not contain any usable beams (nothing was added).
+    bool addLogWeightUpdates(const ed::WorldModel& world, const sensor_msgs::LaserScan& scan,
+                             const UniqueSampleSet& unique_samples, std::vector<double>& log_weight_updates);
+
+    // Multiplies the weights with the given update (log_weight_updates is overwritten) and normalizes them
+    static void applyLogWeightUpdates(const UniqueSampleSet& unique_samples, std::vector<double>& log_weight_updates,
+                                      ParticleFilter& pf);
+
+    // Uses the world cross section of 'other' instead of its own. Only sensible if both lasers are at
+    // (nearly) the same height: the cross section is kept at the height of the laser that created it.
+    void shareWorldCrossSection(const LaserModel& other)
+    {
+        cross_section_ = other.cross_section_;
+        cross_section_height_ = other.cross_section_height_;
+    }
+
+    bool sharesWorldCrossSection() const { return cross_section_ != &world_cross_section_; }
+
+    // Brings the world cross section up to date without updating any weights (only the changed entities are re-rendered)
+    void updateWorldCrossSection(const ed::WorldModel& world) { cross_section_->update(world, cross_section_height_); }
+
+    // Exports the map caches (world cross section and likelihood field) to 'state', and imports them (see
+    // FilterState), such that they do not have to be rebuilt after a restart
+    void saveState(FilterState& state) const;
+    void restoreState(const FilterState& state);
+
     const std::vector<geo::Vec2>& lines_start() const { return lines_start_; }
     const std::vector<geo::Vec2>& lines_end() const { return lines_end_; }
 
     const geo::LaserRangeFinder& renderer() const { return lrf_; }
+    const WorldCrossSection& world_cross_section() const { return *cross_section_; }
+    const LikelihoodField& likelihood_field() const { return likelihood_field_; }
     const std::vector<double>& sensor_ranges() const { return sensor_ranges_; }
 
     const geo::Transform2& laser_offset() const { return laser_offset_; }
+    bool laser_upside_down() const { return laser_upside_down_; }
+    double laser_height() const { return laser_height_; }
+
+    // Number of particles and unique samples in the last call to updateWeights
+    unsigned int num_samples() const { return num_samples_; }
+    unsigned int num_unique_samples() const { return num_unique_samples_; }
+
+    // Number of beams evaluated and skipped (by beam skipping) in the last call to updateWeights
+    unsigned int num_selected_beams() const { return beams_.size(); }
+    unsigned int num_skipped_beams() const { return num_skipped_beams_; }
+
+    // Number of beams left out as dynamic obstacles in the last call to updateWeights
+    unsigned int num_dynamic_beams() const { return num_dynamic_beams_; }
+
+    // Robot pose (in the map frame) at which the expected ranges of the dynamic obstacle rejection are rendered,
+    // typically the pose estimate of the previous filter update moved with the odometry. Without a reference
+    // pose, no beams are rejected.
+    void setReferencePose(const geo::Transform2& pose) { reference_pose_ = pose; has_reference_pose_ = true; }
+    void clearReferencePose() { has_reference_pose_ = false; }
+
+    // Duration (in ms) of the stages of the last call to updateWeights. If all samples were
+    // identical, only the deduplication was performed and the other stages are 0.
+    double time_dedup() const { return time_dedup_; }
+    double time_render() const { return time_render_; }
+    double time_scoring() const { return time_scoring_; }
 
     void setLaserOffset(const geo::Transform2& offset, double height, bool upside_down)
     {
         laser_offset_ = offset;
         laser_height_ = height;
         laser_upside_down_ = upside_down;
+
+        if (!sharesWorldCrossSection())
+            cross_section_height_ = height;
     }
 
 private:
 
+    ModelType type_;
+
     double z_hit;
     double sigma_hit;
     double z_short;
@@ -54,21 +160,152 @@ private:
 
     int num_beams;
 
+    // BEAM SELECTION
+    BeamSelection beam_selection_;
+    double adaptive_beam_min_distance_;
+    std::vector<unsigned int> beams_;   // indices in sensor_ranges_ of the beams that are evaluated
+
+    // BEAM SKIPPING
+    bool do_beam_skip_;
+    double beam_skip_distance_;
+    double beam_skip_threshold_;
+    double beam_skip_error_threshold_;
+    unsigned int num_skipped_beams_;
+    std::vector<Scalar> beam_pz_;   // likelihood of every selected beam for every unique sample
+    std::vector<char> beam_skip_;
+
+    // DYNAMIC OBSTACLE REJECTION
+    bool do_dynamic_obstacle_rejection_;
+    double dynamic_obstacle_distance_;
+    double dynamic_obstacle_max_fraction_;
+    bool has_reference_pose_;
+    geo::Transform2 reference_pose_;
+    unsigned int num_dynamic_beams_;
+    std::vector<Scalar> reference_ranges_;   // expected range of every beam at the reference pose
+    std::vector<char> dynamic_beams_;        // whether every beam (of sensor_ranges_) is dynamic, kept between scans
+
     double min_particle_distance_;
     double min_particle_rotation_distance_;
 
+    // UNIQUE SAMPLES
+    UniqueSampleSet unique_samples_;
+    unsigned int num_samples_;
+    unsigned int num_unique_samples_;
+
+    // TIMING
+    double time_dedup_;
+    double time_render_;
+    double time_scoring_;
+
     // CACHING
     std::vector<double> exp_hit_;
-    std::vector<double> exp_short_;
+
+    // Beam contribution (see BeamCombination) of a beam end point for the quantized (mm) distance to the nearest
+    // obstacle, used by the likelihood field model
+    std::vector<Scalar> likelihood_field_table_;
+
+    // Beam contribution (see BeamCombination) for quantized (observed range, modeled range), stored row-wise
+    // per observed range
+    BeamCombination beam_combination_;
+    double lookup_table_resolution_;
+    double lookup_table_inv_resolution_;
+    unsigned int lookup_table_size_;
+    std::vector<float> lookup_table_;
+    std::vector<unsigned int> lookup_table_rows_;   // lookup table row offset of every selected beam
+
+    // SCAN CLASSIFICATION (everything that only depends on the observed ranges, determined once per scan)
+    bool contiguous_beams_;                    // all beams are selected (beams_[k] == k)
+    std::vector<Scalar> selected_ranges_;      // observed range of every selected beam
+    std::vector<Scalar> fixed_pz_;             // contribution of every selected beam that is invalid or max range
+    std::vector<unsigned int> end_point_beams_;              // selected beams (k) that have an end point
+    std::vector<Scalar> end_points_x_, end_points_y_;        // and their end points (in the laser frame)
 
     // RENDERING
     geo::LaserRangeFinder lrf_;
+    WorldCrossSection world_cross_section_;
+    WorldCrossSection* cross_section_;   // own or shared (see shareWorldCrossSection)
+    double cross_section_height_;
+    SegmentRaycaster raycaster_;
+
+    // Used for ordering the lines near to far
+    std::vector<std::pair<double, unsigned int> > line_order_;
+    std::vector<geo::Vec2> sorted_lines_start_;
+    std::vector<geo::Vec2> sorted_lines_end_;
+
+    // LIKELIHOOD FIELD
+    LikelihoodField likelihood_field_;
+    std::vector<geo::Vec2> beam_directions_;
 
     // Visualization
     std::vector<geo::Vec2> lines_start_;
     std::vector<geo::Vec2> lines_end_;
     std::vector<double> sensor_ranges_;
 
+    // MULTI-THREADING
+    WorkerPool worker_pool_;
+
+    // OPENCL (only for the beam model without beam skipping, and only for large numbers of unique samples)
+    bool use_opencl_;
+    unsigned int opencl_min_samples_;
+    OpenCLScorer opencl_scorer_;
+    unsigned int lookup_table_revision_;                 // incremented every time the lookup table is rebuilt
+    std::vector<geo::Vec2> selected_beam_directions_;    // directions of the selected beams
+
+    // WORKSPACE
+
+    // All buffers of the sensor update are kept between scans, and are only resized (which does not
+    // reallocate once they have reached their steady state size), such that a scan does not allocate.
+
+    const UniqueSampleSet* current_unique_samples_;   // unique samples of the current call to addLogWeightUpdates
+    std::vector<double> weight_updates_;              // weight update of every unique sample
+    std::vector<geo::Transform2> laser_poses_;        // laser pose of every unique sample
+    std::vector<double> log_weight_updates_;
+
+    // Scratch buffers of every worker thread
+    struct ThreadWorkspace
+    {
+        std::vector<Scalar> model_ranges;
+        std::vector<Scalar> pz;
+        std::vector<unsigned int> num_agree;   // beam skipping: number of (unique) samples that agree with every beam
+    };
+
+    std::vector<ThreadWorkspace> thread_workspaces_;
+
+    boost::function<void(unsigned int)> weight_update_job_;
+
+    void sortLines(const geo::Vec2& center);
+
+    // Calculates the weight updates of the block of unique samples assigned to thread i_thread
+    void calculateWeightUpdates(unsigned int i_thread);
+
+    void buildLookupTable();
+
+    inline double beamContribution(double pz) const
+    {
+        return beam_combination_ == CUBIC_SUM ? pz * pz * pz : log(std::max(pz, 1e-300));
+    }
+
+    void selectBeams();
+
+    // Leaves out the selected beams that are much shorter than expected at the given laser pose. Requires
+    // the raycaster to be set up.
+    void rejectDynamicBeams(const geo::Transform2& reference_laser_pose, double max_range);
+
+    // Scoring kernels: calculate the likelihood of every selected beam for the unique samples [j_begin, j_end),
+    // and combine them into their weight updates. With beam skipping (BEAM_SKIP), the beam likelihoods are
+    // stored in beam_pz_ instead, and the beams that agree with the map (within beam_skip_distance) are
+    // counted. CONTIGUOUS means all beams are selected (beams_[k] == k). The kernels are specialized on
+    // these flags, such that the innermost loops do not branch on the configuration.
+
+    template<bool CONTIGUOUS, bool BEAM_SKIP>
+    void scoreBeamModel(ThreadWorkspace& ws, unsigned int j_begin, unsigned int j_end);
+
+    template<bool BEAM_SKIP>
+    void scoreLikelihoodField(ThreadWorkspace& ws, unsigned int j_begin, unsigned int j_end);
+
+    // Combines the beam contributions into the weight update of a sample. Beams for which skip is set are left out.
+    double combineBeamLikelihoods(const Scalar* pz, const char* skip) const;
+
 };
 
 #endif
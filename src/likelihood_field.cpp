@@ -0,0 +1,189 @@
+#include "likelihood_field.h"
+
+#include "world_cross_section.h"
+#include "filter_state.h"
+
+#include <queue>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+class CellData
+{
+public:
+
+    CellData(int index_, int dx_, int dy_, int distance_) :
+        index(index_), dx(dx_), dy(dy_), distance(distance_)
+    {}
+
+    int index;
+    int dx, dy;
+    int distance;
+
+};
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LikelihoodField::LikelihoodField() : resolution_(0.05), resolution_inv_(20), max_distance_(1.0), valid_(false),
+    revision_(0), width_(0), height_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LikelihoodField::~LikelihoodField()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LikelihoodField::update(const WorldCrossSection& cross_section)
+{
+    if (valid_ && revision_ == cross_section.revision())
+        return false;
+
+    valid_ = true;
+    revision_ = cross_section.revision();
+    resolution_inv_ = 1.0 / resolution_;
+
+    const std::vector<geo::Vec2>& lines_start = cross_section.lines_start();
+    const std::vector<geo::Vec2>& lines_end = cross_section.lines_end();
+
+    if (lines_start.empty())
+    {
+        width_ = 0;
+        height_ = 0;
+        distances_.clear();
+        return true;
+    }
+
+    // Make sure the grid is large enough to contain the full distance field around all segments
+    double margin = max_distance_ + resolution_;
+    origin_ = cross_section.min() - geo::Vec2(margin, margin);
+    width_ = (cross_section.max().x - origin_.x + margin) * resolution_inv_ + 1;
+    height_ = (cross_section.max().y - origin_.y + margin) * resolution_inv_ + 1;
+
+    int max_distance_cells = max_distance_ * resolution_inv_ + 1;
+    int max_distance_sq = max_distance_cells * max_distance_cells;
+
+    // Squared distance (in cells) to the nearest segment
+    std::vector<int> distances_sq(width_ * height_, max_distance_sq + 1);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Rasterize the segments
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::queue<CellData> Q;
+
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        geo::Vec2 p1 = (lines_start[i] - origin_) * resolution_inv_;
+        geo::Vec2 p2 = (lines_end[i] - origin_) * resolution_inv_;
+
+        // Step with half a cell to make sure no cell is skipped
+        geo::Vec2 diff = p2 - p1;
+        int n = 2 * diff.length() + 1;
+        geo::Vec2 step = diff / n;
+
+        geo::Vec2 p = p1;
+        for(int j = 0; j <= n; ++j)
+        {
+            int index = (int)p.y * width_ + (int)p.x;
+            if (distances_sq[index] != 0)
+            {
+                distances_sq[index] = 0;
+                Q.push(CellData(index, 0, 0, 0));
+            }
+            p += step;
+        }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Inflate
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    // Every cell keeps track of the offset to the segment cell it was reached from, such
+    // that the euclidean distance can be calculated
+
+    int kernel_d_index[4] = { -width_, width_, -1, 1 };
+    int kernel_dx[4] = { 0, 0, -1, 1 };
+    int kernel_dy[4] = { -1, 1, 0, 0 };
+
+    while(!Q.empty())
+    {
+        const CellData& c = Q.front();
+
+        int x = c.index % width_;
+        int y = c.index / width_;
+
+        for(unsigned int k = 0; k < 4; ++k)
+        {
+            int x_new = x + kernel_dx[k];
+            int y_new = y + kernel_dy[k];
+            if (x_new < 0 || y_new < 0 || x_new >= width_ || y_new >= height_)
+                continue;
+
+            int dx_new = c.dx + kernel_dx[k];
+            int dy_new = c.dy + kernel_dy[k];
+            int new_distance = dx_new * dx_new + dy_new * dy_new;
+
+            int new_index = c.index + kernel_d_index[k];
+            if (new_distance < distances_sq[new_index] && new_distance <= max_distance_sq)
+            {
+                distances_sq[new_index] = new_distance;
+                Q.push(CellData(new_index, dx_new, dy_new, new_distance));
+            }
+        }
+
+        Q.pop();
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Convert to metric distances
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    distances_.resize(distances_sq.size());
+    for(unsigned int i = 0; i < distances_sq.size(); ++i)
+        distances_[i] = std::min<double>(max_distance_, sqrt((double)distances_sq[i]) * resolution_);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LikelihoodField::saveState(FilterState& state) const
+{
+    if (!valid_)
+        return;
+
+    state.field_origin = origin_;
+    state.field_resolution = resolution_;
+    state.field_max_distance = max_distance_;
+    state.field_width = width_;
+    state.field_height = height_;
+    state.field_distances = distances_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LikelihoodField::restoreState(const FilterState& state, const WorldCrossSection& cross_section)
+{
+    if (state.field_width <= 0 || state.field_height <= 0 || state.field_resolution != resolution_
+            || state.field_max_distance != max_distance_)
+        return false;
+
+    valid_ = true;
+    revision_ = cross_section.revision();
+    resolution_inv_ = 1.0 / resolution_;
+
+    origin_ = state.field_origin;
+    width_ = state.field_width;
+    height_ = state.field_height;
+    distances_ = state.field_distances;
+
+    return true;
+}
@@ -0,0 +1,75 @@
+#ifndef ED_LOCALIZATION_LIKELIHOOD_FIELD_H_
+#define ED_LOCALIZATION_LIKELIHOOD_FIELD_H_
+
+#include <geolib/datatypes.h>
+
+#include <vector>
+
+class WorldCrossSection;
+class FilterState;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Grid containing, for every cell, the distance to the nearest line segment of the world cross
+// section (clamped to a maximum distance). The grid is only rebuilt if the cross section changed,
+// after which the distance at any position can be looked up in constant time.
+
+class LikelihoodField
+{
+
+public:
+
+    LikelihoodField();
+
+    ~LikelihoodField();
+
+    void setResolution(double resolution) { resolution_ = resolution; invalidate(); }
+
+    void setMaxDistance(double max_distance) { max_distance_ = max_distance; invalidate(); }
+
+    double maxDistance() const { return max_distance_; }
+
+    // Rebuilds the distance grid if the cross section changed since the previous update. Returns true if it was rebuilt.
+    bool update(const WorldCrossSection& cross_section);
+
+    // Returns the distance to the nearest segment, or the maximum distance if the point is outside the grid
+    inline double distance(double x, double y) const
+    {
+        int mx = (x - origin_.x) * resolution_inv_;
+        int my = (y - origin_.y) * resolution_inv_;
+
+        if (mx < 0 || my < 0 || mx >= width_ || my >= height_)
+            return max_distance_;
+
+        return distances_[my * width_ + mx];
+    }
+
+    // Exports the distance grid, and imports it as the field of the given cross section (see FilterState).
+    // The grid is only imported if it was built with the same resolution and maximum distance.
+    void saveState(FilterState& state) const;
+    bool restoreState(const FilterState& state, const WorldCrossSection& cross_section);
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    double resolution() const { return resolution_; }
+    const geo::Vec2& origin() const { return origin_; }
+    const std::vector<float>& distances() const { return distances_; }
+
+private:
+
+    double resolution_;
+    double resolution_inv_;
+    double max_distance_;
+
+    bool valid_;
+    unsigned int revision_;
+
+    geo::Vec2 origin_;
+    int width_, height_;
+    std::vector<float> distances_;
+
+    void invalidate() { valid_ = false; }
+
+};
+
+#endif
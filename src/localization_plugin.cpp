@@ -2,6 +2,7 @@
 
 #include <ros/node_handle.h>
 #include <ros/subscribe_options.h>
+#include <ros/advertise_service_options.h>
 
 #include <ed/world_model.h>
 #include <ed/entity.h>
@@ -14,14 +15,48 @@
 #include <geolib/ros/msg_conversions.h>
 #include <geolib/ros/tf_conversions.h>
 
-#include <geometry_msgs/PoseArray.h>
+#include <diagnostic_msgs/DiagnosticArray.h>
 
 #include <ed/update_request.h>
 
+#include <sstream>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+const char* STAGE_NAMES[] = { "tf", "motion", "dedup", "render", "scoring", "resample", "scan_matching", "publish",
+                               "total" };
+
+// Adds the time since the previous stage ended to the stage statistics
+void addStageTime(RollingStatistics& stats, tue::Timer& timer, double& t_last)
+{
+    double t = timer.getElapsedTimeInMilliSec();
+    stats.add(t - t_last);
+    t_last = t;
+}
+
+void addKeyValue(diagnostic_msgs::DiagnosticStatus& status, const std::string& key, const std::string& value)
+{
+    diagnostic_msgs::KeyValue kv;
+    kv.key = key;
+    kv.value = value;
+    status.values.push_back(kv);
+}
+
+}
+
 // ----------------------------------------------------------------------------------------------------
 
-LocalizationPlugin::LocalizationPlugin() : have_previous_pose_(false), laser_offset_initialized_(false),
-    tf_listener_(0), tf_broadcaster_(0)
+LocalizationPlugin::LocalizationPlugin() : have_previous_pose_(false), map_to_odom_(geo::Pose3D::identity()),
+    have_map_to_odom_(false), initial_pose_requested_(false), initial_pose_yaw_(0), particles_publish_mode_(PUBLISH_ALL),
+    particles_max_poses_(100), particles_publish_period_(0),
+    scan_buffer_size_(10), scan_buffer_policy_(DROP_OLDEST), scan_batch_window_(0.05), num_dropped_scans_(0),
+    num_scans_(0), num_filter_updates_(0), diagnostics_period_(1.0),
+    async_(false), worker_thread_(0), stop_worker_(false), worker_busy_(false), has_async_pose_(false),
+    global_localization_requested_(false), do_scan_matching_(false), num_scan_matches_(0), state_save_period_(60),
+    tf_listener_(0), tf_broadcaster_(0), odom_buffer_(0)
 {
 }
 
@@ -29,6 +64,10 @@ LocalizationPlugin::LocalizationPlugin() : have_previous_pose_(false), laser_off
 
 LocalizationPlugin::~LocalizationPlugin()
 {
+    stopWorker();
+
+    if (!state_file_.empty())
+        saveState();
 
     // Get transform between map and odom frame
     tf::StampedTransform tf_map_odom;
@@ -43,12 +82,23 @@ LocalizationPlugin::~LocalizationPlugin()
     nh.setParam("initialpose/y", pos_map_odom.y());
     nh.setParam("initialpose/yaw", yaw_map_odom);
 
+    clearLasers();
+
     delete tf_listener_;
     delete tf_broadcaster_;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
+void LocalizationPlugin::clearLasers()
+{
+    for(unsigned int i = 0; i < lasers_.size(); ++i)
+        delete lasers_[i];
+    lasers_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 void LocalizationPlugin::configure(tue::Configuration config)
 {
     if (!tf_listener_)
@@ -57,7 +107,7 @@ void LocalizationPlugin::configure(tue::Configuration config)
     if (!tf_broadcaster_)
         tf_broadcaster_ = new tf::TransformBroadcaster;
 
-    std::string laser_topic;
+    std::string odom_topic;
 
     if (config.readGroup("odom_model", tue::config::REQUIRED))
     {
@@ -65,29 +115,217 @@ void LocalizationPlugin::configure(tue::Configuration config)
         config.value("odom_frame", odom_frame_id_);
         config.value("base_link_frame", base_link_frame_id_);
 
+        // Optional odometry topic. By default the odom to base link transform is taken from /tf.
+        config.value("odom_topic", odom_topic, tue::config::OPTIONAL);
+
+        int odom_buffer_size;
+        if (config.value("odom_buffer_size", odom_buffer_size, tue::config::OPTIONAL))
+            PoseBuffer::shared(odom_frame_id_, base_link_frame_id_).setCapacity(std::max(1, odom_buffer_size));
+
         odom_model_.configure(config);
         config.endGroup();
     }
 
-    if (config.readGroup("laser_model", tue::config::REQUIRED))
+    // Either a single laser ('laser_model') or multiple lasers ('laser_models'), each with its own topic. The
+    // worker (if any) uses the lasers, so it is stopped until the reconfiguration is done.
+    stopWorker();
+    clearLasers();
+
+    {
+        // Buffered scans refer to the lasers by index
+        boost::mutex::scoped_lock lock(mutex_);
+        scan_buffer_.clear();
+    }
+
+    if (config.readArray("laser_models", tue::config::OPTIONAL))
     {
-        config.value("topic", laser_topic);
-        laser_model_.configure(config);
+        while(config.nextArrayItem())
+        {
+            Laser* laser = new Laser;
+            config.value("topic", laser->topic);
+            laser->model.configure(config);
+            lasers_.push_back(laser);
+        }
+
+        config.endArray();
+    }
+    else if (config.readGroup("laser_model", tue::config::REQUIRED))
+    {
+        Laser* laser = new Laser;
+        config.value("topic", laser->topic);
+        laser->model.configure(config);
+        lasers_.push_back(laser);
+
         config.endGroup();
     }
 
+    if (lasers_.empty())
+        config.addError("No laser models configured.");
+
     config.value("num_particles", num_particles_);
 
+    std::string resample_method;
+    if (config.value("resample_method", resample_method, tue::config::OPTIONAL))
+    {
+        if (resample_method == "systematic")
+            particle_filter_.setResampleMethod(ParticleFilter::SYSTEMATIC);
+        else if (resample_method == "stratified")
+            particle_filter_.setResampleMethod(ParticleFilter::STRATIFIED);
+        else if (resample_method == "residual")
+            particle_filter_.setResampleMethod(ParticleFilter::RESIDUAL);
+        else
+            config.addError("Unknown resample method: '" + resample_method + "'. Options are 'systematic', 'stratified' and 'residual'.");
+    }
+
+    double cluster_cell_size = 0.5;
+    double cluster_angle_cell_size = 10 * M_PI / 180;
+    config.value("cluster_cell_size", cluster_cell_size, tue::config::OPTIONAL);
+    config.value("cluster_angle_cell_size", cluster_angle_cell_size, tue::config::OPTIONAL);
+    particle_filter_.setClusterResolution(cluster_cell_size, cluster_angle_cell_size);
+
+    if (config.readGroup("kld", tue::config::OPTIONAL))
+    {
+        int min_particles = 100;
+        int max_particles = 5000;
+        double err = 0.01;
+        double quantile = 0.99;
+        double bin_size = 0.5;
+        double bin_angle = 10 * M_PI / 180;
+
+        config.value("min_particles", min_particles, tue::config::OPTIONAL);
+        config.value("max_particles", max_particles, tue::config::OPTIONAL);
+        config.value("err", err, tue::config::OPTIONAL);
+        config.value("quantile", quantile, tue::config::OPTIONAL);
+        config.value("bin_size", bin_size, tue::config::OPTIONAL);
+        config.value("bin_angle", bin_angle, tue::config::OPTIONAL);
+
+        particle_filter_.setKLDSampling(std::max(1, min_particles), std::max(1, max_particles), err, quantile,
+                                        bin_size, bin_angle);
+
+        config.endGroup();
+    }
+
+    // The scan buffer is bounded (per laser), such that the latency stays bounded if the filter can not keep up
+    int scan_buffer_size = scan_buffer_size_;
+    config.value("scan_buffer_size", scan_buffer_size, tue::config::OPTIONAL);
+    scan_buffer_size_ = std::max(1, scan_buffer_size);
+
+    std::string scan_buffer_policy;
+    if (config.value("scan_buffer_policy", scan_buffer_policy, tue::config::OPTIONAL))
+    {
+        if (scan_buffer_policy == "drop_oldest")
+            scan_buffer_policy_ = DROP_OLDEST;
+        else if (scan_buffer_policy == "latest_only")
+            scan_buffer_policy_ = LATEST_ONLY;
+        else if (scan_buffer_policy == "integrate_odometry")
+            scan_buffer_policy_ = INTEGRATE_ODOMETRY;
+        else
+            config.addError("Unknown scan buffer policy: '" + scan_buffer_policy + "'. Options are 'drop_oldest', 'latest_only' and 'integrate_odometry'.");
+    }
+
+    // Global localization searches the whole world for the robot, and only seeds the particles around
+    // the best candidates. It is triggered by the 'ed/localization/global_localization' service, or
+    // with the first scan if 'on_startup' is set.
+    if (config.readGroup("global_localization", tue::config::OPTIONAL))
+    {
+        global_localizer_.configure(config);
+
+        bool on_startup = false;
+        config.value("on_startup", on_startup, tue::config::OPTIONAL);
+        global_localization_requested_ = on_startup;
+
+        config.endGroup();
+    }
+
+    // Scan matching refines the pose estimate after every filter update, such that accuracy does not only
+    // come from the number of particles
+    if (config.readGroup("scan_matching", tue::config::OPTIONAL))
+    {
+        do_scan_matching_ = true;
+        config.value("enabled", do_scan_matching_, tue::config::OPTIONAL);
+        scan_matcher_.configure(config);
+        config.endGroup();
+    }
+
+    // Particle publication: 'all', 'subset' (at most 'max_poses' particles) or 'clusters' (the cluster means),
+    // at most every 'publish_period' seconds. Nothing is published if there are no subscribers.
+    if (config.readGroup("particles", tue::config::OPTIONAL))
+    {
+        std::string mode;
+        if (config.value("mode", mode, tue::config::OPTIONAL))
+        {
+            if (mode == "all")
+                particles_publish_mode_ = PUBLISH_ALL;
+            else if (mode == "subset")
+                particles_publish_mode_ = PUBLISH_SUBSET;
+            else if (mode == "clusters")
+                particles_publish_mode_ = PUBLISH_CLUSTERS;
+            else
+                config.addError("Unknown particle publish mode: '" + mode + "'. Options are 'all', 'subset' and 'clusters'.");
+        }
+
+        int max_poses = particles_max_poses_;
+        config.value("max_poses", max_poses, tue::config::OPTIONAL);
+        particles_max_poses_ = std::max(1, max_poses);
+
+        config.value("publish_period", particles_publish_period_, tue::config::OPTIONAL);
+
+        config.endGroup();
+    }
+
+    // Scans of different lasers that are close together in time are combined into a single filter update
+    config.value("scan_batch_window", scan_batch_window_, tue::config::OPTIONAL);
+
+    // In async mode, the filter is updated in a separate thread, such that process() does not
+    // hold up the world model update loop
+    config.value("async", async_, tue::config::OPTIONAL);
+
+    // Diagnostics are published every 'diagnostics_period' seconds (0 disables them). The percentiles
+    // are taken over the last 'diagnostics_window' filter updates.
+    config.value("diagnostics_period", diagnostics_period_, tue::config::OPTIONAL);
+
+    int diagnostics_window = 100;
+    if (config.value("diagnostics_window", diagnostics_window, tue::config::OPTIONAL))
+    {
+        for(unsigned int i = 0; i < NUM_STAGES; ++i)
+            stage_stats_[i].setWindowSize(std::max(1, diagnostics_window));
+
+        num_samples_stats_.setWindowSize(std::max(1, diagnostics_window));
+        num_unique_samples_stats_.setWindowSize(std::max(1, diagnostics_window));
+        num_lines_stats_.setWindowSize(std::max(1, diagnostics_window));
+    }
+
     if (config.hasError())
         return;
 
     ros::NodeHandle nh;
 
-    // Subscribe to laser topic
-    ros::SubscribeOptions sub_options =
-            ros::SubscribeOptions::create<sensor_msgs::LaserScan>(
-                laser_topic, 1, boost::bind(&LocalizationPlugin::laserCallback, this, _1), ros::VoidPtr(), &cb_queue_);
-    sub_laser_ = nh.subscribe(sub_options);
+    // Subscribe to the laser topics
+    for(unsigned int i = 0; i < lasers_.size(); ++i)
+    {
+        ros::SubscribeOptions sub_options =
+                ros::SubscribeOptions::create<sensor_msgs::LaserScan>(
+                    lasers_[i]->topic, 1, boost::bind(&LocalizationPlugin::laserCallback, this, _1, i), ros::VoidPtr(), &cb_queue_);
+        lasers_[i]->sub = nh.subscribe(sub_options);
+    }
+
+    // Buffer the odometry locally, such that the scans can be matched to the odometry without tf lookups
+    odom_buffer_ = &PoseBuffer::shared(odom_frame_id_, base_link_frame_id_);
+
+    if (!odom_topic.empty())
+    {
+        ros::SubscribeOptions sub_odom_options =
+                ros::SubscribeOptions::create<nav_msgs::Odometry>(
+                    odom_topic, 100, boost::bind(&LocalizationPlugin::odomCallback, this, _1), ros::VoidPtr(), &cb_queue_);
+        sub_odom_ = nh.subscribe(sub_odom_options);
+    }
+    else
+    {
+        ros::SubscribeOptions sub_tf_options =
+                ros::SubscribeOptions::create<tf::tfMessage>(
+                    "/tf", 100, boost::bind(&LocalizationPlugin::tfCallback, this, _1), ros::VoidPtr(), &cb_queue_);
+        sub_odom_ = nh.subscribe(sub_tf_options);
+    }
 
     std::string initial_pose_topic;
     if (config.value("initial_pose_topic", initial_pose_topic, tue::config::OPTIONAL))
@@ -154,10 +392,34 @@ void LocalizationPlugin::configure(tue::Configuration config)
 
     particle_filter_.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
                                  yaw - 0.1, yaw + 0.1, 0.05);
+    have_map_to_odom_ = false;
+
+    // The full filter state of the previous run (if any) replaces the initial pose
+    if (config.readGroup("state", tue::config::OPTIONAL))
+    {
+        config.value("file", state_file_);
+        config.value("save_period", state_save_period_, tue::config::OPTIONAL);
+        config.endGroup();
+
+        if (!state_file_.empty())
+            restoreState();
+
+        last_state_save_time_ = ros::Time::now();
+    }
 
     config.value("robot_name", robot_name_);
 
     pub_particles_ = nh.advertise<geometry_msgs::PoseArray>("ed/localization/particles", 10);
+    pub_diagnostics_ = nh.advertise<diagnostic_msgs::DiagnosticArray>("ed/localization/diagnostics", 1);
+
+    ros::AdvertiseServiceOptions srv_options =
+            ros::AdvertiseServiceOptions::create<std_srvs::Empty>(
+                "ed/localization/global_localization", boost::bind(&LocalizationPlugin::srvGlobalLocalization, this, _1, _2),
+                ros::VoidPtr(), &cb_queue_);
+    srv_global_localization_ = nh.advertiseService(srv_options);
+
+    if (async_ && !worker_thread_)
+        worker_thread_ = new boost::thread(boost::bind(&LocalizationPlugin::workerLoop, this));
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -177,52 +439,306 @@ void LocalizationPlugin::process(const ed::WorldModel& world, ed::UpdateRequest&
     {
         // Set initial pose
 
-        geo::Vec2 p(initial_pose_msg_->pose.pose.position.x, initial_pose_msg_->pose.pose.position.y);
+        // Applied by processScans, before the next batch of scans
+        boost::mutex::scoped_lock lock(mutex_);
+        initial_pose_requested_ = true;
+        initial_pose_position_ = geo::Vec2(initial_pose_msg_->pose.pose.position.x,
+                                           initial_pose_msg_->pose.pose.position.y);
+        initial_pose_yaw_ = tf::getYaw(initial_pose_msg_->pose.pose.orientation);
+    }
 
-        double yaw = tf::getYaw(initial_pose_msg_->pose.pose.orientation);
+    if (async_)
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+
+        // Apply the result of the last filter update of the worker
+        if (has_async_pose_)
+        {
+            req.setPose(robot_name_, async_pose_);
+            has_async_pose_ = false;
+        }
 
-        particle_filter_.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
-                                     yaw - 0.1, yaw + 0.1, 0.05);
+        // If the worker is idle, hand it a snapshot of the world to process the buffered scans with.
+        // Entities are shared between world model copies, so this does not copy any geometry.
+        if (!scan_buffer_.empty() && !worker_busy_)
+        {
+            world_snapshot_.reset(new ed::WorldModel(world));
+            worker_busy_ = true;
+            worker_cond_.notify_one();
+        }
+    }
+    else
+    {
+        processScans(world, req);
     }
 
-    while(!scan_buffer_.empty())
+    if (diagnostics_period_ > 0)
     {
-        TransformStatus status = update(scan_buffer_.front(), world, req);
-        if (status == OK || status == TOO_OLD || status == UNKNOWN_ERROR)
-            scan_buffer_.pop();
-        else
+        ros::Time now = ros::Time::now();
+        if ((now - last_diagnostics_time_).toSec() >= diagnostics_period_ && publishDiagnostics())
+            last_diagnostics_time_ = now;
+    }
+
+    if (!state_file_.empty() && state_save_period_ > 0)
+    {
+        ros::Time now = ros::Time::now();
+        if ((now - last_state_save_time_).toSec() >= state_save_period_)
+        {
+            // If the worker is busy, try again next time
+            boost::mutex::scoped_lock lock(filter_mutex_, boost::try_to_lock);
+            if (lock.owns_lock())
+            {
+                saveState();
+                last_state_save_time_ = now;
+            }
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::processScans(const ed::WorldModel& world, ed::UpdateRequest& req)
+{
+    while(true)
+    {
+        // Only held per batch, such that others (e.g., the diagnostics) do not have to wait for the whole buffer
+        boost::mutex::scoped_lock filter_lock(filter_mutex_);
+
+        bool sensor_update;
+        scan_batch_.clear();
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+
+            if (initial_pose_requested_)
+            {
+                const geo::Vec2& p = initial_pose_position_;
+                double yaw = initial_pose_yaw_;
+
+                particle_filter_.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
+                                             yaw - 0.1, yaw + 0.1, 0.05);
+
+                // Make sure the new particles are updated with the next scan, without applying the
+                // odometry that was accumulated before the re-initialization
+                have_previous_pose_ = false;
+                have_map_to_odom_ = false;
+                initial_pose_requested_ = false;
+            }
+
+            // Only keep the newest scan of every laser
+            if (scan_buffer_policy_ == LATEST_ONLY)
+            {
+                for(unsigned int i = 0; i < scan_buffer_.size();)
+                {
+                    if (hasNewerScan(i))
+                    {
+                        scan_buffer_.erase(scan_buffer_.begin() + i);
+                        ++num_dropped_scans_;
+                    }
+                    else
+                        ++i;
+                }
+            }
+
+            if (scan_buffer_.empty())
+                break;
+
+            scan_batch_.push_back(scan_buffer_.front());
+
+            // With the INTEGRATE_ODOMETRY policy, only the newest scan of every laser gets a sensor update
+            sensor_update = (scan_buffer_policy_ != INTEGRATE_ODOMETRY || !hasNewerScan(0));
+
+            // Add the first scan of every other laser that is close enough in time
+            const ros::Time& stamp = scan_batch_.front().scan->header.stamp;
+            for(unsigned int i = 1; sensor_update && i < scan_buffer_.size(); ++i)
+            {
+                const BufferedScan& b = scan_buffer_[i];
+                if (std::abs((b.scan->header.stamp - stamp).toSec()) > scan_batch_window_)
+                    continue;
+
+                if (scan_buffer_policy_ == INTEGRATE_ODOMETRY && hasNewerScan(i))
+                    continue;
+
+                bool in_batch = false;
+                for(unsigned int j = 0; j < scan_batch_.size() && !in_batch; ++j)
+                    in_batch = (scan_batch_[j].laser == b.laser);
+
+                if (!in_batch)
+                    scan_batch_.push_back(b);
+            }
+        }
+
+        TransformStatus status = update(scan_batch_, world, req, sensor_update);
+        if (status != OK && status != TOO_OLD && status != UNKNOWN_ERROR)
             break;
+
+        boost::mutex::scoped_lock lock(mutex_);
+
+        // In async mode, scans may have been dropped from the buffer in the meantime
+        for(unsigned int j = 0; j < scan_batch_.size(); ++j)
+        {
+            for(std::deque<BufferedScan>::iterator it = scan_buffer_.begin(); it != scan_buffer_.end(); ++it)
+            {
+                if (it->scan == scan_batch_[j].scan)
+                {
+                    scan_buffer_.erase(it);
+                    break;
+                }
+            }
+        }
+
+        if (!sensor_update)
+            ++num_dropped_scans_;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::hasNewerScan(unsigned int i) const
+{
+    for(unsigned int j = i + 1; j < scan_buffer_.size(); ++j)
+    {
+        if (scan_buffer_[j].laser == scan_buffer_[i].laser)
+            return true;
+    }
+
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::workerLoop()
+{
+    while(true)
+    {
+        ed::WorldModelConstPtr world;
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            while(!stop_worker_ && !world_snapshot_)
+                worker_cond_.wait(lock);
+
+            if (stop_worker_)
+                return;
+
+            world = world_snapshot_;
+            world_snapshot_.reset();
+        }
+
+        // The resulting pose is not set here, but handed to process()
+        ed::UpdateRequest req;
+        processScans(*world, req);
+
+        boost::mutex::scoped_lock lock(mutex_);
+        worker_busy_ = false;
     }
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr& scan, const ed::WorldModel& world, ed::UpdateRequest& req)
+void LocalizationPlugin::stopWorker()
 {
-    if (!laser_offset_initialized_)
+    if (!worker_thread_)
+        return;
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_worker_ = true;
+    }
+    worker_cond_.notify_all();
+
+    worker_thread_->join();
+    delete worker_thread_;
+    worker_thread_ = 0;
+
+    // Ready to be restarted. A snapshot the worker did not get to is dropped, as is its result.
+    boost::mutex::scoped_lock lock(mutex_);
+    stop_worker_ = false;
+    worker_busy_ = false;
+    world_snapshot_.reset();
+    has_async_pose_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus LocalizationPlugin::initializeLaserOffset(unsigned int i_laser, const sensor_msgs::LaserScan& scan)
+{
+    tf::StampedTransform p_laser;
+    TransformStatus ts = this->transform(base_link_frame_id_, scan.header.frame_id, scan.header.stamp, p_laser);
+
+    if (ts != OK)
+        return ts;
+
+    geo::Transform2 offset(geo::Mat2(p_laser.getBasis()[0][0], p_laser.getBasis()[0][1],
+                                     p_laser.getBasis()[1][0], p_laser.getBasis()[1][1]),
+                           geo::Vec2(p_laser.getOrigin().getX(), p_laser.getOrigin().getY()));
+
+    bool upside_down = p_laser.getBasis()[2][2] < 0;
+    if (upside_down)
     {
-        tf::StampedTransform p_laser;
-        TransformStatus ts = this->transform(base_link_frame_id_, scan->header.frame_id, scan->header.stamp, p_laser);
+        offset.R.yx = -offset.R.yx;
+        offset.R.yy = -offset.R.yy;
+    }
+
+    double laser_height = p_laser.getOrigin().getZ();
+
+    Laser& laser = *lasers_[i_laser];
+    laser.model.setLaserOffset(offset, laser_height, upside_down);
+    laser.offset_initialized = true;
+
+    // Lasers at (about) the same height see the same cross section of the world, so it only has to be
+    // rendered once
+    for(unsigned int i = 0; i < lasers_.size(); ++i)
+    {
+        const Laser& other = *lasers_[i];
+        if (i != i_laser && other.offset_initialized && !other.model.sharesWorldCrossSection()
+                && std::abs(other.model.laser_height() - laser_height) < 0.01)
+        {
+            laser.model.shareWorldCrossSection(other.model);
+            break;
+        }
+    }
+
+    return OK;
+}
 
-        if (ts != OK)
-            return ts;
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus LocalizationPlugin::update(const std::vector<BufferedScan>& batch, const ed::WorldModel& world,
+                                           ed::UpdateRequest& req, bool sensor_update)
+{
+    tue::Timer timer;
+    timer.start();
+    double t_last = 0;
 
-        geo::Transform2 offset(geo::Mat2(p_laser.getBasis()[0][0], p_laser.getBasis()[0][1],
-                                         p_laser.getBasis()[1][0], p_laser.getBasis()[1][1]),
-                               geo::Vec2(p_laser.getOrigin().getX(), p_laser.getOrigin().getY()));
+    // The odometry, TF and particles are all taken at the time of the first scan
+    const sensor_msgs::LaserScanConstPtr& scan = batch.front().scan;
+    LaserModel& laser_model = lasers_[batch.front().laser]->model;
 
-        bool upside_down = p_laser.getBasis()[2][2] < 0;
-        if (upside_down)
+    for(unsigned int k = 0; k < batch.size(); ++k)
+    {
+        if (!lasers_[batch[k].laser]->offset_initialized)
         {
-            offset.R.yx = -offset.R.yx;
-            offset.R.yy = -offset.R.yy;
+            TransformStatus ts = initializeLaserOffset(batch[k].laser, *batch[k].scan);
+            if (ts != OK)
+                return ts;
         }
+    }
 
-        double laser_height = p_laser.getOrigin().getZ();
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Global localization (if requested)
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-        laser_model_.setLaserOffset(offset, laser_height, upside_down);
+    if (sensor_update)
+    {
+        bool global_localization = false;
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            std::swap(global_localization, global_localization_requested_);
+        }
 
-        laser_offset_initialized_ = true;
+        if (global_localization)
+            globalLocalization(world, laser_model, *scan);
     }
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
@@ -232,13 +748,20 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
     geo::Pose3D odom_to_base_link;
     Transform movement;
 
+    // Interpolated from the local odometry buffer. Only if nothing was buffered (e.g. if odom to base link
+    // is not a single tf edge), fall back to the tf listener.
     tf::StampedTransform odom_to_base_link_tf;
-    TransformStatus ts = transform(odom_frame_id_, base_link_frame_id_, scan->header.stamp, odom_to_base_link_tf);
+    TransformStatus ts = odom_buffer_->lookup(scan->header.stamp, odom_to_base_link_tf);
+    if (ts == UNKNOWN_ERROR)
+        ts = transform(odom_frame_id_, base_link_frame_id_, scan->header.stamp, odom_to_base_link_tf);
+
     if (ts != OK)
         return ts;
 
     geo::convert(odom_to_base_link_tf, odom_to_base_link);
 
+    // previous_pose_ is the odom pose at the time of the last filter update, so the movement
+    // accumulates until the filter is updated again
     if (have_previous_pose_)
     {
         geo::Pose3D delta = previous_pose_.inverse() * odom_to_base_link;
@@ -255,61 +778,183 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
         movement.set(geo::Transform2::identity());
     }
 
-    previous_pose_ = odom_to_base_link;
-    have_previous_pose_ = true;
-
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Check if particle filter is initialized
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    if (particle_filter_.samples().empty())
+    if (particle_filter_.sampleSet().empty())
         return UNKNOWN_ERROR;
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Update motion
+    // -     Check if the robot moved enough to update the filter
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    odom_model_.updatePoses(movement, 0, particle_filter_);
+    // Without a result since the last (re)initialization (e.g., after the filter state was restored), the
+    // filter has to be updated before anything can be published
+    bool update_filter = !have_previous_pose_ || !have_map_to_odom_ || odom_model_.isUpdateRequired(movement);
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     Update sensor
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    if (!sensor_update)
+    {
+        // Only integrate the odometry. If the filter was just (re)initialized, there is nothing to
+        // integrate yet, and the next sensor update will be forced anyway.
+        if (have_previous_pose_ && update_filter)
+        {
+            odom_model_.updatePoses(movement, 0, particle_filter_);
+            previous_pose_ = odom_to_base_link;
+        }
 
-//    tue::Timer timer;
-//    timer.start();
+        return OK;
+    }
 
-    laser_model_.updateWeights(world, *scan, particle_filter_);
+    ++num_scans_;
+    addStageTime(stage_stats_[STAGE_TF], timer, t_last);
 
-//    std::cout << "----------" << std::endl;
-//    std::cout << "Number of lines = " << laser_model_.lines_start().size() << std::endl;
-//    std::cout << "Total time = " << timer.getElapsedTimeInMilliSec() << " ms" << std::endl;
-//    std::cout << "Time per sample = " << timer.getElapsedTimeInMilliSec() / particle_filter_.samples().size() << " ms" << std::endl;
+    geo::Transform2 mean_pose;
 
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
-    // -     (Re)sample
-    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    if (update_filter)
+    {
+        previous_pose_ = odom_to_base_link;
+        have_previous_pose_ = true;
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // -     Update motion
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+        odom_model_.updatePoses(movement, 0, particle_filter_);
+
+        addStageTime(stage_stats_[STAGE_MOTION], timer, t_last);
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // -     Update sensor
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+        // The dynamic obstacle rejection compares the scans to the expected ranges at the previous pose
+        // estimate, moved with the odometry since then
+        geo::Pose3D reference_pose = map_to_odom_ * odom_to_base_link;
+        geo::Transform2 reference_pose_2d(geo::Mat2(reference_pose.R.xx, reference_pose.R.xy,
+                                                    reference_pose.R.yx, reference_pose.R.yy),
+                                          geo::Vec2(reference_pose.t.x, reference_pose.t.y));
+
+        for(unsigned int k = 0; k < batch.size(); ++k)
+        {
+            LaserModel& model = lasers_[batch[k].laser]->model;
+            if (have_map_to_odom_)
+                model.setReferencePose(reference_pose_2d);
+            else
+                model.clearReferencePose();
+        }
+
+        // The unique samples are determined once (by the first laser), and shared by all lasers
+        LaserModel& primary = lasers_.front()->model;
+        primary.updateUniqueSamples(particle_filter_.sampleSet());
+        const UniqueSampleSet& unique_samples = primary.unique_samples();
+
+        double time_render = 0;
+        double time_scoring = 0;
+        unsigned int num_lines = 0;
+
+        // Scan of the first laser in the batch that its model rendered the lines for (if any), for the scan matching
+        const sensor_msgs::LaserScan* match_scan = 0;
+
+        // If all samples are the same, the weights would not change
+        if (unique_samples.size() > 1)
+        {
+            // The log weight updates of all scans in the batch are summed, and applied at once
+            log_weight_updates_.assign(unique_samples.size(), 0);
+
+            bool updated = false;
+            for(unsigned int k = 0; k < batch.size(); ++k)
+            {
+                LaserModel& model = lasers_[batch[k].laser]->model;
+                bool model_updated = model.addLogWeightUpdates(world, *batch[k].scan, unique_samples, log_weight_updates_);
+                if (model_updated)
+                    updated = true;
+
+                if (&model == &laser_model)
+                    match_scan = model_updated ? batch[k].scan.get() : 0;
 
-    particle_filter_.resample(num_particles_);
+                time_render += model.time_render();
+                time_scoring += model.time_scoring();
+                num_lines += model.lines_start().size();
+            }
+
+            if (updated)
+            {
+                tue::Timer apply_timer;
+                apply_timer.start();
+                LaserModel::applyLogWeightUpdates(unique_samples, log_weight_updates_, particle_filter_);
+                time_scoring += apply_timer.getElapsedTimeInMilliSec();
+            }
+        }
+
+        ROS_DEBUG_STREAM("[ED Localization] Unique samples: " << unique_samples.size()
+                         << " / " << particle_filter_.sampleSet().size() << ", scans: " << batch.size());
+
+        // The laser models keep track of their own stages
+        stage_stats_[STAGE_DEDUP].add(primary.time_dedup());
+        stage_stats_[STAGE_RENDER].add(time_render);
+        stage_stats_[STAGE_SCORING].add(time_scoring);
+        t_last = timer.getElapsedTimeInMilliSec();
+
+        num_samples_stats_.add(particle_filter_.sampleSet().size());
+        num_unique_samples_stats_.add(unique_samples.size());
+        num_lines_stats_.add(num_lines);
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // -     (Re)sample
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+        particle_filter_.resample(num_particles_);
+
+        // Get the best pose (2D): the mean of the dominant cluster. Averaging over all samples would
+        // give a meaningless pose if there are multiple hypotheses.
+        const std::vector<ParticleCluster>& clusters = particle_filter_.calculateClusters();
+        mean_pose = clusters.front().mean;
+
+        ROS_DEBUG_STREAM("[ED Localization] Clusters: " << clusters.size() << ", dominant cluster weight: "
+                         << clusters.front().weight);
+
+        addStageTime(stage_stats_[STAGE_RESAMPLE], timer, t_last);
+
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+        // -     Scan matching (refines the best pose)
+        // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+        // Only if the lines were rendered for this scan
+        if (do_scan_matching_ && match_scan)
+        {
+            if (refinePose(laser_model, *match_scan, mean_pose))
+                ++num_scan_matches_;
+
+            addStageTime(stage_stats_[STAGE_SCAN_MATCHING], timer, t_last);
+        }
+
+        // Convert best pose to 3D
+        geo::Pose3D map_to_base_link;
+        map_to_base_link.t = geo::Vector3(mean_pose.t.x, mean_pose.t.y, 0);
+        map_to_base_link.R = geo::Matrix3(mean_pose.R.xx, mean_pose.R.xy, 0,
+                                          mean_pose.R.yx, mean_pose.R.yy, 0,
+                                          0     , 0     , 1);
+
+        map_to_odom_ = map_to_base_link * odom_to_base_link.inverse();
+        have_map_to_odom_ = true;
+        ++num_filter_updates_;
+    }
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Publish result
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    // Get the best pose (2D)
-    geo::Transform2 mean_pose = particle_filter_.calculateMeanPose();
-
-    // Convert best pose to 3D
-    geo::Pose3D map_to_base_link;
-    map_to_base_link.t = geo::Vector3(mean_pose.t.x, mean_pose.t.y, 0);
-    map_to_base_link.R = geo::Matrix3(mean_pose.R.xx, mean_pose.R.xy, 0,
-                                      mean_pose.R.yx, mean_pose.R.yy, 0,
-                                      0     , 0     , 1);
+    // Nothing to publish before the first filter update
+    if (!have_map_to_odom_)
+        return OK;
 
-    geo::Pose3D map_to_odom = map_to_base_link * odom_to_base_link.inverse();
+    // If the filter was not updated, the last map to odom transform still holds
+    geo::Pose3D map_to_base_link = map_to_odom_ * odom_to_base_link;
 
     // Convert to TF transform
     tf::StampedTransform map_to_odom_tf;
-    geo::convert(map_to_odom, map_to_odom_tf);
+    geo::convert(map_to_odom_, map_to_odom_tf);
 
     // Set frame id's and time stamp
     map_to_odom_tf.frame_id_ = map_frame_id_;
@@ -319,52 +964,53 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
     // Publish TF
     tf_broadcaster_->sendTransform(map_to_odom_tf);
 
+    // Share the result with other plugins (e.g. the localization tf plugin)
+    PoseBuffer::shared(map_frame_id_, odom_frame_id_).insert(map_to_odom_tf.stamp_, map_to_odom_tf);
+
     if (!robot_name_.empty())
-        req.setPose(robot_name_, map_to_base_link);
+    {
+        if (async_)
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            async_pose_ = map_to_base_link;
+            has_async_pose_ = true;
+        }
+        else
+            req.setPose(robot_name_, map_to_base_link);
+    }
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Publish particles
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
-    const std::vector<Sample>& samples = particle_filter_.samples();
-    geometry_msgs::PoseArray particles_msg;
-    particles_msg.poses.resize(samples.size());
-    for(unsigned int i = 0; i < samples.size(); ++i)
-    {
-        const geo::Transform2& p = samples[i].pose.matrix();
-
-        geo::Pose3D pose_3d;
-        pose_3d.t = geo::Vector3(p.t.x, p.t.y, 0);
-        pose_3d.R = geo::Matrix3(p.R.xx, p.R.xy, 0,
-                                 p.R.yx, p.R.yy, 0,
-                                 0     , 0     , 1);
+    // Only publish the particles if they changed
+    if (update_filter)
+        publishParticles(scan->header.stamp);
 
-        geo::convert(pose_3d, particles_msg.poses[i]);
-    }
+    addStageTime(stage_stats_[STAGE_PUBLISH], timer, t_last);
 
-    particles_msg.header.frame_id = "/map";
-    particles_msg.header.stamp = scan->header.stamp;
-
-    pub_particles_.publish(particles_msg);
+    if (update_filter)
+        stage_stats_[STAGE_TOTAL].add(t_last);
 
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // -     Visualization
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
 
     bool visualize = false;
-    if (visualize)
+    if (visualize && update_filter)
     {
         int grid_size = 800;
         double grid_resolution = 0.025;
 
         cv::Mat rgb_image(grid_size, grid_size, CV_8UC3, cv::Scalar(10, 10, 10));
 
+        // Only the scan of the first laser in the batch is shown
         std::vector<geo::Vector3> sensor_points;
-        laser_model_.renderer().rangesToPoints(laser_model_.sensor_ranges(), sensor_points);
+        laser_model.renderer().rangesToPoints(laser_model.sensor_ranges(), sensor_points);
 
         geo::Transform2 best_pose = mean_pose;
 
-        geo::Transform2 laser_pose = best_pose * laser_model_.laser_offset();
+        geo::Transform2 laser_pose = best_pose * laser_model.laser_offset();
         for(unsigned int i = 0; i < sensor_points.size(); ++i)
         {
             const geo::Vec2& p = laser_pose * geo::Vec2(sensor_points[i].x, sensor_points[i].y);
@@ -377,8 +1023,8 @@ TransformStatus LocalizationPlugin::update(const sensor_msgs::LaserScanConstPtr&
             }
         }
 
-        const std::vector<geo::Vec2>& lines_start = laser_model_.lines_start();
-        const std::vector<geo::Vec2>& lines_end = laser_model_.lines_end();
+        const std::vector<geo::Vec2>& lines_start = laser_model.lines_start();
+        const std::vector<geo::Vec2>& lines_end = laser_model.lines_end();
 
         for(unsigned int i = 0; i < lines_start.size(); ++i)
         {
@@ -436,7 +1082,7 @@ TransformStatus LocalizationPlugin::transform(const std::string& target_frame, c
             tf::StampedTransform latest_transform;
             tf_listener_->lookupTransform(target_frame, source_frame, ros::Time(0), latest_transform);
 
-            if (scan_buffer_.front()->header.stamp > latest_transform.stamp_)
+            if (time > latest_transform.stamp_)
             {
                 // Scan is too new
                 return TOO_RECENT;
@@ -460,9 +1106,113 @@ TransformStatus LocalizationPlugin::transform(const std::string& target_frame, c
 
 // ----------------------------------------------------------------------------------------------------
 
-void LocalizationPlugin::laserCallback(const sensor_msgs::LaserScanConstPtr& msg)
+bool LocalizationPlugin::publishDiagnostics()
+{
+    // Do not wait for the worker: if it is busy, the diagnostics are published in a later cycle
+    boost::mutex::scoped_try_lock filter_lock(filter_mutex_);
+    if (!filter_lock.owns_lock())
+        return false;
+
+    // The scan buffer counters are shared with the laser callback
+    unsigned int num_dropped_scans;
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        num_dropped_scans = num_dropped_scans_;
+        num_dropped_scans_ = 0;
+    }
+
+    diagnostic_msgs::DiagnosticStatus status;
+    status.name = "ed_localization";
+    status.hardware_id = "none";
+    status.level = diagnostic_msgs::DiagnosticStatus::OK;
+
+    std::stringstream s_msg;
+    s_msg << num_filter_updates_ << " filter updates / " << num_scans_ << " scans (" << num_dropped_scans << " dropped)";
+    status.message = s_msg.str();
+
+    if (num_filter_updates_ == 0 && num_scans_ > 0)
+        status.level = diagnostic_msgs::DiagnosticStatus::WARN;
+
+    for(unsigned int i = 0; i < NUM_STAGES; ++i)
+    {
+        const RollingStatistics& stats = stage_stats_[i];
+
+        std::stringstream s;
+        s.precision(3);
+        s << std::fixed << "p50: " << stats.percentile(0.5) << ", p90: " << stats.percentile(0.9)
+          << ", p99: " << stats.percentile(0.99) << ", max: " << stats.max();
+
+        addKeyValue(status, std::string(STAGE_NAMES[i]) + " [ms]", s.str());
+    }
+
+    // Beam counts are of the first laser
+    const LaserModel& laser_model = lasers_.front()->model;
+
+    std::stringstream s_counts;
+    s_counts << laser_model.num_samples() << " samples, " << laser_model.num_unique_samples() << " unique, "
+             << laser_model.lines_start().size() << " lines, " << laser_model.num_selected_beams() << " beams ("
+             << laser_model.num_skipped_beams() << " skipped, " << laser_model.num_dynamic_beams()
+             << " dynamic) (mean: " << num_samples_stats_.mean() << ", "
+             << num_unique_samples_stats_.mean() << ", " << num_lines_stats_.mean() << ")";
+    addKeyValue(status, "counts", s_counts.str());
+
+    const std::vector<ParticleCluster>& clusters = particle_filter_.clusters();
+    if (!clusters.empty())
+    {
+        std::stringstream s_clusters;
+        s_clusters << clusters.size() << " clusters, dominant: weight " << clusters.front().weight << ", "
+                   << clusters.front().num_samples << " samples";
+        addKeyValue(status, "clusters", s_clusters.str());
+    }
+
+    if (do_scan_matching_)
+    {
+        std::stringstream s_match;
+        s_match << num_scan_matches_ << " accepted, last: " << scan_matcher_.num_iterations() << " iterations, "
+                << scan_matcher_.num_correspondences() << " / " << scan_matcher_.num_points()
+                << " correspondences, rms: " << scan_matcher_.rms_error();
+        addKeyValue(status, "scan matching", s_match.str());
+    }
+
+    diagnostic_msgs::DiagnosticArray msg;
+    msg.header.stamp = ros::Time::now();
+    msg.status.push_back(status);
+
+    pub_diagnostics_.publish(msg);
+
+    num_scans_ = 0;
+    num_filter_updates_ = 0;
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::laserCallback(const sensor_msgs::LaserScanConstPtr& msg, unsigned int i_laser)
 {
-    scan_buffer_.push(msg);
+    boost::mutex::scoped_lock lock(mutex_);
+
+    scan_buffer_.push_back(BufferedScan(i_laser, msg));
+
+    // The buffer size is per laser: if this laser has too many scans buffered, its own oldest scan is dropped,
+    // such that a fast laser does not push out the scans of the others
+    unsigned int num_buffered = 0;
+    std::deque<BufferedScan>::iterator oldest = scan_buffer_.end();
+    for(std::deque<BufferedScan>::iterator it = scan_buffer_.begin(); it != scan_buffer_.end(); ++it)
+    {
+        if (it->laser != i_laser)
+            continue;
+
+        if (num_buffered == 0)
+            oldest = it;
+        ++num_buffered;
+    }
+
+    if (num_buffered > scan_buffer_size_)
+    {
+        scan_buffer_.erase(oldest);
+        ++num_dropped_scans_;
+    }
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -474,4 +1224,280 @@ void LocalizationPlugin::initialPoseCallback(const geometry_msgs::PoseWithCovari
 
 // ----------------------------------------------------------------------------------------------------
 
+void LocalizationPlugin::tfCallback(const tf::tfMessageConstPtr& msg)
+{
+    odom_buffer_->insert(*msg, odom_frame_id_, base_link_frame_id_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::odomCallback(const nav_msgs::OdometryConstPtr& msg)
+{
+    tf::Transform odom_to_base_link;
+    tf::poseMsgToTF(msg->pose.pose, odom_to_base_link);
+    odom_buffer_->insert(msg->header.stamp, odom_to_base_link);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::publishParticles(const ros::Time& stamp)
+{
+    if (pub_particles_.getNumSubscribers() == 0)
+        return;
+
+    if (particles_publish_period_ > 0 && !last_particles_time_.isZero() && last_particles_time_ <= stamp
+            && (stamp - last_particles_time_).toSec() < particles_publish_period_)
+        return;
+
+    last_particles_time_ = stamp;
+
+    std::vector<geometry_msgs::Pose>& poses = particles_msg_.poses;
+
+    if (particles_publish_mode_ == PUBLISH_CLUSTERS)
+    {
+        const std::vector<ParticleCluster>& clusters = particle_filter_.clusters();
+
+        poses.resize(clusters.size());
+        for(unsigned int i = 0; i < clusters.size(); ++i)
+        {
+            const geo::Transform2& p = clusters[i].mean;
+            double yaw = p.rotation();
+
+            geometry_msgs::Pose& pose = poses[i];
+            pose.position.x = p.t.x;
+            pose.position.y = p.t.y;
+            pose.position.z = 0;
+            pose.orientation.x = 0;
+            pose.orientation.y = 0;
+            pose.orientation.z = sin(yaw / 2);
+            pose.orientation.w = cos(yaw / 2);
+        }
+    }
+    else
+    {
+        // Read directly from the sample set, which avoids building the array-of-structures view
+        const SampleSet& samples = static_cast<const ParticleFilter&>(particle_filter_).sampleSet();
+
+        // After resampling all weights are equal, so an evenly strided subset is representative
+        unsigned int n = samples.size();
+        if (particles_publish_mode_ == PUBLISH_SUBSET)
+            n = std::min(n, particles_max_poses_);
+
+        double stride = n > 0 ? (double)samples.size() / n : 0;
+
+        poses.resize(n);
+        for(unsigned int i = 0; i < n; ++i)
+        {
+            unsigned int j = i * stride;
+            double yaw = samples.yaw[j];
+
+            geometry_msgs::Pose& pose = poses[i];
+            pose.position.x = samples.x[j];
+            pose.position.y = samples.y[j];
+            pose.position.z = 0;
+            pose.orientation.x = 0;
+            pose.orientation.y = 0;
+            pose.orientation.z = sin(yaw / 2);
+            pose.orientation.w = cos(yaw / 2);
+        }
+    }
+
+    particles_msg_.header.frame_id = "/map";
+    particles_msg_.header.stamp = stamp;
+
+    pub_particles_.publish(particles_msg_);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::srvGlobalLocalization(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    global_localization_requested_ = true;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LocalizationPlugin::globalLocalization(const ed::WorldModel& world, LaserModel& laser_model,
+                                            const sensor_msgs::LaserScan& scan)
+{
+    tue::Timer timer;
+    timer.start();
+
+    laser_model.updateWorldCrossSection(world);
+
+    std::vector<geo::Transform2> seeds;
+    global_localizer_.localize(laser_model.world_cross_section(), scan, laser_model.laser_offset(),
+                               laser_model.laser_upside_down(), seeds);
+
+    if (seeds.empty())
+    {
+        ROS_WARN("[ED Localization] Global localization did not find any candidate pose");
+        return;
+    }
+
+    particle_filter_.initUniform(seeds, global_localizer_.seed_window(), global_localizer_.seed_step(),
+                                 global_localizer_.seed_angle_window(), global_localizer_.seed_angle_step());
+
+    // The new particles are updated with this scan, without applying any odometry
+    have_previous_pose_ = false;
+    have_map_to_odom_ = false;
+
+    ROS_INFO_STREAM("[ED Localization] Global localization: " << seeds.size() << " seeds, best pose: ["
+                    << seeds.front().t.x << ", " << seeds.front().t.y << "], yaw: " << seeds.front().rotation()
+                    << ", score: " << global_localizer_.best_score() << " (" << timer.getElapsedTimeInMilliSec() << " ms)");
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::refinePose(const LaserModel& laser_model, const sensor_msgs::LaserScan& scan,
+                                    geo::Transform2& pose)
+{
+    // Scan end points in the base frame. The ranges of an upside down laser are mirrored, as in the laser model.
+    scan_match_points_.clear();
+    double max_range = 0;
+    for(unsigned int i = 0; i < scan.ranges.size(); ++i)
+    {
+        double r = scan.ranges[i];
+
+        // Invalid (Inf, NaN) or out of range measurement
+        if (!(r > scan.range_min && r < scan.range_max))
+            continue;
+
+        double a = scan.angle_min + i * scan.angle_increment;
+        if (laser_model.laser_upside_down())
+            a = scan.angle_min + scan.angle_max - a;
+
+        scan_match_points_.push_back(laser_model.laser_offset() * geo::Vec2(r * cos(a), r * sin(a)));
+        max_range = std::max(max_range, r);
+    }
+
+    // The lines the beam model selected around the samples also cover the pose. Otherwise (likelihood field
+    // model), select the lines around the pose.
+    const std::vector<geo::Vec2>* lines_start = &laser_model.lines_start();
+    const std::vector<geo::Vec2>* lines_end = &laser_model.lines_end();
+    if (lines_start->empty())
+    {
+        scan_match_lines_start_.clear();
+        scan_match_lines_end_.clear();
+        laser_model.world_cross_section().query((pose * laser_model.laser_offset()).t,
+                                                max_range + scan_matcher_.max_correspondence_distance(),
+                                                scan_match_lines_start_, scan_match_lines_end_);
+        lines_start = &scan_match_lines_start_;
+        lines_end = &scan_match_lines_end_;
+    }
+
+    geo::Transform2 refined_pose = pose;
+    if (!scan_matcher_.match(*lines_start, *lines_end, scan_match_points_, refined_pose))
+    {
+        ROS_DEBUG_STREAM("[ED Localization] Scan match rejected (" << scan_matcher_.num_correspondences() << " / "
+                         << scan_matcher_.num_points() << " correspondences)");
+        return false;
+    }
+
+    // Move the samples of the dominant cluster along, such that the next update starts from the refined
+    // pose. The other clusters (alternative hypotheses) are left as they are.
+    geo::Transform2 correction = refined_pose * pose.inverse();
+
+    SampleSet& samples = particle_filter_.sampleSet();
+    const std::vector<unsigned int>& sample_clusters = particle_filter_.sampleClusters();
+    for(unsigned int j = 0; j < samples.size(); ++j)
+    {
+        if (sample_clusters[j] == 0)
+            samples.setPose(j, correction * samples.pose(j));
+    }
+
+    // Keep the cluster statistics consistent with the moved samples
+    particle_filter_.calculateClusters();
+
+    pose = refined_pose;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::saveState()
+{
+    const SampleSet& samples = particle_filter_.sampleSet();
+    if (samples.empty())
+        return false;
+
+    state_.clear();
+
+    state_.sample_poses.resize(samples.size());
+    state_.sample_weights.resize(samples.size());
+    for(unsigned int i = 0; i < samples.size(); ++i)
+    {
+        state_.sample_poses[i] = samples.pose(i);
+        state_.sample_weights[i] = samples.weight[i];
+    }
+
+    // The samples are at the odom pose of the last filter update
+    state_.has_odom_pose = have_previous_pose_;
+    state_.odom_x = previous_pose_.t.x;
+    state_.odom_y = previous_pose_.t.y;
+    state_.odom_yaw = atan2(previous_pose_.R.yx, previous_pose_.R.xx);
+
+    if (!lasers_.empty())
+        lasers_.front()->model.saveState(state_);
+
+    std::string error;
+    if (!state_.save(state_file_, error))
+    {
+        ROS_ERROR_STREAM("[ED Localization] Could not save the filter state: " << error);
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LocalizationPlugin::restoreState()
+{
+    std::string error;
+    if (!state_.load(state_file_, error))
+    {
+        ROS_WARN_STREAM("[ED Localization] No filter state restored: " << error);
+        return false;
+    }
+
+    if (state_.sample_poses.empty())
+        return false;
+
+    SampleSet& samples = particle_filter_.sampleSet();
+    samples.clear();
+    samples.reserve(state_.sample_poses.size());
+    for(unsigned int i = 0; i < state_.sample_poses.size(); ++i)
+        samples.push_back(state_.sample_poses[i], state_.sample_weights[i]);
+
+    particle_filter_.normalize();
+
+    // As with the initial pose on the parameter server, the odometry is assumed to have continued. The motion
+    // since the samples were saved is applied with the next filter update, which is forced because there is
+    // no result yet.
+    have_map_to_odom_ = false;
+    have_previous_pose_ = state_.has_odom_pose;
+    if (have_previous_pose_)
+    {
+        previous_pose_ = geo::Pose3D::identity();
+        previous_pose_.t = geo::Vector3(state_.odom_x, state_.odom_y, 0);
+        previous_pose_.R.setRPY(0, 0, state_.odom_yaw);
+    }
+
+    if (!lasers_.empty())
+        lasers_.front()->model.restoreState(state_);
+
+    ROS_INFO_STREAM("[ED Localization] Restored " << state_.sample_poses.size() << " samples and "
+                    << state_.entities.size() << " cached entities from '" << state_file_ << "'");
+
+    // The loaded buffers are not needed anymore
+    state_.clear();
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 ED_REGISTER_PLUGIN(LocalizationPlugin)
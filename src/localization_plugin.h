@@ -12,26 +12,32 @@
 #include <ros/callback_queue.h>
 #include <sensor_msgs/LaserScan.h>
 #include <geometry_msgs/PoseWithCovarianceStamped.h>
+#include <geometry_msgs/PoseArray.h>
+#include <ros/service_server.h>
+#include <std_srvs/Empty.h>
 
 // SCAN BUFFER
-#include <queue>
+#include <deque>
 
 // TF
 #include <tf/transform_listener.h>
 #include <tf/transform_broadcaster.h>
+#include <nav_msgs/Odometry.h>
+#include "pose_buffer.h"
 
 // MODELS
 #include "particle_filter.h"
 #include "odom_model.h"
 #include "laser_model.h"
+#include "global_localizer.h"
+#include "scan_matcher.h"
+#include "filter_state.h"
 
-enum TransformStatus
-{
-    TOO_RECENT,
-    TOO_OLD,
-    OK,
-    UNKNOWN_ERROR
-};
+// DIAGNOSTICS
+#include "rolling_statistics.h"
+
+// ASYNC
+#include <boost/thread.hpp>
 
 class LocalizationPlugin : public ed::Plugin
 {
@@ -62,34 +68,249 @@ private:
 
     // MODELS
 
-    LaserModel laser_model_;
+    // One laser model per laser, each with its own offset and beam configuration. The unique samples are
+    // determined by the first laser and shared by all lasers, and lasers at (nearly) the same height share
+    // one world cross section.
+    struct Laser
+    {
+        Laser() : offset_initialized(false) {}
+
+        std::string topic;
+        LaserModel model;
+        ros::Subscriber sub;
+        bool offset_initialized;
+    };
+
+    std::vector<Laser*> lasers_;
+
     OdomModel odom_model_;
 
+    // Combined log weight update of all lasers in a filter update
+    std::vector<double> log_weight_updates_;
+
+    void clearLasers();
+
+    // Looks up the laser offset, and shares the world cross section with a laser at the same height (if any)
+    TransformStatus initializeLaserOffset(unsigned int i_laser, const sensor_msgs::LaserScan& scan);
+
 
     // ROS
 
     ros::CallbackQueue cb_queue_;
 
-    ros::Subscriber sub_laser_;
-
-    void laserCallback(const sensor_msgs::LaserScanConstPtr& msg);
+    void laserCallback(const sensor_msgs::LaserScanConstPtr& msg, unsigned int i_laser);
 
+    // Odom pose at the time of the last filter update
     bool have_previous_pose_;
     geo::Pose3D previous_pose_;
 
+    // Result of the last filter update (since the last (re)initialization of the filter, if any)
+    geo::Pose3D map_to_odom_;
+    bool have_map_to_odom_;
+
     ros::Subscriber sub_initial_pose_;
 
     geometry_msgs::PoseWithCovarianceStampedConstPtr initial_pose_msg_;
 
+    // Set by process(), handled before the next batch of scans (such that process() does not have to wait
+    // for the worker). Protected by mutex_.
+    bool initial_pose_requested_;
+    geo::Vec2 initial_pose_position_;
+    double initial_pose_yaw_;
+
     void initialPoseCallback(const geometry_msgs::PoseWithCovarianceStampedConstPtr& msg);
 
     ros::Publisher pub_particles_;
 
-    bool laser_offset_initialized_;
+    enum ParticlePublishMode
+    {
+        // All particles
+        PUBLISH_ALL,
+
+        // At most particles_max_poses_ particles, evenly spread over the sample set
+        PUBLISH_SUBSET,
+
+        // The mean pose of every cluster, dominant cluster first
+        PUBLISH_CLUSTERS
+    };
+
+    ParticlePublishMode particles_publish_mode_;
+
+    unsigned int particles_max_poses_;
+
+    // Minimum time between two particle messages (0 publishes after every filter update)
+    double particles_publish_period_;
+
+    ros::Time last_particles_time_;
+
+    // Reused for every publication, such that the pose array is not reallocated
+    geometry_msgs::PoseArray particles_msg_;
+
+    void publishParticles(const ros::Time& stamp);
 
 
     // Scan buffer
-    std::queue<sensor_msgs::LaserScanConstPtr> scan_buffer_;
+
+    enum ScanBufferPolicy
+    {
+        // Process all buffered scans. If the buffer is full, the oldest scan is dropped
+        DROP_OLDEST,
+
+        // Only process the newest scan, all older scans are dropped
+        LATEST_ONLY,
+
+        // Only process the newest scan, but apply the odometry of all older scans (motion update only)
+        INTEGRATE_ODOMETRY
+    };
+
+    struct BufferedScan
+    {
+        BufferedScan(unsigned int laser_, const sensor_msgs::LaserScanConstPtr& scan_) : laser(laser_), scan(scan_) {}
+
+        unsigned int laser;   // index in lasers_
+        sensor_msgs::LaserScanConstPtr scan;
+    };
+
+    std::deque<BufferedScan> scan_buffer_;
+
+    unsigned int scan_buffer_size_;
+
+    ScanBufferPolicy scan_buffer_policy_;
+
+    // Scans of different lasers that are at most this far apart (in seconds) are combined in one filter update
+    double scan_batch_window_;
+
+    // Scans of the current filter update
+    std::vector<BufferedScan> scan_batch_;
+
+    // Returns true if a newer scan of the same laser as scan_buffer_[i] is buffered. Requires mutex_.
+    bool hasNewerScan(unsigned int i) const;
+
+    // Protected by mutex_ (it is incremented by the laser callback)
+    unsigned int num_dropped_scans_;
+
+
+    // DIAGNOSTICS
+
+    enum Stage
+    {
+        STAGE_TF,
+        STAGE_MOTION,
+        STAGE_DEDUP,
+        STAGE_RENDER,
+        STAGE_SCORING,
+        STAGE_RESAMPLE,
+        STAGE_SCAN_MATCHING,
+        STAGE_PUBLISH,
+        STAGE_TOTAL,
+        NUM_STAGES
+    };
+
+    // Durations (ms) of the stages of the last filter updates
+    RollingStatistics stage_stats_[NUM_STAGES];
+
+    RollingStatistics num_samples_stats_;
+    RollingStatistics num_unique_samples_stats_;
+    RollingStatistics num_lines_stats_;
+
+    // Protected by filter_mutex_
+    unsigned int num_scans_;
+    unsigned int num_filter_updates_;
+
+    ros::Publisher pub_diagnostics_;
+
+    double diagnostics_period_;
+
+    ros::Time last_diagnostics_time_;
+
+    // Returns false if the diagnostics could not be published because the filter was busy
+    bool publishDiagnostics();
+
+
+    // ASYNC
+
+    bool async_;
+
+    boost::thread* worker_thread_;
+
+    // Protects the scan buffer, the worker state and the async result
+    boost::mutex mutex_;
+
+    // Protects the particle filter and the models. Held for a full batch of scans.
+    boost::mutex filter_mutex_;
+
+    boost::condition_variable worker_cond_;
+
+    bool stop_worker_;
+
+    bool worker_busy_;
+
+    // World model copy the worker processes the buffered scans with
+    ed::WorldModelConstPtr world_snapshot_;
+
+    // Result of the last filter update of the worker, set in the next call to process()
+    bool has_async_pose_;
+    geo::Pose3D async_pose_;
+
+    void workerLoop();
+
+    // Waits for the worker to finish its current update, and stops it
+    void stopWorker();
+
+    // Processes the buffered scans according to the scan buffer policy
+    void processScans(const ed::WorldModel& world, ed::UpdateRequest& req);
+
+
+    // GLOBAL LOCALIZATION
+
+    GlobalLocalizer global_localizer_;
+
+    // Set by the service (or on startup), handled with the next scan. Protected by mutex_.
+    bool global_localization_requested_;
+
+    ros::ServiceServer srv_global_localization_;
+
+    bool srvGlobalLocalization(std_srvs::Empty::Request& req, std_srvs::Empty::Response& res);
+
+    // Re-initializes the particles around the best poses of a search over the whole world
+    void globalLocalization(const ed::WorldModel& world, LaserModel& laser_model, const sensor_msgs::LaserScan& scan);
+
+
+    // SCAN MATCHING
+
+    // If enabled, the mean of the dominant cluster is refined by matching the scan to the world cross section
+    bool do_scan_matching_;
+
+    ScanMatcher scan_matcher_;
+
+    unsigned int num_scan_matches_;   // number of accepted matches
+
+    // Workspace
+    std::vector<geo::Vec2> scan_match_points_;
+    std::vector<geo::Vec2> scan_match_lines_start_;
+    std::vector<geo::Vec2> scan_match_lines_end_;
+
+    // Refines 'pose' (of the robot base) with 'scan', which must be the scan 'laser_model' was last updated
+    // with (its lines are reused), and moves the samples of the dominant cluster along. Returns false if the
+    // match was not accepted.
+    bool refinePose(const LaserModel& laser_model, const sensor_msgs::LaserScan& scan, geo::Transform2& pose);
+
+
+    // STATE PERSISTENCE
+
+    // If set, the samples and the map caches of the first laser are saved to this file periodically and on
+    // shutdown, and loaded on startup (see FilterState)
+    std::string state_file_;
+
+    double state_save_period_;
+
+    ros::Time last_state_save_time_;
+
+    FilterState state_;
+
+    // Require filter_mutex_ (or no worker thread)
+    bool saveState();
+    bool restoreState();
 
 
     // TF
@@ -101,7 +322,19 @@ private:
     tf::TransformListener* tf_listener_;
     tf::TransformBroadcaster* tf_broadcaster_;
 
-    TransformStatus update(const sensor_msgs::LaserScanConstPtr& laser_msg_, const ed::WorldModel& world, ed::UpdateRequest& req);
+    // Odom to base link transforms, fed from /tf (or an odom topic) and shared with other plugins
+    PoseBuffer* odom_buffer_;
+
+    ros::Subscriber sub_odom_;
+
+    void tfCallback(const tf::tfMessageConstPtr& msg);
+
+    void odomCallback(const nav_msgs::OdometryConstPtr& msg);
+
+    // All scans in the batch update the filter at once, at the time of the first scan. If sensor_update is
+    // false, only the odometry up to that time is applied to the particles.
+    TransformStatus update(const std::vector<BufferedScan>& batch, const ed::WorldModel& world, ed::UpdateRequest& req,
+                           bool sensor_update = true);
 
     TransformStatus transform(const std::string& target_frame, const std::string& source_frame,
                               const ros::Time& time, tf::StampedTransform& transform);
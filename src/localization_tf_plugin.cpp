@@ -1,4 +1,5 @@
 #include "localization_tf_plugin.h"
+#include "pose_buffer.h"
 
 #include <ros/node_handle.h>
 #include <ros/subscribe_options.h>
@@ -19,7 +20,8 @@
 
 // ----------------------------------------------------------------------------------------------------
 
-LocalizationTFPlugin::LocalizationTFPlugin() : tf_listener_()
+LocalizationTFPlugin::LocalizationTFPlugin() : tf_listener_(), map_frame_id_("map"), map_to_odom_buffer_(0),
+    odom_to_base_link_buffer_(0), max_age_(0.5)
 {
 }
 
@@ -27,6 +29,7 @@ LocalizationTFPlugin::LocalizationTFPlugin() : tf_listener_()
 
 LocalizationTFPlugin::~LocalizationTFPlugin()
 {
+    delete tf_listener_;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -35,8 +38,27 @@ void LocalizationTFPlugin::configure(tue::Configuration config)
 {
     config.value("robot_name", robot_name_);
 
+    base_link_frame_id_ = "/" + robot_name_ + "/base_link";
+    config.value("map_frame", map_frame_id_, tue::config::OPTIONAL);
+    config.value("base_link_frame", base_link_frame_id_, tue::config::OPTIONAL);
+
     delete tf_listener_;
-    tf_listener_ = new tf::TransformListener;
+    tf_listener_ = 0;
+
+    if (config.value("odom_frame", odom_frame_id_, tue::config::OPTIONAL))
+    {
+        map_to_odom_buffer_ = &PoseBuffer::shared(map_frame_id_, odom_frame_id_);
+        odom_to_base_link_buffer_ = &PoseBuffer::shared(odom_frame_id_, base_link_frame_id_);
+    }
+    else
+    {
+        // Without the buffers, tf is the only source of the pose
+        map_to_odom_buffer_ = 0;
+        odom_to_base_link_buffer_ = 0;
+        tf_listener_ = new tf::TransformListener;
+    }
+
+    config.value("max_age", max_age_, tue::config::OPTIONAL);
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -49,10 +71,32 @@ void LocalizationTFPlugin::initialize()
 
 void LocalizationTFPlugin::process(const ed::WorldModel& world, ed::UpdateRequest& req)
 {
+    if (map_to_odom_buffer_)
+    {
+        // Only use a recent result of the localization plugin (it may have stalled), combined with the odom
+        // pose at the same time
+        ros::Time stamp;
+        tf::Transform map_to_odom, odom_to_base_link;
+        if (map_to_odom_buffer_->latest(stamp, map_to_odom) && (ros::Time::now() - stamp).toSec() <= max_age_
+                && odom_to_base_link_buffer_->lookup(stamp, odom_to_base_link) == OK)
+        {
+            geo::Pose3D pose;
+            geo::convert(map_to_odom * odom_to_base_link, pose);
+
+            req.setPose(robot_name_, pose);
+            return;
+        }
+    }
+
+    // The listener (and its subscription to all of tf) is only created once the buffers are insufficient. Its
+    // first lookups fail until it received the transforms.
+    if (!tf_listener_)
+        tf_listener_ = new tf::TransformListener;
+
     try
     {
         tf::StampedTransform t_pose;
-        tf_listener_->lookupTransform("/" + robot_name_ + "/base_link", "map", ros::Time(0), t_pose);
+        tf_listener_->lookupTransform(base_link_frame_id_, map_frame_id_, ros::Time(0), t_pose);
 
         geo::Pose3D pose;
         geo::convert(t_pose, pose);
@@ -9,6 +9,8 @@
 // TF
 #include <tf/transform_listener.h>
 
+class PoseBuffer;
+
 class LocalizationTFPlugin : public ed::Plugin
 {
 
@@ -27,8 +29,22 @@ public:
 private:
 
     std::string robot_name_;
+
+    // Only created if there is no odom frame configured, or the buffers can not provide the pose
     tf::TransformListener* tf_listener_;
 
+    std::string map_frame_id_;
+    std::string odom_frame_id_;
+    std::string base_link_frame_id_;
+
+    // If an odom frame is configured, the pose is composed from the buffers that are fed by the
+    // localization plugin (if it runs in the same process), without a tf lookup
+    PoseBuffer* map_to_odom_buffer_;
+    PoseBuffer* odom_to_base_link_buffer_;
+
+    // Buffered map to odom transforms older than this (seconds) are not used, and tf is used instead
+    double max_age_;
+
 };
 
 #endif
@@ -1,42 +1,31 @@
 #include "odom_model.h"
 
-// ----------------------------------------------------------------------------------------------------
-
-// Draw randomly from a zero-mean Gaussian distribution, with standard
-// deviation sigma.
-// We use the polar form of the Box-Muller transformation, explained here:
-//   http://www.taygeta.com/random/gaussian.html
-double generateRandomGaussian(double sigma)
-{
-    double x1, x2, w, r;
-
-    do
-    {
-        do { r = drand48(); } while (r==0.0);
-        x1 = 2.0 * r - 1.0;
-        do { r = drand48(); } while (r==0.0);
-        x2 = 2.0 * r - 1.0;
-        w = x1*x1 + x2*x2;
-    } while(w > 1.0 || w==0.0);
-
-    return(sigma * x2 * sqrt(-2.0*log(w)/w));
-}
+#include <boost/bind.hpp>
 
 // ----------------------------------------------------------------------------------------------------
 
-OdomModel::OdomModel()
+OdomModel::OdomModel() : seed_(0), current_samples_(0)
 {
     alpha1 = 0.2;
     alpha2 = 0.2;
     alpha3 = 0.2;
     alpha4 = 0.2;
     alpha5 = 0.2;
+
+    update_min_d_ = 0;
+    update_min_a_ = 0;
+
+    createGenerators(RandomGenerator());
+
+    update_job_ = boost::bind(&OdomModel::updateBlock, this, _1);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
 OdomModel::~OdomModel()
 {
+    for(unsigned int i = 0; i < generators_.size(); ++i)
+        delete generators_[i];
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -48,35 +37,124 @@ void OdomModel::configure(tue::Configuration config)
     config.value("alpha3", alpha3);
     config.value("alpha4", alpha4);
     config.value("alpha5", alpha5);
+
+    config.value("update_min_d", update_min_d_, tue::config::OPTIONAL);
+    config.value("update_min_a", update_min_a_, tue::config::OPTIONAL);
+
+    int seed;
+    if (config.value("seed", seed, tue::config::OPTIONAL))
+        seed_ = seed;
+
+    // Only worth it for large sample sets (0 = one thread per core)
+    int num_threads = 1;
+    if (config.value("num_threads", num_threads, tue::config::OPTIONAL))
+        worker_pool_.setNumThreads(std::max(0, num_threads));
+
+    // Restart the streams from the (new) seed, with one engine per thread
+    createGenerators(*generators_[0]);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomModel::setGenerator(const NormalGenerator& generator)
+{
+    createGenerators(generator);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomModel::createGenerators(const NormalGenerator& prototype)
+{
+    std::vector<NormalGenerator*> generators(worker_pool_.numThreads());
+    for(unsigned int i = 0; i < generators.size(); ++i)
+    {
+        generators[i] = prototype.clone();
+        generators[i]->seed(seed_ + i);
+    }
+
+    // The prototype may be one of the current engines, so they are only deleted afterwards
+    for(unsigned int i = 0; i < generators_.size(); ++i)
+        delete generators_[i];
+
+    generators_.swap(generators);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OdomModel::isUpdateRequired(const Transform& movement) const
+{
+    return movement.translation().length() >= update_min_d_ || std::abs(movement.rotation()) >= update_min_a_;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
 void OdomModel::updatePoses(const Transform& movement, double dt, ParticleFilter& pf)
 {
+    // Without movement there is no noise either, so the samples stay where they are
+    if (movement.rotation() == 0 && movement.translation().x == 0 && movement.translation().y == 0)
+        return;
+
     double delta_trans_sq = movement.translation().length2();
 
-    double delta_rot = movement.rotation();
-    double delta_rot_sq = delta_rot * delta_rot;
+    current_delta_rot_ = movement.rotation();
+    double delta_rot_sq = current_delta_rot_ * current_delta_rot_;
 
     // Compute noise standard deviations
-    double trans_hat_stddev = sqrt(alpha3 * delta_trans_sq + alpha1 * delta_rot_sq);
-    double rot_hat_stddev = sqrt(alpha4 * delta_rot_sq + alpha2 * delta_trans_sq);
-    double strafe_hat_stddev = sqrt(alpha1 * delta_rot_sq + alpha5 * delta_trans_sq);
+    trans_hat_stddev_ = sqrt(alpha3 * delta_trans_sq + alpha1 * delta_rot_sq);
+    rot_hat_stddev_ = sqrt(alpha4 * delta_rot_sq + alpha2 * delta_trans_sq);
+    strafe_hat_stddev_ = sqrt(alpha1 * delta_rot_sq + alpha5 * delta_trans_sq);
 
-    for(std::vector<Sample>::iterator it = pf.samples().begin(); it != pf.samples().end(); ++it)
-    {
-        Sample& sample = *it;
+    current_samples_ = &pf.sampleSet();
+    current_movement_ = movement.matrix();
+
+    noise_.resize(3 * current_samples_->size());
+
+    worker_pool_.run(update_job_);
+
+    current_samples_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void OdomModel::updateBlock(unsigned int i_thread)
+{
+    SampleSet& samples = *current_samples_;
+
+    // Every thread gets a consecutive block of samples
+    unsigned int num_threads = worker_pool_.numThreads();
+    unsigned int i_begin = samples.size() * i_thread / num_threads;
+    unsigned int i_end = samples.size() * (i_thread + 1) / num_threads;
 
+    if (i_begin == i_end)
+        return;
+
+    // Draw all noise samples for the block at once, with the engine of this thread
+    generators_[i_thread]->fillNormal(&noise_[3 * i_begin], 3 * (i_end - i_begin));
+
+    // The movement is the same for all samples, so only the noise has to be composed per sample:
+    //     pose * movement * noise = (R_p * R_m * R_n, t_p + R_p * (t_m + R_m * t_n))
+    const geo::Transform2& m = current_movement_;
+
+    for(unsigned int i = i_begin; i < i_end; ++i)
+    {
         // Sample pose differences
-        double delta_trans_hat = generateRandomGaussian(trans_hat_stddev);
-        double delta_rot_hat = generateRandomGaussian(rot_hat_stddev);
-        double delta_strafe_hat = generateRandomGaussian(strafe_hat_stddev);
+        double delta_trans_hat = trans_hat_stddev_ * noise_[3 * i];
+        double delta_rot_hat = rot_hat_stddev_ * noise_[3 * i + 1];
+        double delta_strafe_hat = strafe_hat_stddev_ * noise_[3 * i + 2];
+
+        // Translation in the sample frame
+        double tx = m.t.x + m.R.xx * delta_trans_hat + m.R.xy * delta_strafe_hat;
+        double ty = m.t.y + m.R.yx * delta_trans_hat + m.R.yy * delta_strafe_hat;
+
+        double c = samples.cos_yaw[i];
+        double s = samples.sin_yaw[i];
 
-        geo::Transform2 noise;
-        noise.t = geo::Vec2(delta_trans_hat, delta_strafe_hat);
-        noise.setRotation(delta_rot_hat);
+        double yaw = samples.yaw[i] + current_delta_rot_ + delta_rot_hat;
+        if (yaw > M_PI)
+            yaw -= 2 * M_PI;
+        else if (yaw < -M_PI)
+            yaw += 2 * M_PI;
 
-        sample.pose.set(sample.pose.matrix() * movement.matrix() * noise);
+        samples.setPose(i, samples.x[i] + c * tx - s * ty, samples.y[i] + s * tx + c * ty, yaw);
     }
 }
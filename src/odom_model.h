@@ -2,6 +2,8 @@
 #define ED_LOCALIZATION_ODOM_MODEL_H_
 
 #include "particle_filter.h"
+#include "random_generator.h"
+#include "worker_pool.h"
 #include <geolib/datatypes.h>
 
 #include <tue/config/configuration.h>
@@ -19,6 +21,18 @@ public:
 
     void updatePoses(const Transform& movement, double dt, ParticleFilter& pf);
 
+    // Replaces the engine of the odometry noise. Every worker thread gets its own copy of 'generator',
+    // seeded with (seed + i_thread), such that the noise is reproducible for a given seed and number of
+    // threads.
+    void setGenerator(const NormalGenerator& generator);
+
+    // Returns true if the movement is large enough to justify a filter update (update_min_d /
+    // update_min_a). With the default thresholds (0), every movement requires an update.
+    bool isUpdateRequired(const Transform& movement) const;
+
+    double update_min_d() const { return update_min_d_; }
+    double update_min_a() const { return update_min_a_; }
+
 private:
 
     double alpha1;
@@ -27,6 +41,35 @@ private:
     double alpha4;
     double alpha5;
 
+    double update_min_d_;
+    double update_min_a_;
+
+    // MULTI-THREADING
+    WorkerPool worker_pool_;
+
+    // Noise engine of every worker thread
+    uint64_t seed_;
+    std::vector<NormalGenerator*> generators_;
+
+    // Replaces the engines of all threads by seeded copies of 'prototype'
+    void createGenerators(const NormalGenerator& prototype);
+
+    // State of the current call to updatePoses, used by the worker threads
+    SampleSet* current_samples_;
+    geo::Transform2 current_movement_;
+    double current_delta_rot_;
+    double trans_hat_stddev_;
+    double rot_hat_stddev_;
+    double strafe_hat_stddev_;
+
+    boost::function<void(unsigned int)> update_job_;
+
+    // Moves the block of samples assigned to thread i_thread
+    void updateBlock(unsigned int i_thread);
+
+    // Scratch buffer for the normally distributed noise of all samples
+    std::vector<double> noise_;
+
 };
 
 #endif
@@ -0,0 +1,458 @@
+#include "opencl_scorer.h"
+
+#include "world_cross_section.h"
+
+#ifdef ED_LOCALIZATION_OPENCL
+
+#include <CL/cl.h>
+
+#include <sstream>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Work items per pose (must be a power of two)
+const size_t WORK_GROUP_SIZE = 64;
+
+const char* KERNEL_SOURCE =
+"__kernel void score(__global const float* poses, __global const float4* lines, const unsigned int num_lines,\n"
+"                    __global const float2* beam_dirs, __global const unsigned int* table_rows,\n"
+"                    const unsigned int num_beams, __global const float* table, const float range_min,\n"
+"                    const float range_max, const float table_range_max, const float inv_res,\n"
+"                    const float initial, __local float* partial, __global float* weight_updates)\n"
+"{\n"
+"    unsigned int i_pose = get_group_id(0);\n"
+"    unsigned int lid = get_local_id(0);\n"
+"    unsigned int lsize = get_local_size(0);\n"
+"\n"
+"    /* World to laser transform */\n"
+"    __global const float* p = poses + 6 * i_pose;\n"
+"    float r_xx = p[0], r_xy = p[1], r_yx = p[2], r_yy = p[3], t_x = p[4], t_y = p[5];\n"
+"\n"
+"    float sum = 0;\n"
+"    for(unsigned int k = lid; k < num_beams; k += lsize)\n"
+"    {\n"
+"        float dx = beam_dirs[k].x;\n"
+"        float dy = beam_dirs[k].y;\n"
+"\n"
+"        /* Nearest intersection of the beam with any segment (0 if none) */\n"
+"        float r_best = 0;\n"
+"        for(unsigned int s = 0; s < num_lines; ++s)\n"
+"        {\n"
+"            float4 l = lines[s];\n"
+"            float x1 = r_xx * l.x + r_xy * l.y + t_x;\n"
+"            float y1 = r_yx * l.x + r_yy * l.y + t_y;\n"
+"            float ex = r_xx * l.z + r_xy * l.w + t_x - x1;\n"
+"            float ey = r_yx * l.z + r_yy * l.w + t_y - y1;\n"
+"\n"
+"            float den = dx * ey - dy * ex;\n"
+"            if (den == 0)\n"
+"                continue;\n"
+"\n"
+"            /* Distance along the beam, and position along the segment */\n"
+"            float r = (x1 * ey - y1 * ex) / den;\n"
+"            float t = (x1 * dy - y1 * dx) / den;\n"
+"            if (t < 0 || t > 1 || r <= 0 || r < range_min || r > range_max)\n"
+"                continue;\n"
+"\n"
+"            if (r_best == 0 || r < r_best)\n"
+"                r_best = r;\n"
+"        }\n"
+"\n"
+"        float map_range = min(r_best, table_range_max);\n"
+"        sum += table[table_rows[k] + (int)(map_range * inv_res + 0.5f)];\n"
+"    }\n"
+"\n"
+"    partial[lid] = sum;\n"
+"    barrier(CLK_LOCAL_MEM_FENCE);\n"
+"\n"
+"    for(unsigned int s = lsize / 2; s > 0; s >>= 1)\n"
+"    {\n"
+"        if (lid < s)\n"
+"            partial[lid] += partial[lid + s];\n"
+"        barrier(CLK_LOCAL_MEM_FENCE);\n"
+"    }\n"
+"\n"
+"    if (lid == 0)\n"
+"        weight_updates[i_pose] = initial + partial[0];\n"
+"}\n";
+
+// ----------------------------------------------------------------------------------------------------
+
+// Device buffer that only grows, such that it is not reallocated every scan
+struct DeviceBuffer
+{
+    DeviceBuffer() : mem(0), size(0) {}
+
+    cl_mem mem;
+    size_t size;   // bytes
+};
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+struct OpenCLScorer::Impl
+{
+    Impl() : context(0), queue(0), program(0), kernel(0), num_lines(0) {}
+
+    ~Impl()
+    {
+        DeviceBuffer* buffers[] = { &poses, &lines, &beam_dirs, &table_rows, &table, &weight_updates };
+        for(unsigned int i = 0; i < sizeof(buffers) / sizeof(buffers[0]); ++i)
+        {
+            if (buffers[i]->mem)
+                clReleaseMemObject(buffers[i]->mem);
+        }
+
+        if (kernel)
+            clReleaseKernel(kernel);
+        if (program)
+            clReleaseProgram(program);
+        if (queue)
+            clReleaseCommandQueue(queue);
+        if (context)
+            clReleaseContext(context);
+    }
+
+    // Makes sure the buffer can hold 'size' bytes, and (blocking) writes 'data' to it
+    bool write(DeviceBuffer& buffer, const void* data, size_t size)
+    {
+        if (size == 0)
+            return true;
+
+        if (buffer.size < size)
+        {
+            if (buffer.mem)
+                clReleaseMemObject(buffer.mem);
+
+            cl_int err;
+            buffer.mem = clCreateBuffer(context, CL_MEM_READ_WRITE, size, 0, &err);
+            if (err != CL_SUCCESS)
+            {
+                buffer.mem = 0;
+                buffer.size = 0;
+                return false;
+            }
+
+            buffer.size = size;
+        }
+
+        if (!data)
+            return true;
+
+        return clEnqueueWriteBuffer(queue, buffer.mem, CL_TRUE, 0, size, data, 0, 0, 0) == CL_SUCCESS;
+    }
+
+    cl_context context;
+    cl_command_queue queue;
+    cl_program program;
+    cl_kernel kernel;
+
+    DeviceBuffer poses;
+    DeviceBuffer lines;
+    DeviceBuffer beam_dirs;
+    DeviceBuffer table_rows;
+    DeviceBuffer table;
+    DeviceBuffer weight_updates;
+
+    unsigned int num_lines;
+};
+
+#else
+
+struct OpenCLScorer::Impl
+{
+};
+
+#endif
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLScorer::OpenCLScorer() : impl_(0), cross_section_(0), cross_section_revision_(0), lookup_table_revision_(0),
+    has_lookup_table_(false)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+OpenCLScorer::~OpenCLScorer()
+{
+    delete impl_;
+}
+
+#ifdef ED_LOCALIZATION_OPENCL
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::initialize(std::string& error)
+{
+    delete impl_;
+    impl_ = 0;
+    cross_section_ = 0;
+    has_lookup_table_ = false;
+
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, 0, &num_platforms) != CL_SUCCESS || num_platforms == 0)
+    {
+        error = "No OpenCL platform found.";
+        return false;
+    }
+
+    std::vector<cl_platform_id> platforms(num_platforms);
+    clGetPlatformIDs(num_platforms, &platforms[0], 0);
+
+    // Prefer a GPU, but accept any device
+    cl_device_id device = 0;
+    for(unsigned int i = 0; i < platforms.size() && !device; ++i)
+    {
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 1, &device, 0) != CL_SUCCESS)
+            device = 0;
+    }
+
+    for(unsigned int i = 0; i < platforms.size() && !device; ++i)
+    {
+        if (clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_ALL, 1, &device, 0) != CL_SUCCESS)
+            device = 0;
+    }
+
+    if (!device)
+    {
+        error = "No OpenCL device found.";
+        return false;
+    }
+
+    Impl* impl = new Impl;
+
+    cl_int err;
+    impl->context = clCreateContext(0, 1, &device, 0, 0, &err);
+    if (err == CL_SUCCESS)
+        impl->queue = clCreateCommandQueue(impl->context, device, 0, &err);
+
+    if (err == CL_SUCCESS)
+        impl->program = clCreateProgramWithSource(impl->context, 1, &KERNEL_SOURCE, 0, &err);
+
+    if (err != CL_SUCCESS)
+    {
+        std::stringstream s;
+        s << "Could not create the OpenCL context (error " << err << ").";
+        error = s.str();
+        delete impl;
+        return false;
+    }
+
+    if (clBuildProgram(impl->program, 1, &device, "-cl-fast-relaxed-math", 0, 0) != CL_SUCCESS)
+    {
+        size_t log_size = 0;
+        clGetProgramBuildInfo(impl->program, device, CL_PROGRAM_BUILD_LOG, 0, 0, &log_size);
+
+        std::string log(log_size, '\0');
+        if (log_size > 0)
+            clGetProgramBuildInfo(impl->program, device, CL_PROGRAM_BUILD_LOG, log_size, &log[0], 0);
+
+        error = "Could not build the OpenCL kernel: " + log;
+        delete impl;
+        return false;
+    }
+
+    impl->kernel = clCreateKernel(impl->program, "score", &err);
+    if (err != CL_SUCCESS)
+    {
+        error = "Could not create the OpenCL kernel.";
+        delete impl;
+        return false;
+    }
+
+    impl_ = impl;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::setCrossSection(const WorldCrossSection& cross_section)
+{
+    if (!impl_)
+        return false;
+
+    if (&cross_section == cross_section_ && cross_section.revision() == cross_section_revision_)
+        return true;
+
+    const std::vector<geo::Vec2>& lines_start = cross_section.lines_start();
+    const std::vector<geo::Vec2>& lines_end = cross_section.lines_end();
+
+    lines_.resize(4 * lines_start.size());
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        lines_[4 * i] = lines_start[i].x;
+        lines_[4 * i + 1] = lines_start[i].y;
+        lines_[4 * i + 2] = lines_end[i].x;
+        lines_[4 * i + 3] = lines_end[i].y;
+    }
+
+    if (!impl_->write(impl_->lines, lines_.empty() ? 0 : &lines_[0], lines_.size() * sizeof(float)))
+    {
+        cross_section_ = 0;
+        return false;
+    }
+
+    impl_->num_lines = lines_start.size();
+    cross_section_ = &cross_section;
+    cross_section_revision_ = cross_section.revision();
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::setLookupTable(const std::vector<float>& table, unsigned int revision)
+{
+    if (!impl_)
+        return false;
+
+    if (has_lookup_table_ && revision == lookup_table_revision_)
+        return true;
+
+    if (table.empty() || !impl_->write(impl_->table, &table[0], table.size() * sizeof(float)))
+    {
+        has_lookup_table_ = false;
+        return false;
+    }
+
+    has_lookup_table_ = true;
+    lookup_table_revision_ = revision;
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::score(const std::vector<geo::Transform2>& laser_poses, const std::vector<geo::Vec2>& beam_directions,
+                         const std::vector<unsigned int>& table_rows, double range_min, double range_max,
+                         double table_range_max, double table_inv_resolution, double initial,
+                         std::vector<double>& weight_updates)
+{
+    if (!impl_ || !cross_section_ || !has_lookup_table_)
+        return false;
+
+    weight_updates.resize(laser_poses.size());
+    if (laser_poses.empty())
+        return true;
+
+    // The kernel transforms the segments from world to laser frame
+    poses_.resize(6 * laser_poses.size());
+    for(unsigned int i = 0; i < laser_poses.size(); ++i)
+    {
+        geo::Transform2 t = laser_poses[i].inverse();
+        float* p = &poses_[6 * i];
+        p[0] = t.R.xx;
+        p[1] = t.R.xy;
+        p[2] = t.R.yx;
+        p[3] = t.R.yy;
+        p[4] = t.t.x;
+        p[5] = t.t.y;
+    }
+
+    beam_directions_.resize(2 * beam_directions.size());
+    for(unsigned int k = 0; k < beam_directions.size(); ++k)
+    {
+        beam_directions_[2 * k] = beam_directions[k].x;
+        beam_directions_[2 * k + 1] = beam_directions[k].y;
+    }
+
+    cl_uint num_beams = beam_directions.size();
+    cl_uint num_lines = impl_->num_lines;
+
+    if (!impl_->write(impl_->poses, &poses_[0], poses_.size() * sizeof(float))
+            || !impl_->write(impl_->beam_dirs, num_beams ? &beam_directions_[0] : 0, beam_directions_.size() * sizeof(float))
+            || !impl_->write(impl_->table_rows, num_beams ? &table_rows[0] : 0, num_beams * sizeof(cl_uint))
+            || !impl_->write(impl_->weight_updates, 0, laser_poses.size() * sizeof(float)))
+        return false;
+
+    // Buffers that are still empty (no beams, no lines) are never read, but must be valid arguments
+    if (!impl_->lines.mem && !impl_->write(impl_->lines, 0, 4 * sizeof(float)))
+        return false;
+    if (!impl_->beam_dirs.mem && !impl_->write(impl_->beam_dirs, 0, 2 * sizeof(float)))
+        return false;
+    if (!impl_->table_rows.mem && !impl_->write(impl_->table_rows, 0, sizeof(cl_uint)))
+        return false;
+
+    cl_float f_range_min = range_min;
+    cl_float f_range_max = range_max;
+    cl_float f_table_range_max = table_range_max;
+    cl_float f_inv_res = table_inv_resolution;
+    cl_float f_initial = initial;
+
+    cl_kernel kernel = impl_->kernel;
+    cl_int err = CL_SUCCESS;
+    err |= clSetKernelArg(kernel, 0, sizeof(cl_mem), &impl_->poses.mem);
+    err |= clSetKernelArg(kernel, 1, sizeof(cl_mem), &impl_->lines.mem);
+    err |= clSetKernelArg(kernel, 2, sizeof(cl_uint), &num_lines);
+    err |= clSetKernelArg(kernel, 3, sizeof(cl_mem), &impl_->beam_dirs.mem);
+    err |= clSetKernelArg(kernel, 4, sizeof(cl_mem), &impl_->table_rows.mem);
+    err |= clSetKernelArg(kernel, 5, sizeof(cl_uint), &num_beams);
+    err |= clSetKernelArg(kernel, 6, sizeof(cl_mem), &impl_->table.mem);
+    err |= clSetKernelArg(kernel, 7, sizeof(cl_float), &f_range_min);
+    err |= clSetKernelArg(kernel, 8, sizeof(cl_float), &f_range_max);
+    err |= clSetKernelArg(kernel, 9, sizeof(cl_float), &f_table_range_max);
+    err |= clSetKernelArg(kernel, 10, sizeof(cl_float), &f_inv_res);
+    err |= clSetKernelArg(kernel, 11, sizeof(cl_float), &f_initial);
+    err |= clSetKernelArg(kernel, 12, WORK_GROUP_SIZE * sizeof(cl_float), 0);
+    err |= clSetKernelArg(kernel, 13, sizeof(cl_mem), &impl_->weight_updates.mem);
+
+    if (err != CL_SUCCESS)
+        return false;
+
+    // One work group per pose
+    size_t local_size = WORK_GROUP_SIZE;
+    size_t global_size = laser_poses.size() * WORK_GROUP_SIZE;
+    if (clEnqueueNDRangeKernel(impl_->queue, kernel, 1, 0, &global_size, &local_size, 0, 0, 0) != CL_SUCCESS)
+        return false;
+
+    weight_updates_.resize(laser_poses.size());
+    if (clEnqueueReadBuffer(impl_->queue, impl_->weight_updates.mem, CL_TRUE, 0, weight_updates_.size() * sizeof(float),
+                            &weight_updates_[0], 0, 0, 0) != CL_SUCCESS)
+        return false;
+
+    for(unsigned int i = 0; i < weight_updates_.size(); ++i)
+        weight_updates[i] = weight_updates_[i];
+
+    return true;
+}
+
+#else
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::initialize(std::string& error)
+{
+    error = "Built without OpenCL support (enable the ED_LOCALIZATION_OPENCL CMake option).";
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::setCrossSection(const WorldCrossSection& cross_section)
+{
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::setLookupTable(const std::vector<float>& table, unsigned int revision)
+{
+    return false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool OpenCLScorer::score(const std::vector<geo::Transform2>& laser_poses, const std::vector<geo::Vec2>& beam_directions,
+                         const std::vector<unsigned int>& table_rows, double range_min, double range_max,
+                         double table_range_max, double table_inv_resolution, double initial,
+                         std::vector<double>& weight_updates)
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,74 @@
+#ifndef ED_LOCALIZATION_OPENCL_SCORER_H_
+#define ED_LOCALIZATION_OPENCL_SCORER_H_
+
+#include <geolib/datatypes.h>
+
+#include <string>
+#include <vector>
+
+class WorldCrossSection;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Scores a batch of laser poses with the beam model on an OpenCL device (e.g., the GPU of a Jetson), in a
+// single kernel launch: one work group per pose, of which the work items share the beams. Every beam is
+// intersected with all segments of the world cross section, so no culling or ordering is needed. The
+// segments and the lookup table are only uploaded when they change, so per scan only the poses and the
+// beams are transferred. The kernel uses single precision.
+//
+// Only functional if built with ED_LOCALIZATION_OPENCL (CMake option). Otherwise, initialize() fails.
+
+class OpenCLScorer
+{
+
+public:
+
+    OpenCLScorer();
+
+    ~OpenCLScorer();
+
+    // Selects a device (a GPU if available) and builds the kernel. Returns false (and the reason in 'error')
+    // if that is not possible.
+    bool initialize(std::string& error);
+
+    bool initialized() const { return impl_ != 0; }
+
+    // Uploads the segments of the cross section, if it changed since the previous call
+    bool setCrossSection(const WorldCrossSection& cross_section);
+
+    // Uploads the lookup table (see LaserModel) if its revision changed since the previous call
+    bool setLookupTable(const std::vector<float>& table, unsigned int revision);
+
+    // Calculates the weight update of every laser pose (in world coordinates): initial + the sum of the lookup
+    // table values of all beams. Beam k has direction beam_directions[k] (in the laser frame) and row offset
+    // table_rows[k] in the lookup table. Returns false if the device failed.
+    bool score(const std::vector<geo::Transform2>& laser_poses, const std::vector<geo::Vec2>& beam_directions,
+               const std::vector<unsigned int>& table_rows, double range_min, double range_max,
+               double table_range_max, double table_inv_resolution, double initial,
+               std::vector<double>& weight_updates);
+
+private:
+
+    // Owns device resources
+    OpenCLScorer(const OpenCLScorer&);
+    OpenCLScorer& operator=(const OpenCLScorer&);
+
+    // OpenCL state (only defined if built with OpenCL support)
+    struct Impl;
+    Impl* impl_;
+
+    // Changes that have been uploaded
+    const WorldCrossSection* cross_section_;
+    unsigned int cross_section_revision_;
+    unsigned int lookup_table_revision_;
+    bool has_lookup_table_;
+
+    // Host side staging buffers (single precision)
+    std::vector<float> lines_;
+    std::vector<float> poses_;
+    std::vector<float> beam_directions_;
+    std::vector<float> weight_updates_;
+
+};
+
+#endif
@@ -1,9 +1,185 @@
 #include "particle_filter.h"
 
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+//
+//                                         ARRAY KERNELS
+//
 // ----------------------------------------------------------------------------------------------------
 
-ParticleFilter::ParticleFilter() : i_current_(0)
+// The kernels below use four independent accumulators. Floating point additions are not associative,
+// so the compiler is not allowed to vectorize a single-accumulator reduction by itself.
+
+namespace
 {
+
+double sum(const Scalar* v, unsigned int n)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        s0 += v[i];
+        s1 += v[i + 1];
+        s2 += v[i + 2];
+        s3 += v[i + 3];
+    }
+
+    for(; i < n; ++i)
+        s0 += v[i];
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double dot(const Scalar* a, const Scalar* b, unsigned int n)
+{
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+
+    unsigned int i = 0;
+    for(; i + 4 <= n; i += 4)
+    {
+        s0 += a[i] * b[i];
+        s1 += a[i + 1] * b[i + 1];
+        s2 += a[i + 2] * b[i + 2];
+        s3 += a[i + 3] * b[i + 3];
+    }
+
+    for(; i < n; ++i)
+        s0 += a[i] * b[i];
+
+    return (s0 + s1) + (s2 + s3);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void scale(Scalar* v, unsigned int n, double f)
+{
+    for(unsigned int i = 0; i < n; ++i)
+        v[i] *= f;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Returns the index of the first maximum element
+unsigned int argmax(const Scalar* v, unsigned int n)
+{
+    unsigned int i_max = 0;
+    double v_max = v[0];
+
+    for(unsigned int i = 1; i < n; ++i)
+    {
+        if (v[i] > v_max)
+        {
+            v_max = v[i];
+            i_max = i;
+        }
+    }
+
+    return i_max;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Rational approximation of the inverse of the standard normal CDF (P. J. Acklam), relative error < 1.2e-9
+double inverseNormalCDF(double p)
+{
+    static const double a[] = { -3.969683028665376e+01, 2.209460984245205e+02, -2.759285104469687e+02,
+                                 1.383577518672690e+02, -3.066479806614716e+01, 2.506628277459239e+00 };
+    static const double b[] = { -5.447609879822406e+01, 1.615858368580409e+02, -1.556989798598866e+02,
+                                 6.680131188771972e+01, -1.328068155288572e+01 };
+    static const double c[] = { -7.784894002430293e-03, -3.223964580411365e-01, -2.400758277161838e+00,
+                                -2.549732539343734e+00, 4.374664141464968e+00, 2.938163982698783e+00 };
+    static const double d[] = { 7.784695709041462e-03, 3.224671290700398e-01, 2.445134137142996e+00,
+                                 3.754408661907416e+00 };
+
+    p = std::min(std::max(p, 1e-12), 1 - 1e-12);
+
+    if (p < 0.02425)
+    {
+        double q = sqrt(-2 * log(p));
+        return (((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+                ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+    else if (p > 1 - 0.02425)
+    {
+        double q = sqrt(-2 * log(1 - p));
+        return -(((((c[0] * q + c[1]) * q + c[2]) * q + c[3]) * q + c[4]) * q + c[5]) /
+                 ((((d[0] * q + d[1]) * q + d[2]) * q + d[3]) * q + 1);
+    }
+
+    double q = p - 0.5;
+    double r = q * q;
+    return (((((a[0] * r + a[1]) * r + a[2]) * r + a[3]) * r + a[4]) * r + a[5]) * q /
+            (((((b[0] * r + b[1]) * r + b[2]) * r + b[3]) * r + b[4]) * r + 1);
+}
+
+} // end anonymous namespace
+
+// ----------------------------------------------------------------------------------------------------
+//
+//                                           SAMPLE SET
+//
+// ----------------------------------------------------------------------------------------------------
+
+void SampleSet::resize(unsigned int n)
+{
+    x.resize(n);
+    y.resize(n);
+    cos_yaw.resize(n);
+    sin_yaw.resize(n);
+    yaw.resize(n);
+    weight.resize(n);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SampleSet::reserve(unsigned int n)
+{
+    x.reserve(n);
+    y.reserve(n);
+    cos_yaw.reserve(n);
+    sin_yaw.reserve(n);
+    yaw.reserve(n);
+    weight.reserve(n);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SampleSet::clear()
+{
+    x.clear();
+    y.clear();
+    cos_yaw.clear();
+    sin_yaw.clear();
+    yaw.clear();
+    weight.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SampleSet::push_back(const geo::Transform2& p, double w)
+{
+    x.push_back(p.t.x);
+    y.push_back(p.t.y);
+    cos_yaw.push_back(p.R.xx);
+    sin_yaw.push_back(p.R.yx);
+    yaw.push_back(p.rotation());
+    weight.push_back(w);
+}
+
+// ----------------------------------------------------------------------------------------------------
+//
+//                                         PARTICLE FILTER
+//
+// ----------------------------------------------------------------------------------------------------
+
+ParticleFilter::ParticleFilter() : resample_method_(SYSTEMATIC), rng_(1), kld_enabled_(false), i_current_(0), samples_dirty_(true)
+{
+    cluster_hash_.setResolution(0.5, 10 * M_PI / 180);
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -17,121 +193,284 @@ ParticleFilter::~ParticleFilter()
 void ParticleFilter::initUniform(const geo::Vec2& min, const geo::Vec2& max, double t_step,
                                  double a_min, double a_max, double a_step)
 {
-    std::vector<Sample>& smpls = samples();
+    SampleSet& smpls = sampleSet();
 
     smpls.clear();
-    for(double x = min.x; x < max.x; x += t_step)
-        for(double y = min.y; y < max.y; y += t_step)
-            for(double a = a_min; a < a_max; a += a_step)
-                smpls.push_back(Sample(geo::Transform2(x, y, a)));
+    smpls.reserve(gridSize(min.x, max.x, t_step) * gridSize(min.y, max.y, t_step) * gridSize(a_min, a_max, a_step));
+
+    addGrid(min, max, t_step, a_min, a_max, a_step);
+
+    setUniformWeights();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::initUniform(const std::vector<geo::Transform2>& centers, double window, double t_step,
+                                 double a_window, double a_step)
+{
+    SampleSet& smpls = sampleSet();
+
+    smpls.clear();
+    smpls.reserve(centers.size() * gridSize(-window, window, t_step) * gridSize(-window, window, t_step)
+                  * gridSize(-a_window, a_window, a_step));
+
+    for(unsigned int i = 0; i < centers.size(); ++i)
+    {
+        const geo::Transform2& c = centers[i];
+        double a = c.rotation();
+        addGrid(c.t - geo::Vec2(window, window), c.t + geo::Vec2(window, window), t_step,
+                a - a_window, a + a_window, a_step);
+    }
 
     setUniformWeights();
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-bool compareSamples(const Sample& a, const Sample& b)
+unsigned int ParticleFilter::gridSize(double min, double max, double step)
+{
+    // One extra, as rounding errors in the accumulated steps can add a sample
+    return max > min ? (unsigned int)((max - min) / step) + 2 : 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::addGrid(const geo::Vec2& min, const geo::Vec2& max, double t_step,
+                             double a_min, double a_max, double a_step)
 {
-    return a.weight > b.weight;
+    SampleSet& smpls = sample_sets_[i_current_];
+
+    for(double x = min.x; x < max.x; x += t_step)
+        for(double y = min.y; y < max.y; y += t_step)
+            for(double a = a_min; a < a_max; a += a_step)
+                smpls.push_back(geo::Transform2(x, y, a));
 }
 
 // ----------------------------------------------------------------------------------------------------
 
 void ParticleFilter::resample(unsigned int num_samples)
 {
-    std::vector<Sample>& old_samples = samples_[i_current_];
-    std::vector<Sample>& new_samples = samples_[1 - i_current_];
+    SampleSet& old_samples = sample_sets_[i_current_];
+    SampleSet& new_samples = sample_sets_[1 - i_current_];
 
     if (old_samples.empty())
         return;
 
-    if (num_samples == 0)
+    if (kld_enabled_)
+        num_samples = calculateKLDSampleCount();
+    else if (num_samples == 0)
         num_samples = old_samples.size();
 
-    // Sort all samples (decreasing weight)
-    std::sort(old_samples.begin(), old_samples.end(), compareSamples);
-
-    int k = 0;
     new_samples.resize(num_samples);
-    for(std::vector<Sample>::const_iterator it = old_samples.begin(); it != old_samples.end(); ++it)
+
+    const std::vector<Scalar>& w = old_samples.weight;
+    double total_weight = sum(&w[0], w.size());
+
+    if (!(total_weight > 0))
+    {
+        // All weights are zero: keep the (first) samples as they are
+        for(unsigned int i = 0; i < num_samples; ++i)
+            new_samples.copy(i, old_samples, i % old_samples.size());
+    }
+    else if (resample_method_ == RESIDUAL)
+    {
+        // Deterministically copy every old sample floor(N * w) times, and draw the remaining
+        // samples systematically from the residual weights
+        double f = num_samples / total_weight;
+
+        unsigned int k = 0;
+        for(unsigned int i = 0; i < w.size(); ++i)
+        {
+            unsigned int n_copies = std::min<unsigned int>(w[i] * f, num_samples - k);
+            for(unsigned int j = 0; j < n_copies; ++j)
+                new_samples.copy(k++, old_samples, i);
+        }
+
+        unsigned int num_residual = num_samples - k;
+        if (num_residual > 0)
+        {
+            // The residuals sum up to num_residual (apart from floating point errors)
+            double u = rng_.uniform();
+            double c = w[0] * f - floor(w[0] * f);
+            unsigned int i = 0;
+
+            for(unsigned int m = 0; m < num_residual; ++m, u += 1)
+            {
+                while (u >= c && i + 1 < w.size())
+                {
+                    ++i;
+                    c += w[i] * f - floor(w[i] * f);
+                }
+                new_samples.copy(k++, old_samples, i);
+            }
+        }
+    }
+    else
     {
-        const Sample& old_sample = *it;
+        // Walk once through the cumulative weights. The positions of the new samples are
+        // increasing, so no sorting or searching is needed.
+        double step = total_weight / num_samples;
+        double u0 = rng_.uniform() * step;
+
+        double c = w[0];
+        unsigned int i = 0;
+
+        for(unsigned int m = 0; m < num_samples; ++m)
+        {
+            // Systematic: one random offset for all samples. Stratified: one random offset per sample
+            double u = (resample_method_ == STRATIFIED ? (m + rng_.uniform()) * step : u0 + m * step);
+
+            while (u >= c && i + 1 < w.size())
+            {
+                ++i;
+                c += w[i];
+            }
+
+            new_samples.copy(m, old_samples, i);
+        }
+    }
 
-        int l = std::min<int>(k + 1 + old_sample.weight * num_samples, num_samples - 1);
+    i_current_ = 1 - i_current_;
+    samples_dirty_ = true;
 
-        for(int i = k; i <= l; ++i)
-            new_samples[i] = old_sample;
+    // After resampling, every sample represents the same probability mass
+    setUniformWeights();
+}
 
-        k = l + 1;
+// ----------------------------------------------------------------------------------------------------
 
-        if (k >= num_samples)
-            break;
-    }
+void ParticleFilter::setKLDSampling(unsigned int min_samples, unsigned int max_samples, double err, double quantile,
+                                    double bin_size, double bin_angle)
+{
+    kld_enabled_ = true;
+    kld_min_samples_ = std::max<unsigned int>(1, min_samples);
+    kld_max_samples_ = std::max(kld_min_samples_, max_samples);
+    kld_err_ = err;
+    kld_z_ = inverseNormalCDF(quantile);
+    kld_bins_.setResolution(bin_size, bin_angle);
+}
+
+// ----------------------------------------------------------------------------------------------------
 
-//    // Build up cumulative probability table for resampling.
-//    std::vector<double> cum_weights(old_samples.size());
-//    cum_weights[0] = old_samples[0].weight;
-//    for(unsigned int i = 1; i < old_samples.size(); ++i)
-//        cum_weights[i] = cum_weights[i - 1] + old_samples[i].weight;
+unsigned int ParticleFilter::calculateKLDSampleCount()
+{
+    const SampleSet& smpls = sample_sets_[i_current_];
+    const std::vector<Scalar>& w = smpls.weight;
 
-//    new_samples.resize(num_samples);
-//    for(std::vector<Sample>::iterator it = new_samples.begin(); it != new_samples.end(); ++it)
-//    {
-//        Sample& new_sample = *it;
+    if (smpls.empty())
+        return kld_min_samples_;
 
-//        double r = ((double) rand() / (RAND_MAX));
+    double total_weight = sum(&w[0], w.size());
+    if (!(total_weight > 0))
+        return kld_max_samples_;
 
-//        unsigned int i_sample = 0;
-//        for(i_sample = 0; i_sample < old_samples.size(); ++i_sample)
-//        {
-//            if (r < cum_weights[i_sample])
-//                break;
-//        }
+    // Count the number of bins that would be occupied when drawing the maximum number of
+    // samples from the current weights. This is a systematic pass over the cumulative weights
+    // (with a fixed offset), so it is linear and does not need any random numbers.
+    kld_bins_.clear(std::min<unsigned int>(smpls.size(), kld_max_samples_));
 
-//        new_sample = old_samples[i_sample];
-//    }
+    double step = total_weight / kld_max_samples_;
+    double u = 0.5 * step;
+    double c = w[0];
+    unsigned int i = 0;
+    int i_last = -1;
 
-//    new_samples[0] = best_sample;
+    for(unsigned int m = 0; m < kld_max_samples_; ++m, u += step)
+    {
+        while (u >= c && i + 1 < w.size())
+        {
+            ++i;
+            c += w[i];
+        }
 
-    i_current_ = 1 - i_current_;
+        if ((int)i == i_last)
+            continue;
 
-    normalize();
+        i_last = i;
+
+        PoseHash::Cell cell = kld_bins_.cell(smpls.x[i], smpls.y[i], smpls.yaw[i]);
+        if (kld_bins_.find(cell) < 0)
+            kld_bins_.insert(cell, i);
+    }
+
+    unsigned int k = kld_bins_.size();
+    if (k <= 1)
+        return kld_min_samples_;
+
+    // Wilson-Hilferty approximation of the chi-square quantile (Fox, 2003)
+    double a = 2.0 / (9 * (k - 1));
+    double b = 1 - a + sqrt(a) * kld_z_;
+    double n = (k - 1) / (2 * kld_err_) * b * b * b;
+
+    return std::max<unsigned int>(kld_min_samples_, std::min<double>(kld_max_samples_, ceil(n)));
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-const Sample& ParticleFilter::bestSample() const
+const std::vector<Sample>& ParticleFilter::samples() const
 {
-    const std::vector<Sample>& smpls = samples();
+    if (!samples_dirty_)
+        return samples_;
+
+    const SampleSet& smpls = sampleSet();
 
-    const Sample* best_sample = &smpls.front();
-    for(std::vector<Sample>::const_iterator it = smpls.begin(); it != smpls.end(); ++it)
+    samples_.resize(smpls.size());
+    for(unsigned int i = 0; i < smpls.size(); ++i)
     {
-        const Sample& s = *it;
-        if (s.weight > best_sample->weight)
-            best_sample = &s;
+        Sample& s = samples_[i];
+        s.pose = smpls.transform(i);
+        s.weight = smpls.weight[i];
     }
 
-    return *best_sample;
+    samples_dirty_ = false;
+
+    return samples_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+unsigned int ParticleFilter::bestSampleIndex() const
+{
+    const SampleSet& smpls = sampleSet();
+    if (smpls.empty())
+        return 0;
+
+    return argmax(&smpls.weight[0], smpls.size());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+Sample ParticleFilter::bestSample() const
+{
+    const SampleSet& smpls = sampleSet();
+    unsigned int i = bestSampleIndex();
+
+    Sample s;
+    s.pose = smpls.transform(i);
+    s.weight = smpls.weight[i];
+
+    return s;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-// TODO: deal with particle clusters (taking the average of multiple clusters of particles does not make sense)
 geo::Transform2 ParticleFilter::calculateMeanPose() const
 {
-    const std::vector<Sample>& smpls = samples();
+    const SampleSet& smpls = sampleSet();
 
     geo::Transform2 mean;
     mean.t = geo::Vec2(0, 0);
     geo::Vec2 rot_v(0, 0);
 
-    for(std::vector<Sample>::const_iterator it = smpls.begin(); it != smpls.end(); ++it)
+    if (!smpls.empty())
     {
-        const Sample& s = *it;
-        mean.t += s.weight * s.pose.matrix().t;
-        rot_v.x += s.weight * s.pose.matrix().R.xx;
-        rot_v.y += s.weight * s.pose.matrix().R.yx;
+        const Scalar* w = &smpls.weight[0];
+        unsigned int n = smpls.size();
+
+        mean.t.x = dot(w, &smpls.x[0], n);
+        mean.t.y = dot(w, &smpls.y[0], n);
+        rot_v.x = dot(w, &smpls.cos_yaw[0], n);
+        rot_v.y = dot(w, &smpls.sin_yaw[0], n);
     }
 
     rot_v.normalize();
@@ -145,31 +484,232 @@ geo::Transform2 ParticleFilter::calculateMeanPose() const
 
 // ----------------------------------------------------------------------------------------------------
 
-void ParticleFilter::normalize()
+namespace
+{
+
+unsigned int findRoot(std::vector<unsigned int>& parents, unsigned int i)
+{
+    while (parents[i] != i)
+    {
+        // Path halving
+        parents[i] = parents[parents[i]];
+        i = parents[i];
+    }
+    return i;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+const std::vector<ParticleCluster>& ParticleFilter::calculateClusters()
 {
-    std::vector<Sample>& smpls = samples();
+    const SampleSet& smpls = sample_sets_[i_current_];
+    unsigned int n = smpls.size();
 
-    double total_weight = 0;
-    for(std::vector<Sample>::iterator it = smpls.begin(); it != smpls.end(); ++it)
-        total_weight += it->weight;
+    clusters_.clear();
+    sample_clusters_.resize(n);
 
-    if (total_weight > 0)
+    if (n == 0)
+        return clusters_;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Find occupied cells
+
+    cluster_hash_.clear(n);
+    cluster_cells_.clear();
+
+    for(unsigned int i = 0; i < n; ++i)
     {
-        for(std::vector<Sample>::iterator it = smpls.begin(); it != smpls.end(); ++it)
-            it->weight /= total_weight;
+        PoseHash::Cell c = cluster_hash_.cell(smpls.x[i], smpls.y[i], smpls.yaw[i]);
+
+        int e = cluster_hash_.find(c);
+        if (e < 0)
+        {
+            sample_clusters_[i] = cluster_cells_.size();
+            cluster_hash_.insert(c, cluster_cells_.size());
+            cluster_cells_.push_back(c);
+        }
+        else
+            sample_clusters_[i] = cluster_hash_.value(e);
     }
-    else
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Connect neighbouring cells
+
+    unsigned int num_cells = cluster_cells_.size();
+
+    cell_parents_.resize(num_cells);
+    for(unsigned int i = 0; i < num_cells; ++i)
+        cell_parents_[i] = i;
+
+    // If there are less than 3 angle cells, the angular neighbours would wrap onto each other
+    int num_da = std::min(3, cluster_hash_.numAngleCells());
+
+    for(unsigned int i = 0; i < num_cells; ++i)
     {
-        setUniformWeights();
+        for(int dx = -1; dx <= 1; ++dx)
+        {
+            for(int dy = -1; dy <= 1; ++dy)
+            {
+                for(int k = 0; k < num_da; ++k)
+                {
+                    int da = (k == 2 ? -1 : k);
+
+                    int e = cluster_hash_.find(cluster_hash_.neighbour(cluster_cells_[i], dx, dy, da));
+                    if (e < 0)
+                        continue;
+
+                    unsigned int r1 = findRoot(cell_parents_, i);
+                    unsigned int r2 = findRoot(cell_parents_, cluster_hash_.value(e));
+                    if (r1 != r2)
+                        cell_parents_[std::max(r1, r2)] = std::min(r1, r2);
+                }
+            }
+        }
+    }
+
+    // Assign a cluster index to every root cell
+    unsigned int num_clusters = 0;
+    cell_clusters_.resize(num_cells);
+    std::vector<unsigned int>& cell_clusters = cell_clusters_;
+    for(unsigned int i = 0; i < num_cells; ++i)
+    {
+        // A root always has the lowest index of its set, so it is visited before the other cells
+        unsigned int r = findRoot(cell_parents_, i);
+        if (r == i)
+            cell_clusters[i] = num_clusters++;
+        else
+            cell_clusters[i] = cell_clusters[r];
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Calculate cluster statistics
+
+    // Per cluster: sum of w, w * x, w * y, w * cos(yaw), w * sin(yaw), and (second pass) the weighted
+    // products of the offsets to the mean: w * dx * dx, w * dx * dy, w * dy * dy. Accumulating relative to
+    // the mean keeps the covariance accurate far from the origin (also with single precision samples).
+    std::vector<double>& sums = cluster_sums_;
+    sums.assign(8 * num_clusters, 0);
+
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        unsigned int c = cell_clusters[sample_clusters_[i]];
+        sample_clusters_[i] = c;
+
+        double w = smpls.weight[i];
+
+        double* s = &sums[8 * c];
+        s[0] += w;
+        s[1] += w * smpls.x[i];
+        s[2] += w * smpls.y[i];
+        s[3] += w * smpls.cos_yaw[i];
+        s[4] += w * smpls.sin_yaw[i];
+    }
+
+    clusters_.resize(num_clusters);
+    for(unsigned int c = 0; c < num_clusters; ++c)
+    {
+        const double* s = &sums[8 * c];
+        ParticleCluster& cluster = clusters_[c];
+
+        cluster.weight = s[0];
+        cluster.num_samples = 0;
+
+        double w_inv = s[0] > 0 ? 1.0 / s[0] : 0;
+
+        geo::Vec2 rot_v(s[3] * w_inv, s[4] * w_inv);
+
+        // The length of the mean rotation vector is 1 if all samples have the same yaw, and goes to 0 if
+        // the yaw is uniformly distributed. -2 * log(length) approximates the variance of the yaw.
+        double r = rot_v.length();
+        cluster.var_yaw = r > 0 ? -2 * log(std::min(1.0, r)) : 1e9;
+
+        if (r > 0)
+            rot_v = rot_v / r;
+        else
+            rot_v = geo::Vec2(1, 0);
+
+        cluster.mean.t = geo::Vec2(s[1] * w_inv, s[2] * w_inv);
+        cluster.mean.R.xx = rot_v.x;
+        cluster.mean.R.yx = rot_v.y;
+        cluster.mean.R.xy = -rot_v.y;
+        cluster.mean.R.yy = rot_v.x;
+    }
+
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        unsigned int c = sample_clusters_[i];
+        ++clusters_[c].num_samples;
+
+        const geo::Vec2& m = clusters_[c].mean.t;
+        double w = smpls.weight[i];
+        double dx = (double)smpls.x[i] - m.x;
+        double dy = (double)smpls.y[i] - m.y;
+
+        double* s = &sums[8 * c];
+        s[5] += w * dx * dx;
+        s[6] += w * dx * dy;
+        s[7] += w * dy * dy;
     }
+
+    for(unsigned int c = 0; c < num_clusters; ++c)
+    {
+        const double* s = &sums[8 * c];
+        ParticleCluster& cluster = clusters_[c];
+
+        double w_inv = s[0] > 0 ? 1.0 / s[0] : 0;
+        cluster.cov_xx = s[5] * w_inv;
+        cluster.cov_xy = s[6] * w_inv;
+        cluster.cov_yy = s[7] * w_inv;
+    }
+
+    // Sort by descending weight, and update the sample cluster indices accordingly
+    std::vector<std::pair<double, unsigned int> >& order = cluster_order_;
+    order.resize(num_clusters);
+    for(unsigned int c = 0; c < num_clusters; ++c)
+        order[c] = std::make_pair(-clusters_[c].weight, c);
+
+    std::sort(order.begin(), order.end());
+
+    std::vector<unsigned int>& new_index = cluster_new_index_;
+    std::vector<ParticleCluster>& sorted = sorted_clusters_;
+    new_index.resize(num_clusters);
+    sorted.resize(num_clusters);
+    for(unsigned int c = 0; c < num_clusters; ++c)
+    {
+        new_index[order[c].second] = c;
+        sorted[c] = clusters_[order[c].second];
+    }
+
+    clusters_.swap(sorted);
+
+    for(unsigned int i = 0; i < n; ++i)
+        sample_clusters_[i] = new_index[sample_clusters_[i]];
+
+    return clusters_;
 }
 
 // ----------------------------------------------------------------------------------------------------
 
-void ParticleFilter::setUniformWeights()
+void ParticleFilter::normalize()
 {
-    double uni_weight = 1.0 / samples().size();
-    for(std::vector<Sample>::iterator it = samples().begin(); it != samples().end(); ++it)
-        it->weight = uni_weight;
+    SampleSet& smpls = sampleSet();
+    if (smpls.empty())
+        return;
+
+    double total_weight = sum(&smpls.weight[0], smpls.size());
+
+    if (total_weight > 0)
+        scale(&smpls.weight[0], smpls.size(), 1.0 / total_weight);
+    else
+        setUniformWeights();
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+void ParticleFilter::setUniformWeights()
+{
+    SampleSet& smpls = sampleSet();
+    smpls.weight.assign(smpls.size(), 1.0 / smpls.size());
+}
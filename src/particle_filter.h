@@ -1,6 +1,10 @@
 #ifndef ED_LOCALIZATION_PARTICLE_FILTER_H_
 #define ED_LOCALIZATION_PARTICLE_FILTER_H_
 
+#include "pose_hash.h"
+#include "random_generator.h"
+#include "scalar.h"
+
 #include <geolib/datatypes.h>
 
 // ----------------------------------------------------------------------------------------------------
@@ -21,6 +25,13 @@ public:
         rotation_ = p.rotation();
     }
 
+    // Sets the pose if its rotation is already known, which saves the atan2
+    inline void set(const geo::Transform2& p, double rot)
+    {
+        pose_ = p;
+        rotation_ = rot;
+    }
+
     inline void setRotation(double rot)
     {
         pose_.setRotation(rot);
@@ -51,37 +62,218 @@ struct Sample
 
 // ----------------------------------------------------------------------------------------------------
 
+// Structure-of-arrays storage of a set of samples. Every sample property is stored in its own
+// contiguous array, such that loops that only touch one or two properties (e.g. only the weights)
+// do not have to stride over the full pose, and can be vectorized by the compiler. The arrays are
+// stored in Scalar precision (see scalar.h).
+
+class SampleSet
+{
+
+public:
+
+    unsigned int size() const { return weight.size(); }
+
+    bool empty() const { return weight.empty(); }
+
+    void resize(unsigned int n);
+
+    void reserve(unsigned int n);
+
+    void clear();
+
+    void push_back(const geo::Transform2& p, double w = 0);
+
+    inline void setPose(unsigned int i, const geo::Transform2& p)
+    {
+        x[i] = p.t.x;
+        y[i] = p.t.y;
+        cos_yaw[i] = p.R.xx;
+        sin_yaw[i] = p.R.yx;
+        yaw[i] = p.rotation();
+    }
+
+    inline void setPose(unsigned int i, double x_, double y_, double yaw_)
+    {
+        x[i] = x_;
+        y[i] = y_;
+        cos_yaw[i] = cos(yaw_);
+        sin_yaw[i] = sin(yaw_);
+        yaw[i] = yaw_;
+    }
+
+    inline geo::Transform2 pose(unsigned int i) const
+    {
+        return geo::Transform2(geo::Mat2(cos_yaw[i], -sin_yaw[i], sin_yaw[i], cos_yaw[i]), geo::Vec2(x[i], y[i]));
+    }
+
+    inline Transform transform(unsigned int i) const
+    {
+        Transform t;
+        t.set(pose(i), yaw[i]);
+        return t;
+    }
+
+    // Copies sample j of 'src' to sample i of this set
+    inline void copy(unsigned int i, const SampleSet& src, unsigned int j)
+    {
+        x[i] = src.x[j];
+        y[i] = src.y[j];
+        cos_yaw[i] = src.cos_yaw[j];
+        sin_yaw[i] = src.sin_yaw[j];
+        yaw[i] = src.yaw[j];
+        weight[i] = src.weight[j];
+    }
+
+    std::vector<Scalar> x;
+    std::vector<Scalar> y;
+    std::vector<Scalar> cos_yaw;
+    std::vector<Scalar> sin_yaw;
+    std::vector<Scalar> yaw;
+    std::vector<Scalar> weight;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Group of connected samples (see ParticleFilter::calculateClusters)
+
+struct ParticleCluster
+{
+    // Total weight of the samples in the cluster
+    double weight;
+
+    unsigned int num_samples;
+
+    // Weighted mean pose
+    geo::Transform2 mean;
+
+    // Weighted covariance of the position, and circular variance of the yaw
+    double cov_xx, cov_xy, cov_yy;
+    double var_yaw;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
 class ParticleFilter
 {
 
 public:
 
+    enum ResampleMethod
+    {
+        // One random offset, N equally spaced positions on the cumulative weights
+        SYSTEMATIC,
+
+        // One random position within each of the N equally sized strata
+        STRATIFIED,
+
+        // floor(N * w) deterministic copies, the remainder is drawn systematically
+        RESIDUAL
+    };
+
     ParticleFilter();
 
     ~ParticleFilter();
 
+    void setResampleMethod(ResampleMethod method) { resample_method_ = method; }
+
+    void setSeed(uint64_t seed) { rng_.seed(seed); }
+
+    // Enables KLD-sampling: the number of samples drawn when resampling is adapted to the number of
+    // (x, y, yaw) histogram bins the posterior occupies, such that the KL-divergence between the sample
+    // based and the true posterior stays below 'err' with probability 'quantile'.
+    void setKLDSampling(unsigned int min_samples, unsigned int max_samples, double err, double quantile,
+                        double bin_size, double bin_angle);
+
     void initUniform(const geo::Vec2& min, const geo::Vec2& max, double t_step,
                      double a_min, double a_max, double a_step);
 
+    // Places a grid of samples in a window of +/- 'window' (position) and +/- 'a_window' (yaw) around every center
+    void initUniform(const std::vector<geo::Transform2>& centers, double window, double t_step,
+                     double a_window, double a_step);
+
+    // Draws num_samples (default: the current number of samples) new samples in a single pass
+    // over the cumulative weights, and resets all weights to be uniform. If KLD-sampling is enabled,
+    // num_samples is ignored and the number of samples is determined by calculateKLDSampleCount.
     void resample(unsigned int num_samples = 0);
 
-    std::vector<Sample>& samples() { return samples_[i_current_]; }
+    unsigned int calculateKLDSampleCount();
+
+    // Direct (mutable) access to the structure-of-arrays sample storage
+    SampleSet& sampleSet() { samples_dirty_ = true; return sample_sets_[i_current_]; }
+
+    const SampleSet& sampleSet() const { return sample_sets_[i_current_]; }
+
+    // Array-of-structures view of the current samples. The view is only rebuilt if the
+    // samples changed since the last call.
+    const std::vector<Sample>& samples() const;
 
-    const std::vector<Sample>& samples() const { return samples_[i_current_]; }
+    unsigned int bestSampleIndex() const;
 
-    const Sample& bestSample() const;
+    Sample bestSample() const;
 
+    // Weighted mean of all samples. Only meaningful if the samples form a single cluster.
     geo::Transform2 calculateMeanPose() const;
 
+    // Sets the (x, y, yaw) cell size used for clustering. Samples in neighbouring cells belong to the same cluster.
+    void setClusterResolution(double cell_size, double angle_cell_size) { cluster_hash_.setResolution(cell_size, angle_cell_size); }
+
+    // Groups the samples into clusters of connected cells and calculates the weight, mean and covariance
+    // of every cluster, in time linear in the number of samples. The clusters are sorted by descending weight,
+    // so the first cluster is the dominant hypothesis.
+    const std::vector<ParticleCluster>& calculateClusters();
+
+    const std::vector<ParticleCluster>& clusters() const { return clusters_; }
+
+    // Cluster index (into clusters()) of every sample, as of the last call to calculateClusters
+    const std::vector<unsigned int>& sampleClusters() const { return sample_clusters_; }
+
     void normalize();
 
 private:
 
+    ResampleMethod resample_method_;
+
+    RandomGenerator rng_;
+
+    // KLD-SAMPLING
+    bool kld_enabled_;
+    unsigned int kld_min_samples_;
+    unsigned int kld_max_samples_;
+    double kld_err_;
+    double kld_z_;
+    PoseHash kld_bins_;
+
+    // CLUSTERING
+    PoseHash cluster_hash_;
+    std::vector<PoseHash::Cell> cluster_cells_;
+    std::vector<unsigned int> cell_parents_;   // union-find forest over the occupied cells
+    std::vector<unsigned int> cell_clusters_;
+    std::vector<unsigned int> sample_clusters_;
+    std::vector<ParticleCluster> clusters_;
+
+    // Workspace (kept between calls, such that clustering does not allocate)
+    std::vector<double> cluster_sums_;
+    std::vector<std::pair<double, unsigned int> > cluster_order_;
+    std::vector<unsigned int> cluster_new_index_;
+    std::vector<ParticleCluster> sorted_clusters_;
+
     int i_current_;
-    std::vector<Sample> samples_[2];
+    SampleSet sample_sets_[2];
+
+    mutable bool samples_dirty_;
+    mutable std::vector<Sample> samples_;
 
     void setUniformWeights();
 
+    // Upper bound of the number of steps of 'step' in [min, max)
+    static unsigned int gridSize(double min, double max, double step);
+
+    // Appends a grid of samples to the current sample set, without setting the weights
+    void addGrid(const geo::Vec2& min, const geo::Vec2& max, double t_step,
+                 double a_min, double a_max, double a_step);
+
 };
 
 #endif
@@ -0,0 +1,176 @@
+#include "pose_buffer.h"
+
+#include <algorithm>
+#include <map>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Frame ids are compared without leading slash, as tf does
+std::string stripSlash(const std::string& frame_id)
+{
+    if (!frame_id.empty() && frame_id[0] == '/')
+        return frame_id.substr(1);
+    return frame_id;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseBuffer::PoseBuffer(unsigned int capacity) : capacity_(std::max(1u, capacity))
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseBuffer::~PoseBuffer()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseBuffer::setCapacity(unsigned int capacity)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    capacity_ = std::max(1u, capacity);
+    while(entries_.size() > capacity_)
+        entries_.pop_front();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseBuffer::insert(const ros::Time& stamp, const tf::Transform& transform)
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (!entries_.empty())
+    {
+        if (stamp < entries_.back().stamp)
+            return;
+
+        if (stamp == entries_.back().stamp)
+        {
+            entries_.back().transform = transform;
+            return;
+        }
+    }
+
+    if (entries_.size() >= capacity_)
+        entries_.pop_front();
+
+    entries_.push_back(Entry());
+    entries_.back().stamp = stamp;
+    entries_.back().transform = transform;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseBuffer::insert(const tf::tfMessage& msg, const std::string& parent, const std::string& child)
+{
+    std::string parent_id = stripSlash(parent);
+    std::string child_id = stripSlash(child);
+
+    for(unsigned int i = 0; i < msg.transforms.size(); ++i)
+    {
+        const geometry_msgs::TransformStamped& t = msg.transforms[i];
+        if (stripSlash(t.child_frame_id) != child_id || stripSlash(t.header.frame_id) != parent_id)
+            continue;
+
+        tf::StampedTransform transform;
+        tf::transformStampedMsgToTF(t, transform);
+        insert(t.header.stamp, transform);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TransformStatus PoseBuffer::lookup(const ros::Time& time, tf::Transform& transform) const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (entries_.empty())
+        return UNKNOWN_ERROR;
+
+    if (time.isZero())
+    {
+        transform = entries_.back().transform;
+        return OK;
+    }
+
+    if (time > entries_.back().stamp)
+        return TOO_RECENT;
+
+    if (time < entries_.front().stamp)
+        return TOO_OLD;
+
+    // First entry that is newer than the requested time
+    std::deque<Entry>::const_iterator it = std::upper_bound(entries_.begin(), entries_.end(), time, isBefore);
+
+    if (it == entries_.end())
+    {
+        // Exactly the time of the newest entry
+        transform = entries_.back().transform;
+        return OK;
+    }
+
+    const Entry& e2 = *it;
+    const Entry& e1 = *(it - 1);
+
+    double f = (time - e1.stamp).toSec() / (e2.stamp - e1.stamp).toSec();
+
+    transform.setOrigin(e1.transform.getOrigin().lerp(e2.transform.getOrigin(), f));
+    transform.setRotation(e1.transform.getRotation().slerp(e2.transform.getRotation(), f));
+
+    return OK;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PoseBuffer::latest(ros::Time& stamp, tf::Transform& transform) const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+
+    if (entries_.empty())
+        return false;
+
+    stamp = entries_.back().stamp;
+    transform = entries_.back().transform;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool PoseBuffer::empty() const
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    return entries_.empty();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseBuffer::clear()
+{
+    boost::mutex::scoped_lock lock(mutex_);
+    entries_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseBuffer& PoseBuffer::shared(const std::string& parent, const std::string& child)
+{
+    static boost::mutex registry_mutex;
+    static std::map<std::string, PoseBuffer*> registry;
+
+    boost::mutex::scoped_lock lock(registry_mutex);
+
+    // Never deleted, as plugins may still refer to the buffers during static destruction
+    PoseBuffer*& buffer = registry[stripSlash(parent) + " " + stripSlash(child)];
+    if (!buffer)
+        buffer = new PoseBuffer;
+
+    return *buffer;
+}
@@ -0,0 +1,78 @@
+#ifndef ED_LOCALIZATION_POSE_BUFFER_H_
+#define ED_LOCALIZATION_POSE_BUFFER_H_
+
+#include <ros/time.h>
+
+#include <tf/transform_datatypes.h>
+#include <tf/tfMessage.h>
+
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <string>
+
+enum TransformStatus
+{
+    TOO_RECENT,
+    TOO_OLD,
+    OK,
+    UNKNOWN_ERROR
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Bounded, time ordered buffer of the transform between two frames, that answers stamped queries by
+// interpolating between the two neighbouring transforms. Only the (short) lock of the buffer itself is
+// taken, so lookups do not contend with the tf listener. The process-wide buffers returned by 'shared'
+// are used to reuse transforms between plugins: one plugin feeds a buffer, the others only query it.
+
+class PoseBuffer
+{
+
+public:
+
+    PoseBuffer(unsigned int capacity = 1000);
+
+    ~PoseBuffer();
+
+    // If the buffer is full, the oldest transform is dropped
+    void setCapacity(unsigned int capacity);
+
+    // Transforms that are older than the newest buffered transform are ignored
+    void insert(const ros::Time& stamp, const tf::Transform& transform);
+
+    // Inserts all transforms in 'msg' from 'parent' to 'child' (leading slashes of the frame ids are ignored)
+    void insert(const tf::tfMessage& msg, const std::string& parent, const std::string& child);
+
+    // Interpolates the transform at 'time'. A zero time returns the newest transform.
+    TransformStatus lookup(const ros::Time& time, tf::Transform& transform) const;
+
+    // Returns false if the buffer is empty
+    bool latest(ros::Time& stamp, tf::Transform& transform) const;
+
+    bool empty() const;
+
+    void clear();
+
+    // Process-wide buffer of the transform from 'parent' to 'child'
+    static PoseBuffer& shared(const std::string& parent, const std::string& child);
+
+private:
+
+    struct Entry
+    {
+        ros::Time stamp;
+        tf::Transform transform;
+    };
+
+    static bool isBefore(const ros::Time& time, const Entry& e) { return time < e.stamp; }
+
+    mutable boost::mutex mutex_;
+
+    unsigned int capacity_;
+
+    std::deque<Entry> entries_;
+
+};
+
+#endif
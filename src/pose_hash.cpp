@@ -0,0 +1,107 @@
+#include "pose_hash.h"
+
+#include <cmath>
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseHash::PoseHash() : cell_size_inv_(1), angle_cell_size_inv_(1), num_angle_cells_(1), bucket_mask_(0)
+{
+    clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseHash::~PoseHash()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseHash::setResolution(double cell_size, double angle_cell_size)
+{
+    cell_size_inv_ = 1.0 / cell_size;
+
+    num_angle_cells_ = std::max<int>(1, 2 * M_PI / angle_cell_size);
+    angle_cell_size_inv_ = num_angle_cells_ / (2 * M_PI);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseHash::clear(unsigned int expected_size)
+{
+    // Keep the load factor below 0.5
+    unsigned int num_buckets = 16;
+    while (num_buckets < 2 * expected_size)
+        num_buckets *= 2;
+
+    num_buckets = std::max<unsigned int>(num_buckets, buckets_.size());
+
+    buckets_.assign(num_buckets, -1);
+    bucket_mask_ = num_buckets - 1;
+
+    entries_.clear();
+    entries_.reserve(expected_size);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseHash::Cell PoseHash::cell(double x, double y, double yaw) const
+{
+    // Normalize the angle to [0, 2pi)
+    double a = fmod(yaw, 2 * M_PI);
+    if (a < 0)
+        a += 2 * M_PI;
+
+    int ia = std::min<int>(a * angle_cell_size_inv_, num_angle_cells_ - 1);
+
+    return Cell(floor(x * cell_size_inv_), floor(y * cell_size_inv_), ia);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+PoseHash::Cell PoseHash::neighbour(const Cell& c, int dx, int dy, int da) const
+{
+    int a = (c.a + da) % num_angle_cells_;
+    if (a < 0)
+        a += num_angle_cells_;
+
+    return Cell(c.x + dx, c.y + dy, a);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void PoseHash::insert(const Cell& c, unsigned int value)
+{
+    int& head = buckets_[bucket(c)];
+
+    Entry e;
+    e.cell = c;
+    e.value = value;
+    e.next = head;
+
+    head = entries_.size();
+    entries_.push_back(e);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int PoseHash::find(const Cell& c) const
+{
+    int i = buckets_[bucket(c)];
+    while (i >= 0 && !(entries_[i].cell == c))
+        i = entries_[i].next;
+    return i;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int PoseHash::next(int entry) const
+{
+    const Cell& c = entries_[entry].cell;
+
+    int i = entries_[entry].next;
+    while (i >= 0 && !(entries_[i].cell == c))
+        i = entries_[i].next;
+    return i;
+}
@@ -0,0 +1,81 @@
+#ifndef ED_LOCALIZATION_POSE_HASH_H_
+#define ED_LOCALIZATION_POSE_HASH_H_
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Spatial hash over (x, y, yaw) cells. Every cell can hold multiple values (e.g. sample indices). The
+// hash does not own any memory per cell, so clearing and refilling it does not allocate once the
+// internal buffers have grown to their steady state size.
+
+class PoseHash
+{
+
+public:
+
+    struct Cell
+    {
+        Cell() {}
+        Cell(int x_, int y_, int a_) : x(x_), y(y_), a(a_) {}
+
+        bool operator==(const Cell& c) const { return x == c.x && y == c.y && a == c.a; }
+
+        int x, y, a;
+    };
+
+    PoseHash();
+
+    ~PoseHash();
+
+    // Sets the cell dimensions. The angular cell size is rounded up such that a whole number
+    // of cells covers a full circle.
+    void setResolution(double cell_size, double angle_cell_size);
+
+    // Removes all values and reserves enough buckets for 'expected_size' values
+    void clear(unsigned int expected_size = 0);
+
+    Cell cell(double x, double y, double yaw) const;
+
+    // Returns the cell that is the given number of cells away from c, wrapping the angle
+    Cell neighbour(const Cell& c, int dx, int dy, int da) const;
+
+    int numAngleCells() const { return num_angle_cells_; }
+
+    void insert(const Cell& c, unsigned int value);
+
+    // Returns the first entry of cell c, or -1 if the cell is empty
+    int find(const Cell& c) const;
+
+    // Returns the next entry in the same cell as 'entry', or -1 if there is none
+    int next(int entry) const;
+
+    unsigned int value(int entry) const { return entries_[entry].value; }
+
+    unsigned int size() const { return entries_.size(); }
+
+private:
+
+    struct Entry
+    {
+        Cell cell;
+        unsigned int value;
+        int next;
+    };
+
+    double cell_size_inv_;
+    double angle_cell_size_inv_;
+    int num_angle_cells_;
+
+    unsigned int bucket_mask_;
+    std::vector<int> buckets_;
+    std::vector<Entry> entries_;
+
+    inline unsigned int bucket(const Cell& c) const
+    {
+        return ((unsigned int)c.x * 73856093u ^ (unsigned int)c.y * 19349663u ^ (unsigned int)c.a * 83492791u) & bucket_mask_;
+    }
+
+};
+
+#endif
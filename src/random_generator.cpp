@@ -0,0 +1,56 @@
+#include "random_generator.h"
+
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+RandomGenerator::RandomGenerator(uint64_t s)
+{
+    seed(s);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+RandomGenerator::~RandomGenerator()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void RandomGenerator::seed(uint64_t s)
+{
+    // Expand the seed to the full state using splitmix64 (the state can never become all-zero)
+    for(unsigned int i = 0; i < 2; ++i)
+    {
+        uint64_t z = (s += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        state_[i] = z ^ (z >> 31);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void RandomGenerator::fillNormal(double* values, unsigned int n)
+{
+    unsigned int i = 0;
+    for(; i + 2 <= n; i += 2)
+    {
+        // u1 in (0, 1], such that the log is always defined
+        double u1 = 1.0 - uniform();
+        double u2 = uniform();
+
+        double r = sqrt(-2.0 * log(u1));
+        double a = 2 * M_PI * u2;
+
+        values[i] = r * cos(a);
+        values[i + 1] = r * sin(a);
+    }
+
+    if (i < n)
+    {
+        double u1 = 1.0 - uniform();
+        double u2 = uniform();
+        values[i] = sqrt(-2.0 * log(u1)) * cos(2 * M_PI * u2);
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef ED_LOCALIZATION_RANDOM_GENERATOR_H_
+#define ED_LOCALIZATION_RANDOM_GENERATOR_H_
+
+#include <stdint.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Interface of a seedable source of normally distributed values, such that the engine that generates the
+// noise (e.g., of the odometry model) can be replaced. An instance is not thread-safe: every thread uses
+// its own copy, created with clone().
+
+class NormalGenerator
+{
+
+public:
+
+    virtual ~NormalGenerator() {}
+
+    virtual void seed(uint64_t seed) = 0;
+
+    // Fills 'values' with n samples from a standard normal distribution
+    virtual void fillNormal(double* values, unsigned int n) = 0;
+
+    virtual NormalGenerator* clone() const = 0;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Fast, seedable pseudo random number generator (xorshift128+). In contrast to drand48() it does not
+// have any hidden global state: every owner (and every thread) should use its own instance. Instances
+// that are seeded with different seeds produce independent streams.
+
+class RandomGenerator : public NormalGenerator
+{
+
+public:
+
+    RandomGenerator(uint64_t seed = 0);
+
+    ~RandomGenerator();
+
+    void seed(uint64_t seed);
+
+    inline uint64_t next()
+    {
+        uint64_t s1 = state_[0];
+        const uint64_t s0 = state_[1];
+        state_[0] = s0;
+        s1 ^= s1 << 23;
+        state_[1] = s1 ^ s0 ^ (s1 >> 17) ^ (s0 >> 26);
+        return state_[1] + s0;
+    }
+
+    // Uniform in [0, 1)
+    inline double uniform()
+    {
+        return (next() >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // Fills 'values' with n samples from a standard normal distribution. Uses the basic (non-polar)
+    // Box-Muller transform, which produces two samples per pair of uniforms without any rejection.
+    void fillNormal(double* values, unsigned int n);
+
+    NormalGenerator* clone() const { return new RandomGenerator(*this); }
+
+private:
+
+    uint64_t state_[2];
+
+};
+
+#endif
@@ -0,0 +1,90 @@
+#include "rolling_statistics.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+RollingStatistics::RollingStatistics(unsigned int window_size) : window_size_(std::max(1u, window_size)),
+    i_next_(0), last_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+RollingStatistics::~RollingStatistics()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void RollingStatistics::setWindowSize(unsigned int window_size)
+{
+    window_size_ = std::max(1u, window_size);
+    clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void RollingStatistics::add(double value)
+{
+    last_ = value;
+
+    if (values_.size() < window_size_)
+    {
+        values_.push_back(value);
+        return;
+    }
+
+    values_[i_next_] = value;
+    i_next_ = (i_next_ + 1) % window_size_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void RollingStatistics::clear()
+{
+    values_.clear();
+    i_next_ = 0;
+    last_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double RollingStatistics::mean() const
+{
+    if (values_.empty())
+        return 0;
+
+    double sum = 0;
+    for(unsigned int i = 0; i < values_.size(); ++i)
+        sum += values_[i];
+
+    return sum / values_.size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double RollingStatistics::max() const
+{
+    if (values_.empty())
+        return 0;
+
+    return *std::max_element(values_.begin(), values_.end());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double RollingStatistics::percentile(double p) const
+{
+    if (values_.empty())
+        return 0;
+
+    // Nearest rank: the smallest value for which at least p of the window is smaller or equal
+    int k = std::ceil(p * values_.size()) - 1;
+    k = std::max(0, std::min<int>(k, values_.size() - 1));
+
+    sorted_ = values_;
+    std::nth_element(sorted_.begin(), sorted_.begin() + k, sorted_.end());
+    return sorted_[k];
+}
@@ -0,0 +1,56 @@
+#ifndef ED_LOCALIZATION_ROLLING_STATISTICS_H_
+#define ED_LOCALIZATION_ROLLING_STATISTICS_H_
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Keeps the last N values of a measurement (e.g., the duration of a processing stage) in a ring
+// buffer, such that percentiles over a recent window can be reported without unbounded memory.
+
+class RollingStatistics
+{
+
+public:
+
+    RollingStatistics(unsigned int window_size = 100);
+
+    ~RollingStatistics();
+
+    void setWindowSize(unsigned int window_size);
+
+    void add(double value);
+
+    void clear();
+
+    // Number of values in the window
+    unsigned int size() const { return values_.size(); }
+
+    bool empty() const { return values_.empty(); }
+
+    // Most recently added value
+    double last() const { return last_; }
+
+    double mean() const;
+
+    double max() const;
+
+    // Returns the p-th percentile (p in [0, 1]) of the values in the window
+    double percentile(double p) const;
+
+private:
+
+    unsigned int window_size_;
+
+    // Ring buffer of values, i_next_ is the position the next value will be written to
+    std::vector<double> values_;
+    unsigned int i_next_;
+
+    double last_;
+
+    // Scratch buffer for the percentile calculation
+    mutable std::vector<double> sorted_;
+
+};
+
+#endif
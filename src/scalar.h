@@ -0,0 +1,15 @@
+#ifndef ED_LOCALIZATION_SCALAR_H_
+#define ED_LOCALIZATION_SCALAR_H_
+
+// Floating point type of the sample storage and the scoring kernels. If ED_LOCALIZATION_SINGLE_PRECISION
+// is defined (CMake option), single precision is used: this halves the memory traffic of the hot loops and
+// doubles the SIMD width, while still giving sub-millimetre resolution on building-scale maps. Sums over
+// samples or beams are always accumulated in double precision.
+
+#ifdef ED_LOCALIZATION_SINGLE_PRECISION
+typedef float Scalar;
+#else
+typedef double Scalar;
+#endif
+
+#endif
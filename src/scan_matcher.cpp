@@ -0,0 +1,203 @@
+#include "scan_matcher.h"
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+ScanMatcher::ScanMatcher() : max_iterations_(10), max_points_(200), max_correspondence_distance_(0.3),
+    huber_distance_(0.05), min_correspondence_fraction_(0.5), max_correction_(0.3), max_angle_correction_(0.2),
+    num_iterations_(0), num_correspondences_(0), rms_error_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+ScanMatcher::~ScanMatcher()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ScanMatcher::configure(tue::Configuration config)
+{
+    config.value("max_iterations", max_iterations_, tue::config::OPTIONAL);
+
+    int max_points;
+    if (config.value("max_points", max_points, tue::config::OPTIONAL))
+        max_points_ = std::max(1, max_points);
+
+    config.value("max_correspondence_distance", max_correspondence_distance_, tue::config::OPTIONAL);
+    config.value("huber_distance", huber_distance_, tue::config::OPTIONAL);
+    config.value("min_correspondence_fraction", min_correspondence_fraction_, tue::config::OPTIONAL);
+    config.value("max_correction", max_correction_, tue::config::OPTIONAL);
+    config.value("max_angle_correction", max_angle_correction_, tue::config::OPTIONAL);
+
+    if (max_correspondence_distance_ <= 0 || huber_distance_ <= 0)
+        config.addError("Scan matching distances must be positive.");
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool ScanMatcher::match(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+                        const std::vector<geo::Vec2>& points, geo::Transform2& pose)
+{
+    num_iterations_ = 0;
+    num_correspondences_ = 0;
+    rms_error_ = 0;
+
+    // Spread the evaluated points evenly over the scan
+    unsigned int step = (points.size() + max_points_ - 1) / max_points_;
+    points_.clear();
+    for(unsigned int i = 0; i < points.size(); i += std::max(1u, step))
+        points_.push_back(points[i]);
+
+    if (points_.empty() || lines_start.empty())
+        return false;
+
+    // The segments do not change between iterations
+    segments_.resize(lines_start.size());
+    for(unsigned int i = 0; i < lines_start.size(); ++i)
+    {
+        Segment& s = segments_[i];
+        s.start = lines_start[i];
+        s.dir = lines_end[i] - lines_start[i];
+
+        double length_sq = s.dir.length2();
+        s.inv_length_sq = length_sq > 0 ? 1.0 / length_sq : 0;
+        s.normal = length_sq > 0 ? geo::Vec2(-s.dir.y, s.dir.x) / sqrt(length_sq) : geo::Vec2(0, 0);
+
+        s.min = geo::Vec2(std::min(lines_start[i].x, lines_end[i].x) - max_correspondence_distance_,
+                          std::min(lines_start[i].y, lines_end[i].y) - max_correspondence_distance_);
+        s.max = geo::Vec2(std::max(lines_start[i].x, lines_end[i].x) + max_correspondence_distance_,
+                          std::max(lines_start[i].y, lines_end[i].y) + max_correspondence_distance_);
+    }
+
+    geo::Transform2 current = pose;
+    unsigned int min_correspondences = std::max(3.0, min_correspondence_fraction_ * points_.size());
+
+    for(int iter = 0; iter < max_iterations_; ++iter)
+    {
+        ++num_iterations_;
+
+        // The increment (dx, dy, da) rotates around the current position, which keeps the normal equations
+        // well conditioned: p' = c + R(da) * (p - c) + (dx, dy)
+        geo::Vec2 c = current.t;
+
+        // Normal equations H * x = -g (H is symmetric)
+        double h_xx = 0, h_xy = 0, h_xa = 0, h_yy = 0, h_ya = 0, h_aa = 0;
+        double g_x = 0, g_y = 0, g_a = 0;
+
+        unsigned int num_correspondences = 0;
+        double sum_sq = 0;
+
+        for(unsigned int i = 0; i < points_.size(); ++i)
+        {
+            geo::Vec2 p = current * points_[i];
+
+            geo::Vec2 q, n;
+            if (!findCorrespondence(p, q, n))
+                continue;
+
+            // Distance to the line through the segment, and its derivatives to (dx, dy, da)
+            geo::Vec2 pc = p - c;
+            double r = n.dot(p - q);
+            double j_a = n.y * pc.x - n.x * pc.y;
+
+            double w = std::abs(r) < huber_distance_ ? 1 : huber_distance_ / std::abs(r);
+
+            h_xx += w * n.x * n.x;
+            h_xy += w * n.x * n.y;
+            h_xa += w * n.x * j_a;
+            h_yy += w * n.y * n.y;
+            h_ya += w * n.y * j_a;
+            h_aa += w * j_a * j_a;
+
+            g_x += w * n.x * r;
+            g_y += w * n.y * r;
+            g_a += w * j_a * r;
+
+            ++num_correspondences;
+            sum_sq += r * r;
+        }
+
+        num_correspondences_ = num_correspondences;
+        rms_error_ = num_correspondences > 0 ? sqrt(sum_sq / num_correspondences) : 0;
+
+        if (num_correspondences < min_correspondences)
+            return false;
+
+        // Damping, such that directions the lines do not constrain (e.g., along a corridor) are not moved
+        double lambda = 1e-3 * num_correspondences;
+        h_xx += lambda;
+        h_yy += lambda;
+        h_aa += lambda;
+
+        // Solve with Cramer's rule
+        double c_xx = h_yy * h_aa - h_ya * h_ya;
+        double c_xy = h_xa * h_ya - h_xy * h_aa;
+        double c_xa = h_xy * h_ya - h_xa * h_yy;
+        double det = h_xx * c_xx + h_xy * c_xy + h_xa * c_xa;
+
+        if (std::abs(det) < 1e-12)
+            return false;
+
+        double c_yy = h_xx * h_aa - h_xa * h_xa;
+        double c_ya = h_xa * h_xy - h_xx * h_ya;
+        double c_aa = h_xx * h_yy - h_xy * h_xy;
+
+        double dx = -(c_xx * g_x + c_xy * g_y + c_xa * g_a) / det;
+        double dy = -(c_xy * g_x + c_yy * g_y + c_ya * g_a) / det;
+        double da = -(c_xa * g_x + c_ya * g_y + c_aa * g_a) / det;
+
+        geo::Transform2 rotation(0, 0, da);
+        geo::Transform2 delta(rotation.R, c + geo::Vec2(dx, dy) - rotation.R * c);
+        current = delta * current;
+
+        if (dx * dx + dy * dy < 1e-8 && std::abs(da) < 1e-4)
+            break;
+    }
+
+    // Reject corrections that are too large to be a refinement
+    geo::Transform2 correction = pose.inverse() * current;
+    if (correction.t.length() > max_correction_ || std::abs(correction.rotation()) > max_angle_correction_)
+        return false;
+
+    pose = current;
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool ScanMatcher::findCorrespondence(const geo::Vec2& p, geo::Vec2& q, geo::Vec2& n) const
+{
+    double best_dist_sq = max_correspondence_distance_ * max_correspondence_distance_;
+    bool found = false;
+
+    for(unsigned int i = 0; i < segments_.size(); ++i)
+    {
+        const Segment& s = segments_[i];
+        if (p.x < s.min.x || p.x > s.max.x || p.y < s.min.y || p.y > s.max.y)
+            continue;
+
+        geo::Vec2 d = p - s.start;
+        double t = std::max(0.0, std::min(1.0, d.dot(s.dir) * s.inv_length_sq));
+        geo::Vec2 q_s = s.start + s.dir * t;
+
+        double dist_sq = (p - q_s).length2();
+        if (dist_sq >= best_dist_sq)
+            continue;
+
+        best_dist_sq = dist_sq;
+        q = q_s;
+        found = true;
+
+        // Beyond the end points of the segment, match to the end point itself
+        if (t > 0 && t < 1)
+            n = s.normal;
+        else
+            n = dist_sq > 0 ? (p - q_s) / sqrt(dist_sq) : s.normal;
+    }
+
+    return found;
+}
@@ -0,0 +1,81 @@
+#ifndef ED_LOCALIZATION_SCAN_MATCHER_H_
+#define ED_LOCALIZATION_SCAN_MATCHER_H_
+
+#include <geolib/datatypes.h>
+
+#include <tue/config/configuration.h>
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Refines a pose estimate by matching the scan end points to line segments (point-to-line ICP). Every
+// iteration, each point is paired with the nearest segment within the correspondence distance, and the
+// pose increment that minimizes the (Huber weighted) distances of the points to the lines through their
+// segments is solved in closed form. The result is only accepted if enough points have a correspondence
+// and the correction stays within bounds, such that a wrong match can not pull the estimate away.
+
+class ScanMatcher
+{
+
+public:
+
+    ScanMatcher();
+
+    ~ScanMatcher();
+
+    void configure(tue::Configuration config);
+
+    // Refines 'pose' (of the robot base, in world coordinates) by matching 'points' (the scan end points, in
+    // the base frame) to the given segments (in world coordinates). Returns false, and leaves 'pose' unchanged,
+    // if the match was not accepted.
+    bool match(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end,
+               const std::vector<geo::Vec2>& points, geo::Transform2& pose);
+
+    double max_correspondence_distance() const { return max_correspondence_distance_; }
+
+    // Statistics of the last call to match
+    unsigned int num_iterations() const { return num_iterations_; }
+    unsigned int num_points() const { return points_.size(); }
+    unsigned int num_correspondences() const { return num_correspondences_; }
+    double rms_error() const { return rms_error_; }
+
+private:
+
+    int max_iterations_;
+    unsigned int max_points_;
+    double max_correspondence_distance_;
+    double huber_distance_;
+    double min_correspondence_fraction_;
+    double max_correction_;
+    double max_angle_correction_;
+
+    unsigned int num_iterations_;
+    unsigned int num_correspondences_;
+    double rms_error_;
+
+    // WORKSPACE
+
+    // Subsampled points (base frame)
+    std::vector<geo::Vec2> points_;
+
+    // Segments as start point, direction and inverse squared length, and their bounding boxes grown by
+    // the correspondence distance
+    struct Segment
+    {
+        geo::Vec2 start;
+        geo::Vec2 dir;
+        double inv_length_sq;
+        geo::Vec2 normal;
+        geo::Vec2 min, max;
+    };
+
+    std::vector<Segment> segments_;
+
+    // Finds the point 'q' on the nearest segment within the correspondence distance of 'p', and the normal
+    // 'n' of the line through it. Returns false if there is no segment that close.
+    bool findCorrespondence(const geo::Vec2& p, geo::Vec2& q, geo::Vec2& n) const;
+
+};
+
+#endif
@@ -0,0 +1,153 @@
+#include "segment_raycaster.h"
+
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+SegmentRaycaster::SegmentRaycaster() : angle_min_(0), angle_increment_(0), range_min_(0), range_max_(1e9),
+    cull_occluded_(true)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+SegmentRaycaster::~SegmentRaycaster()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SegmentRaycaster::setBeams(unsigned int num_beams, double angle_min, double angle_max)
+{
+    angle_min_ = angle_min;
+    angle_increment_ = num_beams > 1 ? (angle_max - angle_min) / (num_beams - 1) : 0;
+
+    dir_x_.resize(num_beams);
+    dir_y_.resize(num_beams);
+    for(unsigned int i = 0; i < num_beams; ++i)
+    {
+        double a = angle_min_ + i * angle_increment_;
+        dir_x_[i] = cos(a);
+        dir_y_[i] = sin(a);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SegmentRaycaster::setLines(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end)
+{
+    unsigned int n = lines_start.size();
+
+    x1_.resize(n);
+    y1_.resize(n);
+    x2_.resize(n);
+    y2_.resize(n);
+
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        x1_[i] = lines_start[i].x;
+        y1_[i] = lines_start[i].y;
+        x2_[i] = lines_end[i].x;
+        y2_[i] = lines_end[i].y;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SegmentRaycaster::render(const geo::Transform2& pose, std::vector<Scalar>& ranges) const
+{
+    if (dir_x_.empty())
+        return;
+
+    Scalar r_xx = pose.R.xx, r_xy = pose.R.xy, r_yx = pose.R.yx, r_yy = pose.R.yy;
+    Scalar t_x = pose.t.x, t_y = pose.t.y;
+    Scalar range_max = range_max_;
+
+    for(unsigned int k = 0; k < x1_.size(); ++k)
+    {
+        // Transform the points to the sensor frame
+        Scalar x1 = r_xx * x1_[k] + r_xy * y1_[k] + t_x;
+        Scalar y1 = r_yx * x1_[k] + r_yy * y1_[k] + t_y;
+        Scalar x2 = r_xx * x2_[k] + r_xy * y2_[k] + t_x;
+        Scalar y2 = r_yx * x2_[k] + r_yy * y2_[k] + t_y;
+
+        // Closest distance of the segment to the sensor
+        Scalar ex = x2 - x1;
+        Scalar ey = y2 - y1;
+        Scalar length_sq = ex * ex + ey * ey;
+        Scalar s = length_sq > 0 ? -(x1 * ex + y1 * ey) / length_sq : 0;
+        s = std::max<Scalar>(0, std::min<Scalar>(1, s));
+
+        Scalar cx = x1 + s * ex;
+        Scalar cy = y1 + s * ey;
+        Scalar d_min = std::sqrt(cx * cx + cy * cy);
+
+        // Completely out of range
+        if (d_min > range_max)
+            continue;
+
+        Scalar a1 = std::atan2(y1, x1);
+        Scalar a2 = std::atan2(y2, x2);
+        if (a2 < a1)
+            std::swap(a1, a2);
+
+        if (a2 - a1 <= M_PI)
+        {
+            renderSpan(x1, y1, x2, y2, a1, a2, d_min, ranges);
+        }
+        else
+        {
+            // The segment crosses the negative x-axis (directly behind the sensor)
+            renderSpan(x1, y1, x2, y2, a2, M_PI, d_min, ranges);
+            renderSpan(x1, y1, x2, y2, -M_PI, a1, d_min, ranges);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void SegmentRaycaster::renderSpan(Scalar x1, Scalar y1, Scalar x2, Scalar y2, Scalar a_min, Scalar a_max,
+                                  Scalar d_min, std::vector<Scalar>& ranges) const
+{
+    int n = dir_x_.size();
+
+    int i_min, i_max;
+    if (angle_increment_ > 0)
+    {
+        i_min = std::max<int>(0, std::ceil((a_min - angle_min_) / angle_increment_));
+        i_max = std::min<int>(n - 1, std::floor((a_max - angle_min_) / angle_increment_));
+    }
+    else
+    {
+        // Single beam
+        i_min = 0;
+        i_max = (angle_min_ >= a_min && angle_min_ <= a_max) ? 0 : -1;
+    }
+
+    Scalar ex = x2 - x1;
+    Scalar ey = y2 - y1;
+    Scalar c1 = x1 * ey - y1 * ex;
+
+    Scalar range_min = range_min_;
+    Scalar range_max = range_max_;
+
+    for(int i = i_min; i <= i_max; ++i)
+    {
+        Scalar& r_current = ranges[i];
+
+        // Something nearer already hit this beam
+        if (cull_occluded_ && r_current > 0 && r_current <= d_min)
+            continue;
+
+        Scalar den = dir_x_[i] * ey - dir_y_[i] * ex;
+        if (den == 0)
+            continue;
+
+        Scalar r = c1 / den;
+        if (r <= 0 || r < range_min || r > range_max)
+            continue;
+
+        if (r_current == 0 || r < r_current)
+            r_current = r;
+    }
+}
@@ -0,0 +1,65 @@
+#ifndef ED_LOCALIZATION_SEGMENT_RAYCASTER_H_
+#define ED_LOCALIZATION_SEGMENT_RAYCASTER_H_
+
+#include "scalar.h"
+
+#include <geolib/datatypes.h>
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Renders 2D line segments into the beams of a planar laser range finder. Every segment is only
+// intersected with the beams within its angular span (as seen from the sensor). If occlusion culling
+// is enabled, beams that already hit something nearer than the closest point of a segment are skipped.
+// This is most effective if the segments are ordered near to far.
+
+class SegmentRaycaster
+{
+
+public:
+
+    SegmentRaycaster();
+
+    ~SegmentRaycaster();
+
+    // Beam i has angle angle_min + i * (angle_max - angle_min) / (num_beams - 1)
+    void setBeams(unsigned int num_beams, double angle_min, double angle_max);
+
+    void setRangeLimits(double range_min, double range_max) { range_min_ = range_min; range_max_ = range_max; }
+
+    void setCullOccluded(bool b) { cull_occluded_ = b; }
+
+    unsigned int numBeams() const { return dir_x_.size(); }
+
+    // Sets the segments (in world coordinates) that are rendered by subsequent calls to render
+    void setLines(const std::vector<geo::Vec2>& lines_start, const std::vector<geo::Vec2>& lines_end);
+
+    // Renders all segments, after transforming them with 'pose' (from world to sensor frame). The ranges are
+    // assumed to be initialized; beams without a hit are 0.
+    void render(const geo::Transform2& pose, std::vector<Scalar>& ranges) const;
+
+private:
+
+    double angle_min_;
+    double angle_increment_;
+
+    double range_min_;
+    double range_max_;
+
+    bool cull_occluded_;
+
+    // Beam directions
+    std::vector<Scalar> dir_x_;
+    std::vector<Scalar> dir_y_;
+
+    // Segment end points, stored as structure of arrays
+    std::vector<Scalar> x1_, y1_, x2_, y2_;
+
+    // Renders segment (x1, y1) - (x2, y2) (in sensor frame) into the beams with angles in [a_min, a_max]
+    void renderSpan(Scalar x1, Scalar y1, Scalar x2, Scalar y2, Scalar a_min, Scalar a_max, Scalar d_min,
+                    std::vector<Scalar>& ranges) const;
+
+};
+
+#endif
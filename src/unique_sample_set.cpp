@@ -0,0 +1,95 @@
+#include "unique_sample_set.h"
+
+#include <algorithm>
+
+// ----------------------------------------------------------------------------------------------------
+
+UniqueSampleSet::UniqueSampleSet()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+UniqueSampleSet::~UniqueSampleSet()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void UniqueSampleSet::update(const SampleSet& samples, double min_distance, double min_rotation_distance)
+{
+    // The buffers keep their capacity between updates
+    samples_.clear();
+    sample_to_unique_.resize(samples.size());
+
+    double min_distance_sq = min_distance * min_distance;
+
+    // The unique samples are indexed in a spatial hash with cells that are at least as large as the
+    // distance thresholds. Therefore, a unique sample that is close enough to a given sample is always
+    // in the same cell or in one of the directly neighbouring cells. This keeps the deduplication linear
+    // in the number of samples, instead of comparing every sample to every unique sample.
+    bool use_hash = (min_distance > 0 && min_rotation_distance > 0);
+    if (use_hash)
+    {
+        hash_.setResolution(min_distance, min_rotation_distance);
+        hash_.clear(samples.size());
+    }
+
+    // If there are less than 3 angle cells, the angular neighbours would wrap onto each other
+    int num_da = std::min(3, hash_.numAngleCells());
+
+    for(unsigned int i = 0; i < samples.size(); ++i)
+    {
+        Transform t1 = samples.transform(i);
+
+        if (!use_hash)
+        {
+            sample_to_unique_[i] = samples_.size();
+            samples_.push_back(t1);
+            continue;
+        }
+
+        PoseHash::Cell c = hash_.cell(t1.translation().x, t1.translation().y, t1.rotation());
+
+        // Find the unique sample with the lowest index that is within the boundaries. This gives the
+        // same result as a linear search through the unique sample list.
+        unsigned int i_unique = samples_.size();
+        for(int dx = -1; dx <= 1; ++dx)
+        {
+            for(int dy = -1; dy <= 1; ++dy)
+            {
+                for(int k = 0; k < num_da; ++k)
+                {
+                    int da = (k == 2 ? -1 : k);
+
+                    PoseHash::Cell c_n = hash_.neighbour(c, dx, dy, da);
+                    for(int e = hash_.find(c_n); e >= 0; e = hash_.next(e))
+                    {
+                        unsigned int j = hash_.value(e);
+                        if (j >= i_unique)
+                            continue;
+
+                        const Transform& t2 = samples_[j];
+
+                        // Calculate difference in rotation
+                        double rot_diff = std::abs(t1.rotation() - t2.rotation());
+                        if (rot_diff > M_PI)
+                            rot_diff = 2 * M_PI - rot_diff;
+
+                        // Check if translation and rotational difference are within boundaries
+                        if ((t1.matrix().t - t2.matrix().t).length2() < min_distance_sq && rot_diff < min_rotation_distance)
+                            i_unique = j;
+                    }
+                }
+            }
+        }
+
+        if (i_unique == samples_.size())
+        {
+            hash_.insert(c, i_unique);
+            samples_.push_back(t1);
+        }
+
+        sample_to_unique_[i] = i_unique;
+    }
+}
@@ -0,0 +1,45 @@
+#ifndef ED_LOCALIZATION_UNIQUE_SAMPLE_SET_H_
+#define ED_LOCALIZATION_UNIQUE_SAMPLE_SET_H_
+
+#include "particle_filter.h"
+#include "pose_hash.h"
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// If N samples are nearly identical, we only want to calculate the probability update once and share
+// it for all N samples. The unique sample set only contains samples that are further apart than a given
+// threshold, together with the mapping of every sample to its unique sample. Since the set only depends
+// on the samples, it can be shared by multiple sensor models.
+
+class UniqueSampleSet
+{
+
+public:
+
+    UniqueSampleSet();
+
+    ~UniqueSampleSet();
+
+    // Rebuilds the set from the given samples. If one of the thresholds is not positive, every sample is unique.
+    void update(const SampleSet& samples, double min_distance, double min_rotation_distance);
+
+    unsigned int size() const { return samples_.size(); }
+
+    const Transform& operator[](unsigned int i) const { return samples_[i]; }
+
+    // Index of the unique sample of every sample
+    const std::vector<unsigned int>& sampleToUnique() const { return sample_to_unique_; }
+
+private:
+
+    PoseHash hash_;
+
+    std::vector<Transform> samples_;
+
+    std::vector<unsigned int> sample_to_unique_;
+
+};
+
+#endif
@@ -0,0 +1,109 @@
+#include "worker_pool.h"
+
+#include <boost/bind.hpp>
+
+// ----------------------------------------------------------------------------------------------------
+
+WorkerPool::WorkerPool() : job_(0), generation_(0), num_busy_(0), stop_(false)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+WorkerPool::~WorkerPool()
+{
+    stopThreads();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::setNumThreads(unsigned int num_threads)
+{
+    if (num_threads == 0)
+        num_threads = std::max<unsigned int>(1, boost::thread::hardware_concurrency());
+
+    if (num_threads == numThreads())
+        return;
+
+    stopThreads();
+
+    for(unsigned int i = 1; i < num_threads; ++i)
+        threads_.push_back(new boost::thread(boost::bind(&WorkerPool::workerLoop, this, i, generation_)));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::run(const boost::function<void(unsigned int)>& job)
+{
+    if (threads_.empty())
+    {
+        job(0);
+        return;
+    }
+
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        job_ = &job;
+        num_busy_ = threads_.size();
+        ++generation_;
+    }
+    cond_start_.notify_all();
+
+    job(0);
+
+    boost::mutex::scoped_lock lock(mutex_);
+    while (num_busy_ > 0)
+        cond_done_.wait(lock);
+
+    job_ = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::stopThreads()
+{
+    {
+        boost::mutex::scoped_lock lock(mutex_);
+        stop_ = true;
+    }
+    cond_start_.notify_all();
+
+    for(std::vector<boost::thread*>::iterator it = threads_.begin(); it != threads_.end(); ++it)
+    {
+        (*it)->join();
+        delete *it;
+    }
+
+    threads_.clear();
+    stop_ = false;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorkerPool::workerLoop(unsigned int i_thread, unsigned int generation)
+{
+    while(true)
+    {
+        const boost::function<void(unsigned int)>* job;
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            while (!stop_ && generation_ == generation)
+                cond_start_.wait(lock);
+
+            if (stop_)
+                return;
+
+            generation = generation_;
+            job = job_;
+        }
+
+        (*job)(i_thread);
+
+        {
+            boost::mutex::scoped_lock lock(mutex_);
+            --num_busy_;
+        }
+        cond_done_.notify_one();
+    }
+}
@@ -0,0 +1,53 @@
+#ifndef ED_LOCALIZATION_WORKER_POOL_H_
+#define ED_LOCALIZATION_WORKER_POOL_H_
+
+#include <boost/function.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+#include <vector>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Small pool of persistent worker threads. A job is a function that takes the index of the thread it
+// runs on. The calling thread participates as thread 0, so a pool with one thread runs everything
+// in the calling thread without any synchronization.
+
+class WorkerPool
+{
+
+public:
+
+    WorkerPool();
+
+    ~WorkerPool();
+
+    void setNumThreads(unsigned int num_threads);
+
+    unsigned int numThreads() const { return threads_.size() + 1; }
+
+    // Calls job(i) for every thread i in [0, numThreads()) and blocks until all calls returned
+    void run(const boost::function<void(unsigned int)>& job);
+
+private:
+
+    std::vector<boost::thread*> threads_;
+
+    boost::mutex mutex_;
+    boost::condition_variable cond_start_;
+    boost::condition_variable cond_done_;
+
+    const boost::function<void(unsigned int)>* job_;
+    unsigned int generation_;
+    unsigned int num_busy_;
+    bool stop_;
+
+    void stopThreads();
+
+    // 'generation' is the job generation at the time the thread was created
+    void workerLoop(unsigned int i_thread, unsigned int generation);
+
+};
+
+#endif
@@ -0,0 +1,451 @@
+#include "world_cross_section.h"
+
+#include "filter_state.h"
+
+#include <ed/world_model.h>
+#include <ed/entity.h>
+#include <geolib/Shape.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+class SegmentRenderResult : public geo::LaserRangeFinder::RenderResult
+{
+
+public:
+
+    SegmentRenderResult(std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end)
+        : geo::LaserRangeFinder::RenderResult(dummy_ranges_), lines_start_(lines_start), lines_end_(lines_end) {}
+
+    void renderLine(const geo::Vec2& p1, const geo::Vec2& p2)
+    {
+        lines_start_.push_back(p1);
+        lines_end_.push_back(p2);
+    }
+
+private:
+
+    std::vector<double> dummy_ranges_;
+    std::vector<geo::Vec2>& lines_start_;
+    std::vector<geo::Vec2>& lines_end_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+bool isEqual(const geo::Pose3D& p1, const geo::Pose3D& p2)
+{
+    return p1.t.x == p2.t.x && p1.t.y == p2.t.y && p1.t.z == p2.t.z
+            && p1.R.xx == p2.R.xx && p1.R.xy == p2.R.xy && p1.R.xz == p2.R.xz
+            && p1.R.yx == p2.R.yx && p1.R.yy == p2.R.yy && p1.R.yz == p2.R.yz
+            && p1.R.zx == p2.R.zx && p1.R.zy == p2.R.zy && p1.R.zz == p2.R.zz;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+WorldCrossSection::WorldCrossSection() : height_(-1), cell_size_(1), revision_(0), grid_dirty_(true),
+    grid_width_(0), grid_height_(0), stamp_(0)
+{
+    // The cross section is rendered from the world origin, so make sure nothing is culled
+    lrf_.setNumBeams(100);
+    lrf_.setAngleLimits(-M_PI, M_PI);
+    lrf_.setRangeLimits(0, 1e9);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+WorldCrossSection::~WorldCrossSection()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool WorldCrossSection::update(const ed::WorldModel& world, double height)
+{
+    bool changed = false;
+
+    // If the height changed, all entities have to be re-rendered
+    if (height != height_)
+    {
+        entities_.clear();
+        world_entities_.clear();
+        world_entity_lines_.clear();
+        height_ = height;
+        changed = true;
+    }
+    else if (isUnchanged(world))
+    {
+        if (grid_dirty_)
+            rebuildGrid();
+        return false;
+    }
+
+    for(std::map<ed::UUID, EntityLines>::iterator it = entities_.begin(); it != entities_.end(); ++it)
+        it->second.seen = false;
+
+    // Used to recognize entity objects that did not change, and are at the same position in the world model
+    std::vector<ed::EntityConstPtr> previous_entities;
+    std::vector<EntityLines*> previous_entity_lines;
+    previous_entities.swap(world_entities_);
+    previous_entity_lines.swap(world_entity_lines_);
+
+    unsigned int i = 0;
+    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it, ++i)
+    {
+        const ed::EntityConstPtr& e = *it;
+
+        world_entities_.push_back(e);
+
+        // Same object, so the same shape, pose and flags
+        if (i < previous_entities.size() && previous_entities[i] == e)
+        {
+            EntityLines* lines = previous_entity_lines[i];
+            if (lines)
+                lines->seen = true;
+            world_entity_lines_.push_back(lines);
+            continue;
+        }
+
+        if (!isLocalizable(*e))
+        {
+            world_entity_lines_.push_back(0);
+            continue;
+        }
+
+        std::map<ed::UUID, EntityLines>::iterator it_lines = entities_.find(e->id());
+        if (it_lines == entities_.end())
+        {
+            it_lines = entities_.insert(std::make_pair(e->id(), EntityLines())).first;
+            render(*e, it_lines->second);
+            changed = true;
+        }
+        else
+        {
+            EntityLines& lines = it_lines->second;
+
+            bool up_to_date;
+            if (lines.restored)
+            {
+                unsigned int num_points;
+                double checksum;
+                meshChecksum(*e, num_points, checksum);
+
+                up_to_date = isEqual(lines.pose, e->pose()) && num_points == lines.num_points && checksum == lines.checksum;
+                lines.shape_revision = e->shapeRevision();
+                lines.restored = false;
+            }
+            else
+                up_to_date = (lines.shape_revision == e->shapeRevision() && isEqual(lines.pose, e->pose()));
+
+            if (!up_to_date)
+            {
+                render(*e, lines);
+                changed = true;
+            }
+        }
+
+        it_lines->second.seen = true;
+        world_entity_lines_.push_back(&it_lines->second);
+    }
+
+    // Remove all entities that are no longer in the world model (or no longer localizable)
+    for(std::map<ed::UUID, EntityLines>::iterator it = entities_.begin(); it != entities_.end();)
+    {
+        if (!it->second.seen)
+        {
+            entities_.erase(it++);
+            changed = true;
+        }
+        else
+            ++it;
+    }
+
+    if (changed)
+        collectLines();
+
+    if (grid_dirty_)
+        rebuildGrid();
+
+    return changed;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::collectLines()
+{
+    lines_start_.clear();
+    lines_end_.clear();
+    for(std::map<ed::UUID, EntityLines>::const_iterator it = entities_.begin(); it != entities_.end(); ++it)
+    {
+        const EntityLines& lines = it->second;
+        lines_start_.insert(lines_start_.end(), lines.lines_start.begin(), lines.lines_start.end());
+        lines_end_.insert(lines_end_.end(), lines.lines_end.begin(), lines.lines_end.end());
+    }
+
+    ++revision_;
+    grid_dirty_ = true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::saveState(FilterState& state) const
+{
+    state.cross_section_height = height_;
+    state.entities.clear();
+    state.entities.reserve(entities_.size());
+
+    for(std::map<ed::UUID, EntityLines>::const_iterator it = entities_.begin(); it != entities_.end(); ++it)
+    {
+        const EntityLines& lines = it->second;
+
+        state.entities.push_back(EntityState());
+        EntityState& e = state.entities.back();
+        e.id = it->first.str();
+        e.shape_revision = lines.shape_revision;
+        e.pose = lines.pose;
+        e.num_points = lines.num_points;
+        e.checksum = lines.checksum;
+        e.lines_start = lines.lines_start;
+        e.lines_end = lines.lines_end;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::restoreState(const FilterState& state)
+{
+    if (state.cross_section_height < 0)
+        return;
+
+    height_ = state.cross_section_height;
+    entities_.clear();
+    world_entities_.clear();
+    world_entity_lines_.clear();
+
+    for(unsigned int i = 0; i < state.entities.size(); ++i)
+    {
+        const EntityState& e = state.entities[i];
+
+        EntityLines& lines = entities_[e.id];
+        lines.shape_revision = e.shape_revision;
+        lines.pose = e.pose;
+        lines.seen = false;
+        lines.restored = true;
+        lines.num_points = e.num_points;
+        lines.checksum = e.checksum;
+        lines.lines_start = e.lines_start;
+        lines.lines_end = e.lines_end;
+    }
+
+    collectLines();
+    rebuildGrid();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool WorldCrossSection::isUnchanged(const ed::WorldModel& world) const
+{
+    unsigned int i = 0;
+    for(ed::WorldModel::const_iterator it = world.begin(); it != world.end(); ++it, ++i)
+    {
+        if (i >= world_entities_.size() || world_entities_[i] != *it)
+            return false;
+    }
+
+    return i == world_entities_.size();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool WorldCrossSection::isLocalizable(const ed::Entity& e)
+{
+    if (!e.shape() || !e.has_pose())
+        return false;
+
+    // Do not render the robot itself (we're trying to localize it!)
+    if (e.hasFlag("self"))
+        return false;
+
+    return !e.hasFlag("non-localizable");
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::meshChecksum(const ed::Entity& e, unsigned int& num_points, double& checksum)
+{
+    const std::vector<geo::Vector3>& points = e.shape()->getMesh().getPoints();
+
+    num_points = points.size();
+    checksum = 0;
+    for(unsigned int i = 0; i < points.size(); ++i)
+        checksum += points[i].x + 2 * points[i].y + 3 * points[i].z;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::render(const ed::Entity& e, EntityLines& lines)
+{
+    lines.shape_revision = e.shapeRevision();
+    lines.pose = e.pose();
+    lines.restored = false;
+    meshChecksum(e, lines.num_points, lines.checksum);
+    lines.lines_start.clear();
+    lines.lines_end.clear();
+
+    SegmentRenderResult render_result(lines.lines_start, lines.lines_end);
+
+    geo::Pose3D origin(0, 0, height_);
+
+    geo::LaserRangeFinder::RenderOptions options;
+    geo::Transform t_inv = origin.inverse() * e.pose();
+    options.setMesh(e.shape()->getMesh(), t_inv);
+    lrf_.render(options, render_result);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::rebuildGrid()
+{
+    grid_dirty_ = false;
+
+    min_ = geo::Vec2(1e9, 1e9);
+    max_ = geo::Vec2(-1e9, -1e9);
+
+    for(unsigned int i = 0; i < lines_start_.size(); ++i)
+    {
+        const geo::Vec2& p1 = lines_start_[i];
+        const geo::Vec2& p2 = lines_end_[i];
+
+        min_.x = std::min(min_.x, std::min(p1.x, p2.x));
+        min_.y = std::min(min_.y, std::min(p1.y, p2.y));
+        max_.x = std::max(max_.x, std::max(p1.x, p2.x));
+        max_.y = std::max(max_.y, std::max(p1.y, p2.y));
+    }
+
+    segment_stamps_.assign(lines_start_.size(), 0);
+    stamp_ = 0;
+
+    if (lines_start_.empty())
+    {
+        grid_width_ = 0;
+        grid_height_ = 0;
+        cell_offsets_.assign(1, 0);
+        cell_segments_.clear();
+        return;
+    }
+
+    grid_width_ = (max_.x - min_.x) / cell_size_ + 1;
+    grid_height_ = (max_.y - min_.y) / cell_size_ + 1;
+
+    // First count the number of segments per cell, then fill the cells
+    cell_offsets_.assign(grid_width_ * grid_height_ + 1, 0);
+
+    for(int pass = 0; pass < 2; ++pass)
+    {
+        for(unsigned int i = 0; i < lines_start_.size(); ++i)
+        {
+            const geo::Vec2& p1 = lines_start_[i];
+            const geo::Vec2& p2 = lines_end_[i];
+
+            int x_min = (std::min(p1.x, p2.x) - min_.x) / cell_size_;
+            int x_max = (std::max(p1.x, p2.x) - min_.x) / cell_size_;
+            int y_min = (std::min(p1.y, p2.y) - min_.y) / cell_size_;
+            int y_max = (std::max(p1.y, p2.y) - min_.y) / cell_size_;
+
+            for(int y = y_min; y <= y_max; ++y)
+            {
+                for(int x = x_min; x <= x_max; ++x)
+                {
+                    unsigned int c = y * grid_width_ + x;
+                    if (pass == 0)
+                        ++cell_offsets_[c + 1];
+                    else
+                        cell_segments_[cell_offsets_[c]++] = i;
+                }
+            }
+        }
+
+        if (pass == 0)
+        {
+            for(unsigned int c = 1; c < cell_offsets_.size(); ++c)
+                cell_offsets_[c] += cell_offsets_[c - 1];
+
+            cell_segments_.resize(cell_offsets_.back());
+        }
+    }
+
+    // During the second pass the offsets have been shifted by one cell, so shift them back
+    for(unsigned int c = cell_offsets_.size() - 1; c > 0; --c)
+        cell_offsets_[c] = cell_offsets_[c - 1];
+    cell_offsets_[0] = 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void WorldCrossSection::query(const geo::Vec2& center, double radius,
+                              std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end) const
+{
+    if (lines_start_.empty())
+        return;
+
+    int x_min = std::max<int>(0, floor((center.x - radius - min_.x) / cell_size_));
+    int x_max = std::min<int>(grid_width_ - 1, floor((center.x + radius - min_.x) / cell_size_));
+    int y_min = std::max<int>(0, floor((center.y - radius - min_.y) / cell_size_));
+    int y_max = std::min<int>(grid_height_ - 1, floor((center.y + radius - min_.y) / cell_size_));
+
+    // Make sure segments that are in multiple cells are only considered once
+    ++stamp_;
+    if (stamp_ == 0)
+    {
+        segment_stamps_.assign(segment_stamps_.size(), 0);
+        stamp_ = 1;
+    }
+
+    double radius_sq = radius * radius;
+
+    for(int y = y_min; y <= y_max; ++y)
+    {
+        for(int x = x_min; x <= x_max; ++x)
+        {
+            unsigned int c = y * grid_width_ + x;
+            for(unsigned int k = cell_offsets_[c]; k < cell_offsets_[c + 1]; ++k)
+            {
+                unsigned int i = cell_segments_[k];
+                if (segment_stamps_[i] == stamp_)
+                    continue;
+
+                segment_stamps_[i] = stamp_;
+
+                // Calculate distance to the line
+
+                geo::Vec2 p1 = lines_start_[i] - center;
+                geo::Vec2 p2 = lines_end_[i] - center;
+
+                geo::Vec2 diff = p2 - p1;
+                double line_length_sq = diff.length2();
+
+                double t = p1.dot(diff) / -line_length_sq;
+
+                double distance_sq;
+
+                if (t < 0)
+                    distance_sq = p1.length2();
+                else if (t > 1)
+                    distance_sq = p2.length2();
+                else
+                    distance_sq = (p1 + t * diff).length2();
+
+                // If too far, skip
+                if (distance_sq > radius_sq)
+                    continue;
+
+                lines_start.push_back(lines_start_[i]);
+                lines_end.push_back(lines_end_[i]);
+            }
+        }
+    }
+}
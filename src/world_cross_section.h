@@ -0,0 +1,124 @@
+#ifndef ED_LOCALIZATION_WORLD_CROSS_SECTION_H_
+#define ED_LOCALIZATION_WORLD_CROSS_SECTION_H_
+
+#include <ed/types.h>
+#include <geolib/datatypes.h>
+#include <geolib/sensors/LaserRangeFinder.h>
+
+#include <map>
+
+class FilterState;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Persistent 2D cross section of the world model at a given height (typically the laser height), in
+// world coordinates. Entities are only re-rendered if their shape revision or pose changed since the
+// previous update. The resulting line segments are indexed in a uniform grid, such that all segments
+// around a certain position can be queried without touching the whole world.
+//
+// The world model replaces an entity object whenever the entity changes, so an entity that is still the
+// same object as during the previous update did not change. If the world model consists of exactly the
+// same objects as before, the update is only a pointer comparison per entity (no flag lookups).
+
+class WorldCrossSection
+{
+
+public:
+
+    WorldCrossSection();
+
+    ~WorldCrossSection();
+
+    void setCellSize(double cell_size) { cell_size_ = cell_size; grid_dirty_ = true; }
+
+    // Brings the cross section up to date with the world model. Returns true if it changed.
+    bool update(const ed::WorldModel& world, double height);
+
+    // Appends all segments that are (partly) within 'radius' of 'center'
+    void query(const geo::Vec2& center, double radius,
+               std::vector<geo::Vec2>& lines_start, std::vector<geo::Vec2>& lines_end) const;
+
+    // All segments of the cross section
+    const std::vector<geo::Vec2>& lines_start() const { return lines_start_; }
+    const std::vector<geo::Vec2>& lines_end() const { return lines_end_; }
+
+    const geo::Vec2& min() const { return min_; }
+    const geo::Vec2& max() const { return max_; }
+
+    // Incremented every time the cross section changes
+    unsigned int revision() const { return revision_; }
+
+    // Exports and imports the rendered entities (see FilterState). Imported entities are only used if the
+    // pose and mesh of the entity in the world model still match, otherwise they are rendered again.
+    void saveState(FilterState& state) const;
+    void restoreState(const FilterState& state);
+
+private:
+
+    struct EntityLines
+    {
+        int shape_revision;
+        geo::Pose3D pose;
+        bool seen;
+
+        // Imported (see restoreState): the shape revision is not comparable, so the mesh is checked instead
+        bool restored;
+        unsigned int num_points;
+        double checksum;
+
+        std::vector<geo::Vec2> lines_start;
+        std::vector<geo::Vec2> lines_end;
+    };
+
+    double height_;
+
+    double cell_size_;
+
+    unsigned int revision_;
+
+    std::map<ed::UUID, EntityLines> entities_;
+
+    // All entity objects of the world model during the last update, in world model order, and their lines
+    // (0 if the entity is not localizable). Holding the pointers makes sure the objects are not reused.
+    std::vector<ed::EntityConstPtr> world_entities_;
+    std::vector<EntityLines*> world_entity_lines_;
+
+    geo::LaserRangeFinder lrf_;
+
+    // All segments of all entities
+    std::vector<geo::Vec2> lines_start_;
+    std::vector<geo::Vec2> lines_end_;
+
+    // GRID
+
+    bool grid_dirty_;
+    geo::Vec2 min_, max_;
+    int grid_width_, grid_height_;
+
+    // Segment indices per cell, stored consecutively. The indices of cell i are in
+    // cell_segments_[cell_offsets_[i]] ... cell_segments_[cell_offsets_[i + 1] - 1]
+    std::vector<unsigned int> cell_offsets_;
+    std::vector<unsigned int> cell_segments_;
+
+    // Used to make sure segments that span multiple cells are only returned once
+    mutable std::vector<unsigned int> segment_stamps_;
+    mutable unsigned int stamp_;
+
+    void render(const ed::Entity& e, EntityLines& lines);
+
+    // Returns true if the world model consists of exactly the same entity objects as during the last update
+    bool isUnchanged(const ed::WorldModel& world) const;
+
+    static bool isLocalizable(const ed::Entity& e);
+
+    // Number of vertices and a weighted sum of their coordinates
+    static void meshChecksum(const ed::Entity& e, unsigned int& num_points, double& checksum);
+
+    // Collects the segments of all entities, and marks the cross section as changed
+    void collectLines();
+
+    void rebuildGrid();
+
+};
+
+#endif
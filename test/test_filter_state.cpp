@@ -0,0 +1,288 @@
+#include "../src/filter_state.h"
+
+#include <gtest/gtest.h>
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+std::string tempFilename(const std::string& name)
+{
+    std::stringstream s;
+    s << "/tmp/ed_localization_" << name << "_" << getpid() << ".bin";
+    return s.str();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FilterState createState()
+{
+    FilterState state;
+
+    for(unsigned int i = 0; i < 20; ++i)
+    {
+        state.sample_poses.push_back(geo::Transform2(0.5 * i, -0.25 * i, 0.1 * i - 1));
+        state.sample_weights.push_back(1.0 / (i + 1));
+    }
+
+    state.has_odom_pose = true;
+    state.odom_x = 1.5;
+    state.odom_y = -2.5;
+    state.odom_yaw = 0.75;
+
+    state.cross_section_height = 0.3;
+
+    const char* ids[] = { "wall", "table", "cabinet" };
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+        EntityState e;
+        e.id = ids[i];
+        e.shape_revision = i + 1;
+        e.pose = geo::Pose3D(i, 2 * i, 0.1, 0, 0, 0.2 * i);
+        e.num_points = 8 * (i + 1);
+        e.checksum = 12.5 * i;
+
+        for(unsigned int j = 0; j <= i; ++j)
+        {
+            e.lines_start.push_back(geo::Vec2(j, i));
+            e.lines_end.push_back(geo::Vec2(j + 0.5, i - 0.5));
+        }
+
+        state.entities.push_back(e);
+    }
+
+    state.field_origin = geo::Vec2(-5, -4);
+    state.field_resolution = 0.05;
+    state.field_max_distance = 1.0;
+    state.field_width = 4;
+    state.field_height = 3;
+    for(int i = 0; i < state.field_width * state.field_height; ++i)
+        state.field_distances.push_back(0.125 * i);
+
+    return state;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+std::string readFile(const std::string& filename)
+{
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    std::stringstream s;
+    s << in.rdbuf();
+    return s.str();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void writeFile(const std::string& filename, const std::string& data)
+{
+    std::ofstream out(filename.c_str(), std::ios::binary | std::ios::trunc);
+    out.write(data.c_str(), data.size());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Writes 'data' and checks that it is rejected (and that a rejected load leaves the state empty)
+void expectRejected(const std::string& filename, const std::string& data)
+{
+    writeFile(filename, data);
+
+    FilterState state = createState();
+    std::string error;
+    EXPECT_FALSE(state.load(filename, error));
+    EXPECT_FALSE(error.empty());
+    EXPECT_TRUE(state.sample_poses.empty());
+    EXPECT_TRUE(state.entities.empty());
+}
+
+} // end namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(FilterState, RoundTrip)
+{
+    std::string filename = tempFilename("filter_state_round_trip");
+
+    FilterState original = createState();
+
+    std::string error;
+    ASSERT_TRUE(original.save(filename, error)) << error;
+
+    FilterState loaded;
+    ASSERT_TRUE(loaded.load(filename, error)) << error;
+    remove(filename.c_str());
+
+    // Samples are stored in single precision
+    ASSERT_EQ(original.sample_poses.size(), loaded.sample_poses.size());
+    ASSERT_EQ(original.sample_weights.size(), loaded.sample_weights.size());
+    for(unsigned int i = 0; i < original.sample_poses.size(); ++i)
+    {
+        EXPECT_NEAR(original.sample_poses[i].t.x, loaded.sample_poses[i].t.x, 1e-5);
+        EXPECT_NEAR(original.sample_poses[i].t.y, loaded.sample_poses[i].t.y, 1e-5);
+        EXPECT_NEAR(original.sample_poses[i].rotation(), loaded.sample_poses[i].rotation(), 1e-5);
+        EXPECT_NEAR(original.sample_weights[i], loaded.sample_weights[i], 1e-6);
+    }
+
+    EXPECT_TRUE(loaded.has_odom_pose);
+    EXPECT_EQ(original.odom_x, loaded.odom_x);
+    EXPECT_EQ(original.odom_y, loaded.odom_y);
+    EXPECT_EQ(original.odom_yaw, loaded.odom_yaw);
+
+    EXPECT_EQ(original.cross_section_height, loaded.cross_section_height);
+
+    ASSERT_EQ(original.entities.size(), loaded.entities.size());
+    for(unsigned int i = 0; i < original.entities.size(); ++i)
+    {
+        const EntityState& e1 = original.entities[i];
+        const EntityState& e2 = loaded.entities[i];
+
+        EXPECT_EQ(e1.id, e2.id);
+        EXPECT_EQ(e1.shape_revision, e2.shape_revision);
+        EXPECT_EQ(e1.num_points, e2.num_points);
+        EXPECT_EQ(e1.checksum, e2.checksum);
+
+        // Entity poses are stored in double precision
+        EXPECT_EQ(e1.pose.t.x, e2.pose.t.x);
+        EXPECT_EQ(e1.pose.t.y, e2.pose.t.y);
+        EXPECT_EQ(e1.pose.t.z, e2.pose.t.z);
+        EXPECT_EQ(e1.pose.R.xx, e2.pose.R.xx);
+        EXPECT_EQ(e1.pose.R.xy, e2.pose.R.xy);
+        EXPECT_EQ(e1.pose.R.yx, e2.pose.R.yx);
+        EXPECT_EQ(e1.pose.R.zz, e2.pose.R.zz);
+
+        ASSERT_EQ(e1.lines_start.size(), e2.lines_start.size());
+        ASSERT_EQ(e1.lines_end.size(), e2.lines_end.size());
+        for(unsigned int j = 0; j < e1.lines_start.size(); ++j)
+        {
+            EXPECT_NEAR(e1.lines_start[j].x, e2.lines_start[j].x, 1e-6);
+            EXPECT_NEAR(e1.lines_start[j].y, e2.lines_start[j].y, 1e-6);
+            EXPECT_NEAR(e1.lines_end[j].x, e2.lines_end[j].x, 1e-6);
+            EXPECT_NEAR(e1.lines_end[j].y, e2.lines_end[j].y, 1e-6);
+        }
+    }
+
+    EXPECT_EQ(original.field_origin.x, loaded.field_origin.x);
+    EXPECT_EQ(original.field_origin.y, loaded.field_origin.y);
+    EXPECT_EQ(original.field_resolution, loaded.field_resolution);
+    EXPECT_EQ(original.field_max_distance, loaded.field_max_distance);
+    EXPECT_EQ(original.field_width, loaded.field_width);
+    EXPECT_EQ(original.field_height, loaded.field_height);
+    EXPECT_EQ(original.field_distances, loaded.field_distances);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(FilterState, RoundTripEmpty)
+{
+    std::string filename = tempFilename("filter_state_empty");
+
+    FilterState original;
+
+    std::string error;
+    ASSERT_TRUE(original.save(filename, error)) << error;
+
+    FilterState loaded = createState();
+    ASSERT_TRUE(loaded.load(filename, error)) << error;
+    remove(filename.c_str());
+
+    EXPECT_TRUE(loaded.sample_poses.empty());
+    EXPECT_TRUE(loaded.entities.empty());
+    EXPECT_TRUE(loaded.field_distances.empty());
+    EXPECT_FALSE(loaded.has_odom_pose);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(FilterState, RejectMissingFile)
+{
+    FilterState state;
+    std::string error;
+    EXPECT_FALSE(state.load(tempFilename("filter_state_missing"), error));
+    EXPECT_FALSE(error.empty());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(FilterState, RejectTruncated)
+{
+    std::string filename = tempFilename("filter_state_truncated");
+
+    std::string error;
+    ASSERT_TRUE(createState().save(filename, error)) << error;
+    std::string data = readFile(filename);
+    ASSERT_FALSE(data.empty());
+
+    // Empty, inside the header, inside the arrays, and only missing the last byte
+    std::size_t sizes[] = { 0, 7, 40, data.size() / 2, data.size() - 1 };
+    for(unsigned int i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i)
+    {
+        SCOPED_TRACE(sizes[i]);
+        expectRejected(filename, data.substr(0, sizes[i]));
+    }
+
+    // Trailing garbage does not match the size in the header either
+    expectRejected(filename, data + "garbage");
+
+    remove(filename.c_str());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(FilterState, RejectCorrupted)
+{
+    std::string filename = tempFilename("filter_state_corrupted");
+
+    std::string error;
+    ASSERT_TRUE(createState().save(filename, error)) << error;
+    std::string data = readFile(filename);
+    ASSERT_GT(data.size(), 32u);
+
+    // Magic (the header starts with 8 magic characters, followed by the version)
+    {
+        std::string corrupted = data;
+        corrupted[0] = 'X';
+        expectRejected(filename, corrupted);
+    }
+
+    // Version
+    {
+        std::string corrupted = data;
+        corrupted[8] ^= 0x7f;
+        expectRejected(filename, corrupted);
+    }
+
+    // Number of samples (after the magic, version, header size and file size), pointing beyond the file
+    {
+        std::string corrupted = data;
+        uint32_t num_samples = 0xffffffff;
+        corrupted.replace(24, sizeof(num_samples), reinterpret_cast<const char*>(&num_samples), sizeof(num_samples));
+        expectRejected(filename, corrupted);
+    }
+
+    // The file ends with the null-terminated entity ids: without the last terminator, the last id would
+    // run beyond the file
+    {
+        std::string corrupted = data;
+        ASSERT_EQ('\0', corrupted[corrupted.size() - 1]);
+        corrupted[corrupted.size() - 1] = 'X';
+        expectRejected(filename, corrupted);
+    }
+
+    remove(filename.c_str());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
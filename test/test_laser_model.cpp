@@ -0,0 +1,175 @@
+#include "../src/laser_model.h"
+#include "../src/particle_filter.h"
+
+#include <ed/world_model.h>
+#include <ed/update_request.h>
+
+#include <geolib/Box.h>
+
+#include <gtest/gtest.h>
+
+#include <algorithm>
+#include <cmath>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Square room of 10 x 10 m around the origin, with a table
+void createWorld(ed::WorldModel& world)
+{
+    ed::UpdateRequest req;
+
+    req.setShape("wall_south", geo::ShapeConstPtr(new geo::Box(geo::Vector3(-5, -5.1, 0), geo::Vector3(5, -5, 2))));
+    req.setShape("wall_north", geo::ShapeConstPtr(new geo::Box(geo::Vector3(-5, 5, 0), geo::Vector3(5, 5.1, 2))));
+    req.setShape("wall_west", geo::ShapeConstPtr(new geo::Box(geo::Vector3(-5.1, -5, 0), geo::Vector3(-5, 5, 2))));
+    req.setShape("wall_east", geo::ShapeConstPtr(new geo::Box(geo::Vector3(5, -5, 0), geo::Vector3(5.1, 5, 2))));
+    req.setShape("table", geo::ShapeConstPtr(new geo::Box(geo::Vector3(-0.5, -0.4, 0), geo::Vector3(0.5, 0.4, 0.8))));
+
+    req.setPose("wall_south", geo::Pose3D::identity());
+    req.setPose("wall_north", geo::Pose3D::identity());
+    req.setPose("wall_west", geo::Pose3D::identity());
+    req.setPose("wall_east", geo::Pose3D::identity());
+    req.setPose("table", geo::Pose3D(2, 1, 0, 0, 0, 0.5));
+
+    world.update(req);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Scan of the walls of the room, as seen by a laser at 'laser_pose' (the table is left out, which makes
+// some beams disagree with the map)
+sensor_msgs::LaserScan createScan(const geo::Transform2& laser_pose)
+{
+    sensor_msgs::LaserScan scan;
+    scan.header.frame_id = "laser";
+    scan.angle_min = -2;
+    scan.angle_max = 2;
+    scan.angle_increment = 4.0 / 399;
+    scan.range_min = 0.05;
+    scan.range_max = 8;
+
+    for(unsigned int i = 0; i < 400; ++i)
+    {
+        double a = scan.angle_min + i * scan.angle_increment;
+        geo::Vec2 dir = laser_pose.R * geo::Vec2(cos(a), sin(a));
+
+        // Distance to the nearest wall in the beam direction
+        double r = 1e9;
+        if (dir.x > 1e-9)
+            r = std::min(r, (5 - laser_pose.t.x) / dir.x);
+        if (dir.x < -1e-9)
+            r = std::min(r, (-5 - laser_pose.t.x) / dir.x);
+        if (dir.y > 1e-9)
+            r = std::min(r, (5 - laser_pose.t.y) / dir.y);
+        if (dir.y < -1e-9)
+            r = std::min(r, (-5 - laser_pose.t.y) / dir.y);
+
+        // Beyond the maximum range, the laser reports its maximum
+        scan.ranges.push_back(std::min<double>(r, scan.range_max));
+    }
+
+    return scan;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+tue::Configuration createConfig(const std::string& type, int num_threads, bool beam_skip)
+{
+    tue::Configuration config;
+    config.setValue("type", type);
+    config.setValue("num_beams", 200);
+    config.setValue("num_threads", num_threads);
+    config.setValue("z_hit", 0.95);
+    config.setValue("sigma_hit", 0.2);
+    config.setValue("z_short", 0.1);
+    config.setValue("z_max", 0.05);
+    config.setValue("z_rand", 0.05);
+    config.setValue("lambda_short", 0.1);
+    config.setValue("range_max", 10.0);
+    config.setValue("min_particle_distance", 0.01);
+    config.setValue("min_particle_rotation_distance", 0.02);
+    config.setValue("do_beam_skip", beam_skip);
+
+    // The OpenCL backend would score all samples the same way, regardless of the number of threads
+    config.setValue("backend", std::string("cpu"));
+
+    return config;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Updates the weights of the same samples with 1 and with num_threads threads, and checks that the
+// results are identical (every unique sample is scored independently of the others)
+void expectSameWeights(const std::string& type, bool beam_skip, unsigned int num_threads)
+{
+    ed::WorldModel world;
+    createWorld(world);
+
+    geo::Transform2 robot_pose(0.5, -1, 0.3);
+    sensor_msgs::LaserScan scan = createScan(robot_pose * geo::Transform2(0.3, 0, 0));
+
+    std::vector<Scalar> weights[2];
+    for(unsigned int i = 0; i < 2; ++i)
+    {
+        LaserModel laser_model;
+        tue::Configuration config = createConfig(type, i == 0 ? 1 : num_threads, beam_skip);
+        laser_model.configure(config);
+        ASSERT_FALSE(config.hasError()) << config.error();
+
+        // A grid of samples around the true pose
+        ParticleFilter pf;
+        pf.initUniform(robot_pose.t - geo::Vec2(0.3, 0.3), robot_pose.t + geo::Vec2(0.3, 0.3), 0.05,
+                       robot_pose.rotation() - 0.2, robot_pose.rotation() + 0.2, 0.05);
+
+        // The second scan uses the buffers of the first one
+        laser_model.updateWeights(world, scan, pf);
+        laser_model.updateWeights(world, scan, pf);
+
+        ASSERT_GT(laser_model.num_unique_samples(), num_threads);
+        weights[i] = pf.sampleSet().weight;
+    }
+
+    ASSERT_EQ(weights[0].size(), weights[1].size());
+    for(unsigned int j = 0; j < weights[0].size(); ++j)
+        EXPECT_EQ(weights[0][j], weights[1][j]) << "sample " << j;
+
+    // The update was not trivial
+    EXPECT_NE(*std::min_element(weights[0].begin(), weights[0].end()),
+              *std::max_element(weights[0].begin(), weights[0].end()));
+}
+
+} // end namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(LaserModel, BeamModelThreads)
+{
+    expectSameWeights("beam", false, 2);
+    expectSameWeights("beam", false, 4);
+    expectSameWeights("beam", false, 7);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(LaserModel, BeamModelBeamSkipThreads)
+{
+    expectSameWeights("beam", true, 4);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(LaserModel, LikelihoodFieldThreads)
+{
+    expectSameWeights("likelihood_field", false, 4);
+    expectSameWeights("likelihood_field", true, 4);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
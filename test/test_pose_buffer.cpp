@@ -0,0 +1,168 @@
+#include "../src/pose_buffer.h"
+
+#include <gtest/gtest.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+tf::Transform pose2D(double x, double y, double yaw)
+{
+    return tf::Transform(tf::createQuaternionFromYaw(yaw), tf::Vector3(x, y, 0));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void expectPose(const tf::Transform& t, double x, double y, double yaw)
+{
+    EXPECT_NEAR(x, t.getOrigin().x(), 1e-9);
+    EXPECT_NEAR(y, t.getOrigin().y(), 1e-9);
+    EXPECT_NEAR(0, t.getOrigin().z(), 1e-9);
+    EXPECT_NEAR(yaw, tf::getYaw(t.getRotation()), 1e-9);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Poses at t = 1, 2 and 3
+void fill(PoseBuffer& buffer)
+{
+    buffer.insert(ros::Time(1), pose2D(0, 0, 0));
+    buffer.insert(ros::Time(2), pose2D(1, 2, 0.5));
+    buffer.insert(ros::Time(3), pose2D(3, 2, 1.0));
+}
+
+} // end namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(PoseBuffer, Empty)
+{
+    PoseBuffer buffer;
+    EXPECT_TRUE(buffer.empty());
+
+    tf::Transform t;
+    EXPECT_EQ(UNKNOWN_ERROR, buffer.lookup(ros::Time(1), t));
+    EXPECT_EQ(UNKNOWN_ERROR, buffer.lookup(ros::Time(), t));
+
+    ros::Time stamp;
+    EXPECT_FALSE(buffer.latest(stamp, t));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(PoseBuffer, Interpolation)
+{
+    PoseBuffer buffer;
+    fill(buffer);
+
+    tf::Transform t;
+
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(1.5), t));
+    expectPose(t, 0.5, 1, 0.25);
+
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(2.75), t));
+    expectPose(t, 2.5, 2, 0.875);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(PoseBuffer, ExactStamps)
+{
+    PoseBuffer buffer;
+    fill(buffer);
+
+    tf::Transform t;
+
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(1), t));
+    expectPose(t, 0, 0, 0);
+
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(2), t));
+    expectPose(t, 1, 2, 0.5);
+
+    // Exactly the newest entry is not too recent
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(3), t));
+    expectPose(t, 3, 2, 1.0);
+
+    // A zero time returns the newest entry
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(), t));
+    expectPose(t, 3, 2, 1.0);
+
+    ros::Time stamp;
+    ASSERT_TRUE(buffer.latest(stamp, t));
+    EXPECT_EQ(ros::Time(3), stamp);
+    expectPose(t, 3, 2, 1.0);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(PoseBuffer, OutOfRange)
+{
+    PoseBuffer buffer;
+    fill(buffer);
+
+    // The transform is left unchanged
+    tf::Transform t = pose2D(7, 8, 0.1);
+
+    EXPECT_EQ(TOO_OLD, buffer.lookup(ros::Time(0.5), t));
+    EXPECT_EQ(TOO_RECENT, buffer.lookup(ros::Time(3.5), t));
+    expectPose(t, 7, 8, 0.1);
+
+    // A single entry only answers its own stamp
+    PoseBuffer single;
+    single.insert(ros::Time(1), pose2D(1, 1, 0));
+    EXPECT_EQ(TOO_OLD, single.lookup(ros::Time(0.9), t));
+    EXPECT_EQ(TOO_RECENT, single.lookup(ros::Time(1.1), t));
+    EXPECT_EQ(OK, single.lookup(ros::Time(1), t));
+    expectPose(t, 1, 1, 0);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(PoseBuffer, Insert)
+{
+    PoseBuffer buffer;
+    fill(buffer);
+
+    tf::Transform t;
+
+    // Older than the newest entry: ignored
+    buffer.insert(ros::Time(2.5), pose2D(10, 10, 0));
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(2.5), t));
+    expectPose(t, 2, 2, 0.75);
+
+    // Same stamp as the newest entry: replaced
+    buffer.insert(ros::Time(3), pose2D(5, 2, 1.0));
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(3), t));
+    expectPose(t, 5, 2, 1.0);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(PoseBuffer, Capacity)
+{
+    PoseBuffer buffer(2);
+    fill(buffer);
+
+    // The oldest entry was dropped
+    tf::Transform t;
+    EXPECT_EQ(TOO_OLD, buffer.lookup(ros::Time(1.5), t));
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(2.5), t));
+    expectPose(t, 2, 2, 0.75);
+
+    buffer.setCapacity(1);
+    EXPECT_EQ(TOO_OLD, buffer.lookup(ros::Time(2.5), t));
+    ASSERT_EQ(OK, buffer.lookup(ros::Time(3), t));
+    expectPose(t, 3, 2, 1.0);
+
+    buffer.clear();
+    EXPECT_TRUE(buffer.empty());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
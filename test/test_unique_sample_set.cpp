@@ -0,0 +1,176 @@
+#include "../src/unique_sample_set.h"
+#include "../src/random_generator.h"
+
+#include <gtest/gtest.h>
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Reference deduplication: every sample is compared to all unique samples so far, and is mapped to the
+// first one that is within both thresholds
+void bruteForce(const SampleSet& samples, double min_distance, double min_rotation_distance,
+                std::vector<Transform>& unique_samples, std::vector<unsigned int>& sample_to_unique)
+{
+    unique_samples.clear();
+    sample_to_unique.resize(samples.size());
+
+    for(unsigned int i = 0; i < samples.size(); ++i)
+    {
+        Transform t1 = samples.transform(i);
+
+        unsigned int i_unique = unique_samples.size();
+        for(unsigned int j = 0; j < unique_samples.size(); ++j)
+        {
+            const Transform& t2 = unique_samples[j];
+
+            double rot_diff = std::abs(t1.rotation() - t2.rotation());
+            if (rot_diff > M_PI)
+                rot_diff = 2 * M_PI - rot_diff;
+
+            if ((t1.matrix().t - t2.matrix().t).length2() < min_distance * min_distance && rot_diff < min_rotation_distance)
+            {
+                i_unique = j;
+                break;
+            }
+        }
+
+        if (i_unique == unique_samples.size())
+            unique_samples.push_back(t1);
+
+        sample_to_unique[i] = i_unique;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Samples uniformly in [x_min, x_max] x [y_min, y_max] x [yaw_min, yaw_max]
+void createSamples(RandomGenerator& rng, unsigned int n, double x_min, double x_max, double y_min, double y_max,
+                   double yaw_min, double yaw_max, SampleSet& samples)
+{
+    samples.clear();
+    for(unsigned int i = 0; i < n; ++i)
+    {
+        double x = x_min + rng.uniform() * (x_max - x_min);
+        double y = y_min + rng.uniform() * (y_max - y_min);
+        double yaw = yaw_min + rng.uniform() * (yaw_max - yaw_min);
+        samples.push_back(geo::Transform2(x, y, yaw), 1.0 / n);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void expectEqualToBruteForce(UniqueSampleSet& unique_samples, const SampleSet& samples, double min_distance,
+                             double min_rotation_distance)
+{
+    std::vector<Transform> expected_samples;
+    std::vector<unsigned int> expected_sample_to_unique;
+    bruteForce(samples, min_distance, min_rotation_distance, expected_samples, expected_sample_to_unique);
+
+    unique_samples.update(samples, min_distance, min_rotation_distance);
+
+    ASSERT_EQ(expected_samples.size(), unique_samples.size());
+    EXPECT_EQ(expected_sample_to_unique, unique_samples.sampleToUnique());
+
+    for(unsigned int i = 0; i < expected_samples.size(); ++i)
+    {
+        EXPECT_EQ(expected_samples[i].translation().x, unique_samples[i].translation().x);
+        EXPECT_EQ(expected_samples[i].translation().y, unique_samples[i].translation().y);
+        EXPECT_EQ(expected_samples[i].rotation(), unique_samples[i].rotation());
+    }
+}
+
+} // end namespace
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(UniqueSampleSet, DenseSamples)
+{
+    RandomGenerator rng(1);
+    UniqueSampleSet unique_samples;
+    SampleSet samples;
+
+    // Many samples per cell, over the full circle (including the wrap-around at +/- pi)
+    createSamples(rng, 3000, 0, 0.5, 0, 0.5, -M_PI, M_PI, samples);
+    expectEqualToBruteForce(unique_samples, samples, 0.05, 0.05);
+
+    // Concentrated around the wrap-around
+    createSamples(rng, 3000, -0.2, 0.2, -0.2, 0.2, M_PI - 0.1, M_PI + 0.1, samples);
+    expectEqualToBruteForce(unique_samples, samples, 0.05, 0.05);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(UniqueSampleSet, SparseSamples)
+{
+    RandomGenerator rng(2);
+    UniqueSampleSet unique_samples;
+    SampleSet samples;
+
+    // Including negative coordinates, far from the origin
+    createSamples(rng, 3000, -50, -40, 20, 25, -M_PI, M_PI, samples);
+    expectEqualToBruteForce(unique_samples, samples, 0.1, 0.2);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(UniqueSampleSet, FewAngleCells)
+{
+    RandomGenerator rng(3);
+    UniqueSampleSet unique_samples;
+    SampleSet samples;
+
+    // With a rotation threshold this large, there are less than three angle cells
+    double rotation_distances[] = { 2.5, 4.0, 7.0 };
+    for(unsigned int i = 0; i < 3; ++i)
+    {
+        SCOPED_TRACE(rotation_distances[i]);
+        createSamples(rng, 1000, 0, 1, 0, 1, -M_PI, M_PI, samples);
+        expectEqualToBruteForce(unique_samples, samples, 0.1, rotation_distances[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(UniqueSampleSet, Reuse)
+{
+    RandomGenerator rng(4);
+    UniqueSampleSet unique_samples;
+    SampleSet samples;
+
+    // The same instance is updated with sets of different sizes and thresholds
+    for(unsigned int i = 0; i < 10; ++i)
+    {
+        SCOPED_TRACE(i);
+        createSamples(rng, 200 * (i % 4 + 1), 0, 1 + i, 0, 1, -M_PI, M_PI, samples);
+        expectEqualToBruteForce(unique_samples, samples, 0.02 * (i + 1), 0.03 * (i + 1));
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+TEST(UniqueSampleSet, Disabled)
+{
+    RandomGenerator rng(5);
+    UniqueSampleSet unique_samples;
+    SampleSet samples;
+    createSamples(rng, 100, 0, 0.01, 0, 0.01, 0, 0.01, samples);
+
+    // If one of the thresholds is not positive, every sample is unique
+    unique_samples.update(samples, 0, 0.1);
+    ASSERT_EQ(samples.size(), unique_samples.size());
+    for(unsigned int i = 0; i < samples.size(); ++i)
+        EXPECT_EQ(i, unique_samples.sampleToUnique()[i]);
+
+    unique_samples.update(samples, 0.1, 0);
+    EXPECT_EQ(samples.size(), unique_samples.size());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
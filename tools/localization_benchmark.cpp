@@ -0,0 +1,507 @@
+// Offline replay benchmark for the localization pipeline. Feeds the laser scans and TF of a rosbag, together
+// with a fixed world model, through the LaserModel, OdomModel and ParticleFilter, and reports the throughput,
+// the latency per stage, the number of heap allocations in the sensor update and (if a ground truth frame
+// is given) the pose error. Exits with a non-zero status if the sensor update allocates after the warm-up.
+//
+// Usage:
+//
+//     localization_benchmark CONFIG.yaml
+//
+// Example configuration:
+//
+//     bag: /path/to/recording.bag
+//     scan_topic: /amigo/base_laser/scan
+//     ground_truth_frame: /amigo/base_link_ground_truth    # optional, expressed in map_frame
+//     num_particles: 500
+//     num_warmup_scans: 10                                  # optional, scans not counted for the allocations
+//     initial_pose: { x: 0, y: 0, rz: 0 }
+//     odom_model: { map_frame: /map, odom_frame: /amigo/odom, base_link_frame: /amigo/base_link, alpha1: 0.2, ... }
+//     laser_model: { num_beams: 100, ... }
+//     world:
+//     - { id: wall1, min: { x: -5, y: -5.1, z: 0 }, max: { x: 5, y: -5, z: 2 } }
+//     - { id: table, pose: { x: 1, y: 2, z: 0, rz: 0.5 }, min: { x: -0.5, y: -0.4, z: 0 }, max: { x: 0.5, y: 0.4, z: 0.8 } }
+//
+// The world consists of boxes: 'min' and 'max' are the box corners relative to the (optional) pose.
+
+#include "../src/particle_filter.h"
+#include "../src/odom_model.h"
+#include "../src/laser_model.h"
+#include "../src/rolling_statistics.h"
+
+#include <ed/world_model.h>
+#include <ed/update_request.h>
+
+#include <geolib/Box.h>
+#include <geolib/ros/tf_conversions.h>
+
+#include <tue/config/configuration.h>
+#include <tue/profiling/timer.h>
+
+#include <rosbag/bag.h>
+#include <rosbag/view.h>
+
+#include <tf/transform_listener.h>
+#include <tf/tfMessage.h>
+
+#include <sensor_msgs/LaserScan.h>
+
+#include <iostream>
+#include <iomanip>
+
+#include <cstdlib>
+#include <new>
+
+// ----------------------------------------------------------------------------------------------------
+
+// Counts all heap allocations of the process, such that the allocations of the sensor update can be
+// measured. All (array and nothrow) variants are replaced, such that no allocation passes the counter.
+
+#if __cplusplus >= 201103L
+#define ED_LOCALIZATION_THROW_BAD_ALLOC
+#else
+#define ED_LOCALIZATION_THROW_BAD_ALLOC throw(std::bad_alloc)
+#endif
+
+static unsigned long num_allocations = 0;
+
+static void* countedAlloc(std::size_t size)
+{
+    __sync_fetch_and_add(&num_allocations, 1);
+    return std::malloc(size == 0 ? 1 : size);
+}
+
+void* operator new(std::size_t size) ED_LOCALIZATION_THROW_BAD_ALLOC
+{
+    void* p = countedAlloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new[](std::size_t size) ED_LOCALIZATION_THROW_BAD_ALLOC
+{
+    void* p = countedAlloc(size);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) throw()
+{
+    return countedAlloc(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) throw()
+{
+    return countedAlloc(size);
+}
+
+void operator delete(void* p) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void* p) throw()
+{
+    std::free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) throw()
+{
+    std::free(p);
+}
+
+void operator delete[](void* p, const std::nothrow_t&) throw()
+{
+    std::free(p);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+enum Stage
+{
+    STAGE_TF,
+    STAGE_MOTION,
+    STAGE_DEDUP,
+    STAGE_RENDER,
+    STAGE_SCORING,
+    STAGE_RESAMPLE,
+    STAGE_TOTAL,
+    NUM_STAGES
+};
+
+const char* STAGE_NAMES[] = { "tf", "motion", "dedup", "render", "scoring", "resample", "total" };
+
+// ----------------------------------------------------------------------------------------------------
+
+geo::Transform2 toTransform2(const geo::Pose3D& p)
+{
+    return geo::Transform2(geo::Mat2(p.R.xx, p.R.xy, p.R.yx, p.R.yy), geo::Vec2(p.t.x, p.t.y));
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool lookupTransform(const tf::Transformer& tf, const std::string& target_frame, const std::string& source_frame,
+                     const ros::Time& time, geo::Pose3D& pose)
+{
+    try
+    {
+        tf::StampedTransform t;
+        tf.lookupTransform(target_frame, source_frame, time, t);
+        geo::convert(t, pose);
+        return true;
+    }
+    catch(tf::TransformException& ex)
+    {
+        return false;
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool loadWorld(tue::Configuration& config, ed::WorldModel& world)
+{
+    ed::UpdateRequest req;
+
+    if (config.readArray("world", tue::config::REQUIRED))
+    {
+        while(config.nextArrayItem())
+        {
+            std::string id;
+            config.value("id", id);
+
+            geo::Pose3D pose = geo::Pose3D::identity();
+            if (config.readGroup("pose", tue::config::OPTIONAL))
+            {
+                double x = 0, y = 0, z = 0, rz = 0;
+                config.value("x", x, tue::config::OPTIONAL);
+                config.value("y", y, tue::config::OPTIONAL);
+                config.value("z", z, tue::config::OPTIONAL);
+                config.value("rz", rz, tue::config::OPTIONAL);
+                pose = geo::Pose3D(x, y, z, 0, 0, rz);
+                config.endGroup();
+            }
+
+            geo::Vector3 min, max;
+            if (config.readGroup("min"))
+            {
+                config.value("x", min.x);
+                config.value("y", min.y);
+                config.value("z", min.z);
+                config.endGroup();
+            }
+
+            if (config.readGroup("max"))
+            {
+                config.value("x", max.x);
+                config.value("y", max.y);
+                config.value("z", max.z);
+                config.endGroup();
+            }
+
+            req.setShape(id, geo::ShapeConstPtr(new geo::Box(min, max)));
+            req.setPose(id, pose);
+        }
+
+        config.endArray();
+    }
+
+    if (config.hasError())
+        return false;
+
+    world.update(req);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void printStatistics(const std::string& name, const RollingStatistics& stats)
+{
+    std::cout << "    " << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(3)
+              << "mean: " << std::setw(9) << stats.mean()
+              << "   p50: " << std::setw(9) << stats.percentile(0.5)
+              << "   p90: " << std::setw(9) << stats.percentile(0.9)
+              << "   p99: " << std::setw(9) << stats.percentile(0.99)
+              << "   max: " << std::setw(9) << stats.max() << std::endl;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        std::cout << "Usage: localization_benchmark CONFIG.yaml" << std::endl;
+        return 1;
+    }
+
+    tue::Configuration config;
+    if (!config.loadFromYAMLFile(argv[1]))
+    {
+        std::cerr << config.error() << std::endl;
+        return 1;
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Configure
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::string bag_filename, scan_topic, ground_truth_frame;
+    config.value("bag", bag_filename);
+    config.value("scan_topic", scan_topic);
+    config.value("ground_truth_frame", ground_truth_frame, tue::config::OPTIONAL);
+
+    int num_particles = 500;
+    config.value("num_particles", num_particles, tue::config::OPTIONAL);
+
+    std::string map_frame_id, odom_frame_id, base_link_frame_id;
+
+    OdomModel odom_model;
+    if (config.readGroup("odom_model", tue::config::REQUIRED))
+    {
+        config.value("map_frame", map_frame_id);
+        config.value("odom_frame", odom_frame_id);
+        config.value("base_link_frame", base_link_frame_id);
+
+        odom_model.configure(config);
+        config.endGroup();
+    }
+
+    LaserModel laser_model;
+    if (config.readGroup("laser_model", tue::config::REQUIRED))
+    {
+        laser_model.configure(config);
+        config.endGroup();
+    }
+
+    geo::Vec2 p(0, 0);
+    double yaw = 0;
+    if (config.readGroup("initial_pose", tue::config::OPTIONAL))
+    {
+        config.value("x", p.x);
+        config.value("y", p.y);
+        config.value("rz", yaw);
+        config.endGroup();
+    }
+
+    ed::WorldModel world;
+    if (!loadWorld(config, world) || config.hasError())
+    {
+        std::cerr << config.error() << std::endl;
+        return 1;
+    }
+
+    ParticleFilter particle_filter;
+    particle_filter.initUniform(p - geo::Vec2(0.3, 0.3), p + geo::Vec2(0.3, 0.3), 0.05,
+                                yaw - 0.1, yaw + 0.1, 0.05);
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Load TF
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    rosbag::Bag bag;
+    try
+    {
+        bag.open(bag_filename, rosbag::bagmode::Read);
+    }
+    catch(rosbag::BagException& ex)
+    {
+        std::cerr << "Could not open bag '" << bag_filename << "': " << ex.what() << std::endl;
+        return 1;
+    }
+
+    // All TF data is loaded up front, such that every scan can be processed as soon as it is read
+    rosbag::View tf_view(bag, rosbag::TopicQuery("/tf"));
+    tf::Transformer tf_transformer(true, ros::Duration((tf_view.getEndTime() - tf_view.getBeginTime()).toSec() + 1));
+
+    for(rosbag::View::iterator it = tf_view.begin(); it != tf_view.end(); ++it)
+    {
+        tf::tfMessageConstPtr tf_msg = it->instantiate<tf::tfMessage>();
+        if (!tf_msg)
+            continue;
+
+        for(unsigned int i = 0; i < tf_msg->transforms.size(); ++i)
+        {
+            tf::StampedTransform t;
+            tf::transformStampedMsgToTF(tf_msg->transforms[i], t);
+            tf_transformer.setTransform(t);
+        }
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Replay scans
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    rosbag::View scan_view(bag, rosbag::TopicQuery(scan_topic));
+
+    unsigned int window_size = std::max<unsigned int>(1, scan_view.size());
+
+    std::vector<RollingStatistics> stage_stats(NUM_STAGES, RollingStatistics(window_size));
+    RollingStatistics unique_samples_stats(window_size);
+    RollingStatistics allocation_stats(window_size);
+
+    // The first scans size the buffers of the laser model, so they are not counted as steady state
+    int num_warmup_scans = 10;
+    config.value("num_warmup_scans", num_warmup_scans, tue::config::OPTIONAL);
+    unsigned int num_allocating_scans = 0;
+    RollingStatistics translation_error_stats(window_size);
+    RollingStatistics rotation_error_stats(window_size);
+
+    bool laser_offset_initialized = false;
+    bool have_previous_pose = false;
+    geo::Pose3D previous_pose;
+
+    unsigned int num_scans = 0;
+    unsigned int num_skipped = 0;
+
+    tue::Timer total_timer;
+    total_timer.start();
+
+    for(rosbag::View::iterator it = scan_view.begin(); it != scan_view.end(); ++it)
+    {
+        sensor_msgs::LaserScanConstPtr scan = it->instantiate<sensor_msgs::LaserScan>();
+        if (!scan)
+            continue;
+
+        tue::Timer timer;
+        timer.start();
+        double t_last = 0;
+
+        if (!laser_offset_initialized)
+        {
+            geo::Pose3D p_laser;
+            if (!lookupTransform(tf_transformer, base_link_frame_id, scan->header.frame_id, scan->header.stamp, p_laser))
+            {
+                ++num_skipped;
+                continue;
+            }
+
+            geo::Transform2 offset = toTransform2(p_laser);
+
+            bool upside_down = p_laser.R.zz < 0;
+            if (upside_down)
+            {
+                offset.R.yx = -offset.R.yx;
+                offset.R.yy = -offset.R.yy;
+            }
+
+            laser_model.setLaserOffset(offset, p_laser.t.z, upside_down);
+            laser_offset_initialized = true;
+        }
+
+        geo::Pose3D odom_to_base_link;
+        if (!lookupTransform(tf_transformer, odom_frame_id, base_link_frame_id, scan->header.stamp, odom_to_base_link))
+        {
+            ++num_skipped;
+            continue;
+        }
+
+        Transform movement;
+        if (have_previous_pose)
+            movement.set(toTransform2(previous_pose.inverse() * odom_to_base_link));
+        else
+            movement.set(geo::Transform2::identity());
+
+        previous_pose = odom_to_base_link;
+        have_previous_pose = true;
+
+        double t = timer.getElapsedTimeInMilliSec();
+        stage_stats[STAGE_TF].add(t - t_last);
+        t_last = t;
+
+        // Motion
+        odom_model.updatePoses(movement, 0, particle_filter);
+
+        t = timer.getElapsedTimeInMilliSec();
+        stage_stats[STAGE_MOTION].add(t - t_last);
+        t_last = t;
+
+        // Sensor
+        unsigned long num_allocations_before = num_allocations;
+        laser_model.updateWeights(world, *scan, particle_filter);
+        unsigned long num_sensor_allocations = num_allocations - num_allocations_before;
+
+        if ((int)num_scans >= num_warmup_scans)
+        {
+            allocation_stats.add(num_sensor_allocations);
+            if (num_sensor_allocations > 0)
+                ++num_allocating_scans;
+        }
+
+        stage_stats[STAGE_DEDUP].add(laser_model.time_dedup());
+        stage_stats[STAGE_RENDER].add(laser_model.time_render());
+        stage_stats[STAGE_SCORING].add(laser_model.time_scoring());
+        unique_samples_stats.add(laser_model.num_unique_samples());
+        t_last = timer.getElapsedTimeInMilliSec();
+
+        // Resample
+        particle_filter.resample(num_particles);
+        geo::Transform2 mean_pose = particle_filter.calculateClusters().front().mean;
+
+        t = timer.getElapsedTimeInMilliSec();
+        stage_stats[STAGE_RESAMPLE].add(t - t_last);
+        stage_stats[STAGE_TOTAL].add(t);
+
+        ++num_scans;
+
+        // Compare to ground truth
+        geo::Pose3D ground_truth;
+        if (!ground_truth_frame.empty()
+                && lookupTransform(tf_transformer, map_frame_id, ground_truth_frame, scan->header.stamp, ground_truth))
+        {
+            geo::Transform2 gt = toTransform2(ground_truth);
+            double rot_error = std::abs(mean_pose.rotation() - gt.rotation());
+            if (rot_error > M_PI)
+                rot_error = 2 * M_PI - rot_error;
+
+            translation_error_stats.add((mean_pose.t - gt.t).length());
+            rotation_error_stats.add(rot_error);
+        }
+    }
+
+    double total_time = total_timer.getElapsedTimeInSec();
+
+    bag.close();
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // -     Report
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+
+    std::cout << "Scans processed:  " << num_scans << " (" << num_skipped << " skipped, no TF)" << std::endl;
+    std::cout << "Total time:       " << total_time << " s" << std::endl;
+    if (total_time > 0)
+        std::cout << "Throughput:       " << num_scans / total_time << " scans/s" << std::endl;
+
+    std::cout << std::endl << "Latency per stage [ms]:" << std::endl;
+    for(unsigned int i = 0; i < NUM_STAGES; ++i)
+        printStatistics(STAGE_NAMES[i], stage_stats[i]);
+
+    std::cout << std::endl << "Unique samples:" << std::endl;
+    printStatistics("unique", unique_samples_stats);
+
+    if (!allocation_stats.empty())
+    {
+        std::cout << std::endl << "Heap allocations in the sensor update (after " << num_warmup_scans << " scans):" << std::endl;
+        printStatistics("allocs", allocation_stats);
+
+        if (num_allocating_scans > 0)
+            std::cout << "FAILED: the sensor update allocated in " << num_allocating_scans << " of "
+                      << allocation_stats.size() << " scans after the warm-up" << std::endl;
+        else
+            std::cout << "OK: no allocations in the sensor update after the warm-up" << std::endl;
+    }
+
+    if (!translation_error_stats.empty())
+    {
+        std::cout << std::endl << "Pose error (" << translation_error_stats.size() << " scans):" << std::endl;
+        printStatistics("trans [m]", translation_error_stats);
+        printStatistics("rot [rad]", rotation_error_stats);
+    }
+
+    return num_allocating_scans > 0 ? 1 : 0;
+}